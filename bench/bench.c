@@ -0,0 +1,504 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "corpus.h"
+#include "log.h"
+#include "ops.h"
+#include "tagfs.h"
+
+#define MAX_THREADS 256
+
+/* a request of the loop scenario, waiting for a worker */
+struct request {
+    struct request *next;
+    unsigned thread;
+    size_t i;
+    int rc;
+    int done;
+};
+
+/* workers taking requests in order, as those of the FUSE loop do */
+struct loop {
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    struct request *head, **tail;
+    int stopping;
+    pthread_t workers[MAX_THREADS];
+    unsigned nworkers;
+};
+
+struct ctx {
+    struct corpus corpus;
+    uint64_t rng[MAX_THREADS];
+    unsigned run;
+    size_t bs;
+    size_t blocks;
+    char *buf[MAX_THREADS];
+    struct fuse_file_info fi[MAX_THREADS];
+    struct loop loop;
+};
+
+static int op_getattr(void *_ctx, unsigned thread, size_t i) {
+    (void)i;
+    struct ctx *ctx = _ctx;
+    char path[4096];
+    struct stat st;
+
+    size_t f = bench_rand(&ctx->rng[thread]) % ctx->corpus.params.nfiles;
+    if (corpus_file_path(&ctx->corpus, f, path, sizeof path) < 0)
+        return -1;
+    return tagfs_ops.getattr(path, &st, NULL);
+}
+
+static int list_dir(void *_ctx, unsigned thread, enum fuse_readdir_flags flags) {
+    struct ctx *ctx = _ctx;
+    char path[4096];
+    size_t count = 0;
+
+    /* the tags of a random file, so the deepest directory containing it */
+    size_t f = bench_rand(&ctx->rng[thread]) % ctx->corpus.params.nfiles;
+    int len = corpus_file_path(&ctx->corpus, f, path, sizeof path);
+    if (len < 0)
+        return -1;
+    *strrchr(path, '/') = '\0';
+    if (path[0] == '\0')
+        strcpy(path, "/");
+
+    int rc = tagfs_ops.readdir(path, &count, bench_count_filler, 0, NULL, flags);
+    if (rc < 0)
+        return rc;
+    return count > 0 ? 0 : -1;
+}
+
+static int op_readdir(void *ctx, unsigned thread, size_t i) {
+    (void)i;
+    return list_dir(ctx, thread, 0);
+}
+
+/* as libfuse asks by default, with the attributes of files */
+static int op_readdirplus(void *ctx, unsigned thread, size_t i) {
+    (void)i;
+    return list_dir(ctx, thread, FUSE_READDIR_PLUS);
+}
+
+static int op_open(void *_ctx, unsigned thread, size_t i) {
+    (void)i;
+    struct ctx *ctx = _ctx;
+    char path[4096];
+    struct fuse_file_info fi = { .flags = O_RDONLY };
+
+    size_t f = bench_rand(&ctx->rng[thread]) % ctx->corpus.params.nfiles;
+    if (corpus_file_path(&ctx->corpus, f, path, sizeof path) < 0)
+        return -1;
+    int rc = tagfs_ops.open(path, &fi);
+    if (rc < 0)
+        return rc;
+    return tagfs_ops.release(path, &fi);
+}
+
+static int op_create(void *_ctx, unsigned thread, size_t i) {
+    struct ctx *ctx = _ctx;
+    char path[4096];
+    struct fuse_file_info fi = { .flags = O_RDWR | O_CREAT };
+
+    size_t t = corpus_zipf(&ctx->corpus, &ctx->rng[thread]);
+    snprintf(path, sizeof path, "/%s/bench-create-%u-%u-%zu",
+             ctx->corpus.tags[t], ctx->run, thread, i);
+    int rc = tagfs_ops.create(path, 0644, &fi);
+    if (rc < 0)
+        return rc;
+    return tagfs_ops.release(path, &fi);
+}
+
+static int op_write(void *_ctx, unsigned thread, size_t i) {
+    struct ctx *ctx = _ctx;
+    off_t off = (off_t)(i % ctx->blocks) * ctx->bs;
+    int rc = tagfs_ops.write(NULL, ctx->buf[thread], ctx->bs, off, &ctx->fi[thread]);
+    return rc == (int)ctx->bs ? 0 : -1;
+}
+
+static int op_read(void *_ctx, unsigned thread, size_t i) {
+    struct ctx *ctx = _ctx;
+    off_t off = (off_t)(i % ctx->blocks) * ctx->bs;
+    int rc = tagfs_ops.read(NULL, ctx->buf[thread], ctx->bs, off, &ctx->fi[thread]);
+    return rc == (int)ctx->bs ? 0 : -1;
+}
+
+#define LANES_READS_PER_READDIR 100
+
+/* even threads list the files of the two most popular tags, odd ones read */
+static int op_lanes(void *_ctx, unsigned thread, size_t i) {
+    struct ctx *ctx = _ctx;
+    char path[4096];
+    size_t count = 0;
+
+    if (thread % 2)
+        return op_read(ctx, thread, i);
+
+    snprintf(path, sizeof path, "/%s/%s", ctx->corpus.tags[0],
+             ctx->corpus.tags[1 % ctx->corpus.params.ntags]);
+    int rc = tagfs_ops.readdir(path, &count, bench_count_filler, 0, NULL, 0);
+    return rc < 0 ? rc : 0;
+}
+
+static void *loop_worker(void *_ctx) {
+    struct ctx *ctx = _ctx;
+    struct loop *l = &ctx->loop;
+
+    pthread_mutex_lock(&l->lock);
+    for (;;) {
+        while (!l->head && !l->stopping)
+            pthread_cond_wait(&l->work, &l->lock);
+        struct request *r = l->head;
+        if (!r)
+            break;
+        l->head = r->next;
+        if (!l->head)
+            l->tail = &l->head;
+        pthread_mutex_unlock(&l->lock);
+
+        int rc = op_lanes(ctx, r->thread, r->i);
+
+        pthread_mutex_lock(&l->lock);
+        r->rc = rc;
+        r->done = 1;
+        pthread_cond_broadcast(&l->done);
+    }
+    pthread_mutex_unlock(&l->lock);
+    return NULL;
+}
+
+/* as op_lanes(), from the threads standing for applications, run by the workers */
+static int op_loop(void *_ctx, unsigned thread, size_t i) {
+    struct ctx *ctx = _ctx;
+    struct loop *l = &ctx->loop;
+    struct request r = { .thread = thread, .i = i };
+
+    pthread_mutex_lock(&l->lock);
+    *l->tail = &r;
+    l->tail = &r.next;
+    pthread_cond_signal(&l->work);
+    while (!r.done)
+        pthread_cond_wait(&l->done, &l->lock);
+    pthread_mutex_unlock(&l->lock);
+    return r.rc;
+}
+
+static void loop_start(struct ctx *ctx, unsigned workers) {
+    struct loop *l = &ctx->loop;
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->work, NULL);
+    pthread_cond_init(&l->done, NULL);
+    l->head = NULL;
+    l->tail = &l->head;
+    l->stopping = 0;
+    l->nworkers = workers;
+    for (unsigned i = 0; i < workers; i++) {
+        int rc = pthread_create(&l->workers[i], NULL, loop_worker, ctx);
+        assert(rc == 0);
+    }
+    /* as a mount with max_threads, for the lanes to leave workers to reads */
+    tagfs.max_workers = workers;
+}
+
+static void loop_stop(struct ctx *ctx) {
+    struct loop *l = &ctx->loop;
+    pthread_mutex_lock(&l->lock);
+    l->stopping = 1;
+    pthread_cond_broadcast(&l->work);
+    pthread_mutex_unlock(&l->lock);
+    for (unsigned i = 0; i < l->nworkers; i++)
+        pthread_join(l->workers[i], NULL);
+    pthread_cond_destroy(&l->done);
+    pthread_cond_destroy(&l->work);
+    pthread_mutex_destroy(&l->lock);
+    tagfs.max_workers = 0;
+}
+
+static int rw_open(struct ctx *ctx, unsigned threads) {
+    char path[4096];
+    for (unsigned t = 0; t < threads; t++) {
+        snprintf(path, sizeof path, "/%s/bench-rw-%u-%u",
+                 ctx->corpus.tags[0], ctx->run, t);
+        ctx->fi[t] = (struct fuse_file_info){ .flags = O_RDWR | O_CREAT };
+        int rc = tagfs_ops.create(path, 0644, &ctx->fi[t]);
+        if (rc < 0) {
+            log_err("create %s: %s\n", path, strerror(-rc));
+            return -1;
+        }
+        ctx->buf[t] = malloc(ctx->bs);
+        assert(ctx->buf[t] != NULL);
+        memset(ctx->buf[t], 'a' + t % 26, ctx->bs);
+        for (size_t b = 0; b < ctx->blocks; b++)
+            if (op_write(ctx, t, b) < 0)
+                return -1;
+    }
+    return 0;
+}
+
+static void rw_close(struct ctx *ctx, unsigned threads) {
+    for (unsigned t = 0; t < threads; t++) {
+        tagfs_ops.release(NULL, &ctx->fi[t]);
+        free(ctx->buf[t]);
+        ctx->buf[t] = NULL;
+    }
+}
+
+static void usage(const char *argv0) {
+    printf("usage: %s [options]\n"
+           "\n"
+           "    -n N        number of files in the corpus (10000)\n"
+           "    -m M        number of tags in the corpus (100)\n"
+           "    -z S        Zipf exponent of tag popularity (1.0)\n"
+           "    -d D        maximum number of tags per file (4)\n"
+           "    -p P        parameter of the geometric tags-per-file distribution (0.5)\n"
+           "    -t T,...    thread counts to run each scenario with (1,4)\n"
+           "    -o N        operations per thread (10000)\n"
+           "    -b B        block size of read/write scenarios (4096)\n"
+           "    -w MIB      file size per thread of read/write scenarios (16)\n"
+           "    -c          store the files of read/write scenarios compressed\n"
+           "    -y LEVEL    durability: strict, group or relaxed (strict)\n"
+           "    -M N        metadata ops run at once (CPUs - 1), -1 for no limit\n"
+           "    -A N        data ops run at once (0, no limit)\n"
+           "    -L KIB      memory for cached listings (4096), -1 for none\n"
+           "    -W KIB      gather small writes in buffers of KIB per file (0, none)\n"
+           "    -T N        workers of the loop scenario, as -o max_threads (10)\n"
+           "    -s S,...    scenarios: getattr,readdir,readdirplus,open,create,write,\n"
+           "                read,lanes,loop (all)\n"
+           "    -D DIR      use DIR as datadir instead of a temporary one\n"
+           "    -r          mount DIR read-only as a replica, the corpus being\n"
+           "                loaded already with the same -n, -m, -z, -d, -p and -S;\n"
+           "                only getattr, readdir, readdirplus and open run\n"
+           "    -k          keep the temporary datadir\n"
+           "    -S SEED     random seed (1)\n"
+           "\n"
+           "Results are printed as one JSON object per line. Threads call the\n"
+           "ops directly, without a FUSE loop, so with -t they stand for its\n"
+           "workers, and lanes reports the caps of -M and -A only. In loop,\n"
+           "they stand for applications instead, running the ops of lanes\n"
+           "through a queue served by the -T workers, and the latencies include\n"
+           "waiting for a free worker.\n",
+           argv0);
+}
+
+static int has_scenario(const char *list, const char *name) {
+    size_t len = strlen(name);
+    for (const char *s = list; s; s = strchr(s, ',')) {
+        if (*s == ',')
+            s++;
+        if (strncmp(s, name, len) == 0 && (s[len] == ',' || s[len] == '\0'))
+            return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct corpus_params params = {
+        .nfiles = 10000,
+        .ntags = 100,
+        .zipf = 1.0,
+        .maxdepth = 4,
+        .depth_p = 0.5,
+        .seed = 1,
+    };
+    const char *threads_list = "1,4";
+    const char *scenarios = "getattr,readdir,readdirplus,open,create,write,read,lanes,loop";
+    const char *datadir = NULL;
+    int explicit_scenarios = 0;
+    size_t ops = 10000, bs = 4096, mib = 16;
+    unsigned workers = 10;
+    int keep = 0, opt;
+
+    fuse_set_log_func(log_fuse);
+
+    while ((opt = getopt(argc, argv, "n:m:z:d:p:t:o:b:w:cy:M:A:L:W:T:s:D:rkS:h")) != -1) {
+        switch (opt) {
+        case 'n': params.nfiles = strtoull(optarg, NULL, 0); break;
+        case 'm': params.ntags = strtoull(optarg, NULL, 0); break;
+        case 'z': params.zipf = strtod(optarg, NULL); break;
+        case 'd': params.maxdepth = strtoul(optarg, NULL, 0); break;
+        case 'p': params.depth_p = strtod(optarg, NULL); break;
+        case 't': threads_list = optarg; break;
+        case 'o': ops = strtoull(optarg, NULL, 0); break;
+        case 'b': bs = strtoull(optarg, NULL, 0); break;
+        case 'w': mib = strtoull(optarg, NULL, 0); break;
+        case 'c': tagfs.compress = 1; break;
+        case 'y': tagfs.durability = optarg; break;
+        case 'M': tagfs.meta_threads = strtol(optarg, NULL, 0); break;
+        case 'A': tagfs.data_threads = strtol(optarg, NULL, 0); break;
+        case 'L': tagfs.listing_cache = strtol(optarg, NULL, 0); break;
+        case 'W': tagfs.write_behind = strtol(optarg, NULL, 0); break;
+        case 'T': workers = strtoul(optarg, NULL, 0); break;
+        case 's': scenarios = optarg; explicit_scenarios = 1; break;
+        case 'D': datadir = optarg; break;
+        case 'r': tagfs.ro = 1; break;
+        case 'k': keep = 1; break;
+        case 'S': params.seed = strtoull(optarg, NULL, 0); break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (params.nfiles == 0 || params.ntags == 0 || params.maxdepth == 0
+        || params.maxdepth > params.ntags || params.maxdepth > 255 || bs == 0) {
+        log_err("invalid corpus parameters\n");
+        return 1;
+    }
+    if (workers == 0 || workers > MAX_THREADS) {
+        log_err("invalid worker count\n");
+        return 1;
+    }
+    if (tagfs.ro) {
+        if (!datadir) {
+            log_err("-r needs -D\n");
+            return 1;
+        }
+        if (!explicit_scenarios)
+            scenarios = "getattr,readdir,readdirplus,open";
+        if (has_scenario(scenarios, "create") || has_scenario(scenarios, "write")
+            || has_scenario(scenarios, "read") || has_scenario(scenarios, "lanes")
+            || has_scenario(scenarios, "loop")) {
+            log_err("replicas only run getattr, readdir, readdirplus and open\n");
+            return 1;
+        }
+    }
+
+    struct ctx *ctx = calloc(1, sizeof *ctx);
+    assert(ctx != NULL);
+    ctx->bs = bs;
+    ctx->blocks = mib * 1024 * 1024 / bs;
+    if (ctx->blocks == 0)
+        ctx->blocks = 1;
+
+    if (corpus_generate(&ctx->corpus, &params) < 0) {
+        log_err("cannot generate corpus\n");
+        return 1;
+    }
+
+    if (bench_setup(datadir) < 0) {
+        log_err("cannot set up datadir\n");
+        return 1;
+    }
+
+    printf("{\"bench\":\"yatagfs\",\"files\":%zu,\"tags\":%zu,\"zipf\":%.3f,"
+           "\"maxdepth\":%u,\"depth_p\":%.3f,\"ops_per_thread\":%zu,\"bs\":%zu,"
+           "\"compress\":%s,\"durability\":\"%s\",\"meta_threads\":%d,"
+           "\"data_threads\":%d,\"listing_cache\":%d,\"write_behind\":%d,\"replica\":%s,"
+           "\"loop_workers\":%u,\"seed\":%" PRIu64 "}\n",
+           params.nfiles, params.ntags, params.zipf, params.maxdepth,
+           params.depth_p, ops, bs, tagfs.compress ? "true" : "false",
+           tagfs.durability ? tagfs.durability : "strict", tagfs.meta_threads,
+           tagfs.data_threads, tagfs.listing_cache, tagfs.write_behind,
+           tagfs.ro ? "true" : "false", workers, params.seed);
+
+    struct bench_result res;
+    uint64_t t = bench_now_ns();
+    if (!tagfs.ro) {
+        if (corpus_load(&ctx->corpus) < 0) {
+            log_err("cannot load corpus\n");
+            bench_teardown(keep);
+            return 1;
+        }
+        res = (struct bench_result){
+            .scenario = "load",
+            .threads = 1,
+            .ops = params.nfiles,
+            .seconds = (bench_now_ns() - t) / 1e9,
+        };
+        bench_print(&res);
+    }
+
+    int ret = 0;
+    char *list = strdup(threads_list);
+    assert(list != NULL);
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        unsigned threads = strtoul(tok, NULL, 0);
+        if (threads == 0 || threads > MAX_THREADS) {
+            log_err("invalid thread count\n");
+            ret = 1;
+            break;
+        }
+        for (unsigned i = 0; i < threads; i++)
+            ctx->rng[i] = params.seed + i + 1;
+        ctx->run++;
+
+        if (has_scenario(scenarios, "getattr")) {
+            bench_run(&res, "getattr", threads, ops, op_getattr, ctx);
+            bench_print(&res);
+        }
+        if (has_scenario(scenarios, "readdir")) {
+            bench_run(&res, "readdir", threads, ops, op_readdir, ctx);
+            bench_print(&res);
+        }
+        if (has_scenario(scenarios, "readdirplus")) {
+            bench_run(&res, "readdirplus", threads, ops, op_readdirplus, ctx);
+            bench_print(&res);
+        }
+        if (has_scenario(scenarios, "open")) {
+            bench_run(&res, "open", threads, ops, op_open, ctx);
+            bench_print(&res);
+        }
+        if (has_scenario(scenarios, "create")) {
+            bench_run(&res, "create", threads, ops, op_create, ctx);
+            bench_print(&res);
+        }
+        if (has_scenario(scenarios, "write") || has_scenario(scenarios, "read")
+            || has_scenario(scenarios, "lanes") || has_scenario(scenarios, "loop")) {
+            if (rw_open(ctx, threads) < 0) {
+                ret = 1;
+                break;
+            }
+            if (has_scenario(scenarios, "write")) {
+                bench_run(&res, "write", threads, ops, op_write, ctx);
+                res.bytes = (uint64_t)res.ops * bs;
+                bench_print(&res);
+            }
+            if (has_scenario(scenarios, "read")) {
+                bench_run(&res, "read", threads, ops, op_read, ctx);
+                res.bytes = (uint64_t)res.ops * bs;
+                bench_print(&res);
+            }
+            /* how much slow listings delay reads, needs two threads */
+            if (has_scenario(scenarios, "lanes") && threads >= 2) {
+                static const char *const names[] = { "lanes-readdir", "lanes-read" };
+                size_t lane_ops[] = { ops / LANES_READS_PER_READDIR + 1, ops };
+                struct bench_result lanes[2];
+                bench_run_lanes(lanes, names, 2, threads, lane_ops, op_lanes, ctx);
+                lanes[1].bytes = (uint64_t)lanes[1].ops * bs;
+                bench_print(&lanes[0]);
+                bench_print(&lanes[1]);
+            }
+            /* the same, with listings and reads waiting for workers too */
+            if (has_scenario(scenarios, "loop") && threads >= 2) {
+                static const char *const names[] = { "loop-readdir", "loop-read" };
+                size_t lane_ops[] = { ops / LANES_READS_PER_READDIR + 1, ops };
+                struct bench_result lanes[2];
+                loop_start(ctx, workers);
+                bench_run_lanes(lanes, names, 2, threads, lane_ops, op_loop, ctx);
+                loop_stop(ctx);
+                lanes[1].bytes = (uint64_t)lanes[1].ops * bs;
+                bench_print(&lanes[0]);
+                bench_print(&lanes[1]);
+            }
+            rw_close(ctx, threads);
+        }
+    }
+
+    free(list);
+    bench_teardown(keep);
+    corpus_free(&ctx->corpus);
+    free(ctx);
+    return ret;
+}
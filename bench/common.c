@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "log.h"
+#include "replica.h"
+#include "sync.h"
+#include "tagfs.h"
+#include "writeback.h"
+
+static char *tmpdir;
+static int opened;
+
+uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t bench_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+double bench_rand_unit(uint64_t *state) {
+    return (bench_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int bench_datadir(const char *datadir) {
+    if (datadir) {
+        tagfs.datadir = strdup(datadir);
+    } else {
+        const char *base = getenv("TMPDIR");
+        if (!base)
+            base = "/tmp";
+        if (asprintf(&tmpdir, "%s/yatagfs-bench.XXXXXX", base) < 0)
+            return -1;
+        if (!mkdtemp(tmpdir)) {
+            log_err("mkdtemp: %s\n", strerror(errno));
+            return -1;
+        }
+        tagfs.datadir = strdup(tmpdir);
+    }
+    assert(tagfs.datadir != NULL);
+    return 0;
+}
+
+int bench_open(void) {
+    opened = 1;
+    if (tagfs_init() < 0)
+        return -1;
+    /* as mounts do, for group durability and replicas to be measured */
+    if (tagfs_replica_start() < 0)
+        return -1;
+    if (tagfs_writeback_start() < 0)
+        return -1;
+    return tagfs_sync_start();
+}
+
+void bench_close(void) {
+    if (!opened)
+        return;
+    tagfs_writeback_stop();
+    tagfs_sync_stop();
+    tagfs_replica_stop();
+    tagfs_fini();
+    opened = 0;
+}
+
+int bench_setup(const char *datadir) {
+    if (bench_datadir(datadir) < 0)
+        return -1;
+    return bench_open();
+}
+
+void bench_teardown(int keep) {
+    bench_close();
+
+    if (tmpdir && !keep) {
+        /* the datadir is flat, no need to recurse */
+        DIR *dir = opendir(tmpdir);
+        if (dir) {
+            struct dirent *de;
+            while ((de = readdir(dir)) != NULL) {
+                if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                    continue;
+                if (unlinkat(dirfd(dir), de->d_name, 0) < 0)
+                    log_warn("unlinkat %s: %s\n", de->d_name, strerror(errno));
+            }
+            closedir(dir);
+        }
+        if (rmdir(tmpdir) < 0)
+            log_warn("rmdir %s: %s\n", tmpdir, strerror(errno));
+    } else if (tmpdir) {
+        log_notice("datadir kept in %s\n", tmpdir);
+    }
+
+    free(tmpdir);
+    tmpdir = NULL;
+    free(tagfs.datadir);
+    tagfs.datadir = NULL;
+}
+
+struct worker {
+    pthread_t thread;
+    unsigned id;
+    size_t ops;
+    size_t errors;
+    uint64_t *lat;
+    /* when the last op returned */
+    uint64_t done;
+    bench_op_fn fn;
+    void *ctx;
+    pthread_barrier_t *barrier;
+};
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+
+    pthread_barrier_wait(w->barrier);
+    for (size_t i = 0; i < w->ops; i++) {
+        uint64_t t = bench_now_ns();
+        if (w->fn(w->ctx, w->id, i) < 0)
+            w->errors++;
+        w->lat[i] = bench_now_ns() - t;
+    }
+    w->done = bench_now_ns();
+
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void lat_stats(struct bench_result *res, uint64_t *lat) {
+    if (res->ops == 0)
+        return;
+    qsort(lat, res->ops, sizeof *lat, cmp_u64);
+#define P(q) lat[(size_t)((res->ops - 1) * (q))]
+    res->lat_p50 = P(0.50);
+    res->lat_p90 = P(0.90);
+    res->lat_p99 = P(0.99);
+    res->lat_p999 = P(0.999);
+#undef P
+    res->lat_max = lat[res->ops - 1];
+}
+
+int bench_run(struct bench_result *res, const char *scenario, unsigned threads,
+              size_t ops_per_thread, bench_op_fn fn, void *ctx) {
+    return bench_run_lanes(res, &scenario, 1, threads, &ops_per_thread, fn, ctx);
+}
+
+int bench_run_lanes(struct bench_result *res, const char *const *scenarios, unsigned nlanes,
+                    unsigned threads, const size_t *ops_per_thread, bench_op_fn fn, void *ctx) {
+    size_t ops = 0;
+    for (unsigned t = 0; t < threads; t++)
+        ops += ops_per_thread[t % nlanes];
+    uint64_t *lat = malloc(sizeof *lat * (ops ? ops : 1));
+    uint64_t *sorted = malloc(sizeof *sorted * (ops ? ops : 1));
+    struct worker *workers = calloc(threads, sizeof *workers);
+    if (!lat || !sorted || !workers) {
+        free(lat);
+        free(sorted);
+        free(workers);
+        return -1;
+    }
+
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, threads + 1);
+
+    uint64_t *next = lat;
+    for (unsigned t = 0; t < threads; t++) {
+        struct worker *w = &workers[t];
+        w->id = t;
+        w->ops = ops_per_thread[t % nlanes];
+        w->lat = next;
+        next += w->ops;
+        w->fn = fn;
+        w->ctx = ctx;
+        w->barrier = &barrier;
+        int rc = pthread_create(&w->thread, NULL, worker_main, w);
+        assert(rc == 0);
+    }
+
+    pthread_barrier_wait(&barrier);
+    uint64_t start = bench_now_ns();
+    for (unsigned t = 0; t < threads; t++)
+        pthread_join(workers[t].thread, NULL);
+    pthread_barrier_destroy(&barrier);
+
+    /* each lane until its last thread is done */
+    for (unsigned l = 0; l < nlanes; l++) {
+        memset(&res[l], 0, sizeof res[l]);
+        res[l].scenario = scenarios[l];
+        for (unsigned t = l; t < threads; t += nlanes) {
+            uint64_t done = workers[t].done > start ? workers[t].done - start : 0;
+            if (done / 1e9 > res[l].seconds)
+                res[l].seconds = done / 1e9;
+            memcpy(sorted + res[l].ops, workers[t].lat, workers[t].ops * sizeof *sorted);
+            res[l].ops += workers[t].ops;
+            res[l].errors += workers[t].errors;
+            res[l].threads++;
+        }
+        lat_stats(&res[l], sorted);
+    }
+
+    free(workers);
+    free(sorted);
+    free(lat);
+    return 0;
+}
+
+void bench_print(const struct bench_result *res) {
+    double secs = res->seconds > 0 ? res->seconds : 1e-9;
+    printf("{\"scenario\":\"%s\",\"threads\":%u,\"ops\":%zu,\"errors\":%zu,"
+           "\"seconds\":%.6f,\"ops_per_sec\":%.1f",
+           res->scenario, res->threads, res->ops, res->errors,
+           res->seconds, res->ops / secs);
+    if (res->bytes)
+        printf(",\"bytes\":%" PRIu64 ",\"mib_per_sec\":%.2f",
+               res->bytes, res->bytes / secs / (1024 * 1024));
+    printf(",\"lat_ns\":{\"p50\":%" PRIu64 ",\"p90\":%" PRIu64 ",\"p99\":%" PRIu64
+           ",\"p999\":%" PRIu64 ",\"max\":%" PRIu64 "}}\n",
+           res->lat_p50, res->lat_p90, res->lat_p99, res->lat_p999, res->lat_max);
+    fflush(stdout);
+}
+
+int bench_count_filler(void *buf, const char *name, const struct stat *stbuf,
+                       off_t off, enum fuse_fill_dir_flags flags) {
+    (void)name;
+    (void)stbuf;
+    (void)off;
+    (void)flags;
+    (*(size_t *)buf)++;
+    return 0;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 35
+#endif
+#include <fuse.h>
+
+/* one benchmark operation, `i` is the index of the op within the thread */
+typedef int (*bench_op_fn)(void *ctx, unsigned thread, size_t i);
+
+struct bench_result {
+    const char *scenario;
+    unsigned threads;
+    size_t ops;
+    size_t errors;
+    double seconds;
+    uint64_t bytes;
+    uint64_t lat_p50, lat_p90, lat_p99, lat_p999, lat_max;
+};
+
+uint64_t bench_now_ns(void);
+
+/* xorshift64*, one state per thread */
+uint64_t bench_rand(uint64_t *state);
+double bench_rand_unit(uint64_t *state);
+
+/* creates a fresh datadir under $TMPDIR and runs tagfs_init() on it */
+int bench_setup(const char *datadir);
+/* tagfs_fini() and, unless `keep`, removes the datadir */
+void bench_teardown(int keep);
+/*
+ * The two halves of bench_setup(), for processes opening the datadir of
+ * their parent. SQLite is configured on opening, so a process can only
+ * open once.
+ */
+int bench_datadir(const char *datadir);
+int bench_open(void);
+/* the half of bench_teardown() closing the datadir */
+void bench_close(void);
+
+/* runs `ops_per_thread` ops on each of `threads` threads and records per-op latency */
+int bench_run(struct bench_result *res, const char *scenario, unsigned threads,
+              size_t ops_per_thread, bench_op_fn fn, void *ctx);
+
+/*
+ * Like bench_run(), with thread t in lane t % nlanes running
+ * ops_per_thread[t % nlanes] ops, and one result per lane named after
+ * `scenarios`. `threads` should be a multiple of nlanes.
+ */
+int bench_run_lanes(struct bench_result *res, const char *const *scenarios, unsigned nlanes,
+                    unsigned threads, const size_t *ops_per_thread, bench_op_fn fn, void *ctx);
+
+/* prints `res` as a single JSON object on stdout */
+void bench_print(const struct bench_result *res);
+
+/* fuse_fill_dir_t counting its entries into *(size_t *)buf */
+int bench_count_filler(void *buf, const char *name, const struct stat *stbuf,
+                       off_t off, enum fuse_fill_dir_flags flags);
@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sqlite3.h>
+
+#include "common.h"
+#include "corpus.h"
+#include "log.h"
+#include "ops.h"
+#include "tagfs.h"
+
+int corpus_generate(struct corpus *c, const struct corpus_params *p) {
+    memset(c, 0, sizeof *c);
+    c->params = *p;
+    assert(p->ntags > 0 && p->maxdepth > 0 && p->maxdepth <= p->ntags);
+
+    c->tags = calloc(p->ntags, sizeof *c->tags);
+    c->cdf = malloc(sizeof *c->cdf * p->ntags);
+    c->files = calloc(p->nfiles, sizeof *c->files);
+    c->file_tags = malloc(sizeof *c->file_tags * p->nfiles * p->maxdepth);
+    c->file_depth = malloc(sizeof *c->file_depth * p->nfiles);
+    if (!c->tags || !c->cdf || !c->files || !c->file_tags || !c->file_depth)
+        goto oom;
+
+    double sum = 0;
+    for (size_t t = 0; t < p->ntags; t++) {
+        if (asprintf(&c->tags[t], "tag%05zu", t) < 0)
+            goto oom;
+        sum += 1.0 / pow((double)(t + 1), p->zipf);
+        c->cdf[t] = sum;
+    }
+    for (size_t t = 0; t < p->ntags; t++)
+        c->cdf[t] /= sum;
+
+    uint64_t rng = p->seed ? p->seed : 1;
+    for (size_t f = 0; f < p->nfiles; f++) {
+        if (asprintf(&c->files[f], "file%08zu", f) < 0)
+            goto oom;
+
+        unsigned depth = 1;
+        while (depth < p->maxdepth && bench_rand_unit(&rng) >= p->depth_p)
+            depth++;
+        c->file_depth[f] = (uint8_t)depth;
+
+        uint32_t *ft = &c->file_tags[f * p->maxdepth];
+        for (unsigned d = 0; d < depth; d++) {
+            uint32_t t;
+        again:
+            t = (uint32_t)corpus_zipf(c, &rng);
+            for (unsigned e = 0; e < d; e++)
+                if (ft[e] == t)
+                    goto again;
+            ft[d] = t;
+        }
+    }
+
+    return 0;
+
+oom:
+    corpus_free(c);
+    return -1;
+}
+
+void corpus_free(struct corpus *c) {
+    if (c->tags)
+        for (size_t t = 0; t < c->params.ntags; t++)
+            free(c->tags[t]);
+    if (c->files)
+        for (size_t f = 0; f < c->params.nfiles; f++)
+            free(c->files[f]);
+    free(c->tags);
+    free(c->cdf);
+    free(c->files);
+    free(c->file_tags);
+    free(c->file_depth);
+    memset(c, 0, sizeof *c);
+}
+
+size_t corpus_zipf(const struct corpus *c, uint64_t *rng) {
+    double u = bench_rand_unit(rng);
+    size_t lo = 0, hi = c->params.ntags - 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (c->cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int corpus_file_path(const struct corpus *c, size_t i, char *buf, size_t size) {
+    size_t len = 0;
+    const uint32_t *ft = &c->file_tags[i * c->params.maxdepth];
+    for (unsigned d = 0; d < c->file_depth[i]; d++) {
+        int n = snprintf(buf + len, size - len, "/%s", c->tags[ft[d]]);
+        if (n < 0 || (size_t)n >= size - len)
+            return -1;
+        len += n;
+    }
+    int n = snprintf(buf + len, size - len, "/%s", c->files[i]);
+    if (n < 0 || (size_t)n >= size - len)
+        return -1;
+    return (int)(len + n);
+}
+
+int corpus_load(const struct corpus *c) {
+    char path[4096];
+    int rc;
+
+    rc = sqlite3_exec(tagfs.db, "BEGIN", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        log_err("BEGIN: %s\n", sqlite3_errmsg(tagfs.db));
+        return -1;
+    }
+
+    for (size_t t = 0; t < c->params.ntags; t++) {
+        snprintf(path, sizeof path, "/%s", c->tags[t]);
+        rc = tagfs_ops.mkdir(path, 0755);
+        if (rc < 0) {
+            log_err("mkdir %s: %s\n", path, strerror(-rc));
+            goto err;
+        }
+    }
+
+    for (size_t f = 0; f < c->params.nfiles; f++) {
+        struct fuse_file_info fi = { .flags = O_RDWR | O_CREAT };
+        if (corpus_file_path(c, f, path, sizeof path) < 0) {
+            rc = -ENAMETOOLONG;
+            goto err;
+        }
+        rc = tagfs_ops.create(path, 0644, &fi);
+        if (rc < 0) {
+            log_err("create %s: %s\n", path, strerror(-rc));
+            goto err;
+        }
+        tagfs_ops.release(path, &fi);
+    }
+
+    rc = sqlite3_exec(tagfs.db, "COMMIT", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        log_err("COMMIT: %s\n", sqlite3_errmsg(tagfs.db));
+        return -1;
+    }
+    return 0;
+
+err:
+    sqlite3_exec(tagfs.db, "ROLLBACK", NULL, NULL, NULL);
+    return -1;
+}
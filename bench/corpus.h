@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct corpus_params {
+    size_t nfiles;
+    size_t ntags;
+    /* exponent of the Zipf distribution of tag popularity */
+    double zipf;
+    /* number of tags per file is geometric(depth_p), capped to maxdepth */
+    unsigned maxdepth;
+    double depth_p;
+    uint64_t seed;
+};
+
+struct corpus {
+    struct corpus_params params;
+    char **tags;
+    double *cdf;
+    char **files;
+    /* tags of file i are file_tags[i * maxdepth ..][0 .. file_depth[i]] */
+    uint32_t *file_tags;
+    uint8_t *file_depth;
+};
+
+int corpus_generate(struct corpus *c, const struct corpus_params *p);
+void corpus_free(struct corpus *c);
+
+/* creates the tags and files through tagfs_ops, in a single transaction */
+int corpus_load(const struct corpus *c);
+
+/* index of a tag drawn according to its popularity */
+size_t corpus_zipf(const struct corpus *c, uint64_t *rng);
+
+/* writes "/tag/.../file" for file i, returns its length or -1 if it doesn't fit */
+int corpus_file_path(const struct corpus *c, size_t i, char *buf, size_t size);
@@ -0,0 +1,526 @@
+/* both pwrite and pwrite64 are defined here, whatever the others see */
+#undef _FILE_OFFSET_BITS
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "crash.h"
+#include "log.h"
+
+enum { WRITE, SYNC, GONE, MOVE, NOTE };
+
+/* followed by the path of the file, then for writes by the old data */
+struct record {
+    uint32_t type;
+    uint32_t pathlen;
+    uint64_t ino;
+    /* writes: the size before, and the data at `off` they replaced */
+    int64_t size, off;
+    uint64_t len;
+    /* syncs: the records before are synced, through a descriptor open with `flags` */
+    uint64_t upto;
+    int32_t flags;
+    uint32_t kind, thread, value;
+};
+
+static struct {
+    ssize_t (*write)(int, const void *, size_t);
+    ssize_t (*pwrite64)(int, const void *, size_t, off64_t);
+    ssize_t (*writev)(int, const struct iovec *, int);
+    ssize_t (*pwritev64)(int, const struct iovec *, int, off64_t);
+    int (*ftruncate64)(int, off64_t);
+    int (*fallocate64)(int, int, off64_t, off64_t);
+    int (*fsync)(int);
+    int (*fdatasync)(int);
+    int (*unlinkat)(int, const char *, int);
+    int (*renameat)(int, const char *, int, const char *);
+} real;
+static pthread_once_t loaded = PTHREAD_ONCE_INIT;
+
+static atomic_bool armed;
+static char *dir;
+static size_t dirlen;
+static dev_t dev;
+static int logfd = -1;
+/* held from logging a write until it is done, so that records are in order */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t records;
+
+static void load(void) {
+    real.write = dlsym(RTLD_NEXT, "write");
+    real.pwrite64 = dlsym(RTLD_NEXT, "pwrite64");
+    real.writev = dlsym(RTLD_NEXT, "writev");
+    real.pwritev64 = dlsym(RTLD_NEXT, "pwritev64");
+    real.ftruncate64 = dlsym(RTLD_NEXT, "ftruncate64");
+    real.fallocate64 = dlsym(RTLD_NEXT, "fallocate64");
+    real.fsync = dlsym(RTLD_NEXT, "fsync");
+    real.fdatasync = dlsym(RTLD_NEXT, "fdatasync");
+    real.unlinkat = dlsym(RTLD_NEXT, "unlinkat");
+    real.renameat = dlsym(RTLD_NEXT, "renameat");
+}
+
+#define REAL(fn) (pthread_once(&loaded, load), real.fn)
+
+/* the path of `fd` in `buf`, of PATH_MAX, if it is a regular file under the directory */
+static const char *fd_path(int fd, struct stat *st, char *buf) {
+    char link[32];
+    if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode) || st->st_dev != dev)
+        return NULL;
+    snprintf(link, sizeof link, "/proc/self/fd/%d", fd);
+    ssize_t n = readlink(link, buf, PATH_MAX - 1);
+    if (n < 0)
+        return NULL;
+    buf[n] = '\0';
+    if (strncmp(buf, dir, dirlen) != 0 || buf[dirlen] != '/')
+        return NULL;
+    return buf;
+}
+
+/* as fd_path(), for `name` relative to `dirfd` */
+static const char *at_path(int dirfd, const char *name, struct stat *st, char *buf) {
+    int fd = openat(dirfd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    const char *path = fd_path(fd, st, buf);
+    close(fd);
+    return path;
+}
+
+/* with the lock held */
+static void append(struct record *r, const char *path, const void *data) {
+    r->pathlen = strlen(path);
+    size_t len = sizeof *r + r->pathlen + r->len;
+    char *buf = malloc(len);
+    if (!buf) {
+        log_err("cannot log a write\n");
+        _exit(3);
+    }
+    memcpy(buf, r, sizeof *r);
+    memcpy(buf + sizeof *r, path, r->pathlen);
+    if (r->len)
+        memcpy(buf + sizeof *r + r->pathlen, data, r->len);
+
+    for (size_t done = 0; done < len;) {
+        ssize_t w = REAL(write)(logfd, buf + done, len - done);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0) {
+            log_err("write: %s\n", strerror(errno));
+            _exit(3);
+        }
+        done += w;
+    }
+    records++;
+    free(buf);
+}
+
+/* reads what `path`, open as `fd`, holds at `off`, zeros past its end */
+static int read_old(int fd, const char *path, char *buf, size_t len, off_t off) {
+    int rfd = fd;
+    for (size_t done = 0; done < len;) {
+        ssize_t r = pread(rfd, buf + done, len - done, off + done);
+        /* opened write-only */
+        if (r < 0 && errno == EBADF && rfd == fd) {
+            rfd = open(path, O_RDONLY | O_CLOEXEC);
+            if (rfd < 0)
+                return -1;
+            continue;
+        }
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            if (r < 0)
+                break;
+            memset(buf + done, 0, len - done);
+            break;
+        }
+        done += r;
+    }
+    if (rfd != fd)
+        close(rfd);
+    return 0;
+}
+
+/* logs what `len` bytes at `off` of `fd`, -1 for its offset, are about to replace */
+static void log_write(int fd, int64_t off, uint64_t len) {
+    struct stat st;
+    char path[PATH_MAX];
+    if (!fd_path(fd, &st, path))
+        return;
+    if (off < 0) {
+        int flags = fcntl(fd, F_GETFL);
+        off = flags >= 0 && (flags & O_APPEND) ? st.st_size : lseek(fd, 0, SEEK_CUR);
+        if (off < 0)
+            return;
+    }
+
+    struct record r = { .type = WRITE, .ino = st.st_ino, .size = st.st_size, .off = off };
+    if (off < st.st_size)
+        r.len = len < (uint64_t)(st.st_size - off) ? len : (uint64_t)(st.st_size - off);
+    char *old = r.len ? malloc(r.len) : NULL;
+    if (r.len && (!old || read_old(fd, path, old, r.len, off) < 0)) {
+        log_err("cannot read what %s holds: %s\n", path, strerror(errno));
+        _exit(3);
+    }
+    append(&r, path, old);
+    free(old);
+}
+
+static size_t iov_len(const struct iovec *iov, int n) {
+    size_t len = 0;
+    for (int i = 0; i < n; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+ssize_t write(int fd, const void *buf, size_t n) {
+    if (!armed || fd == logfd)
+        return REAL(write)(fd, buf, n);
+    pthread_mutex_lock(&lock);
+    log_write(fd, -1, n);
+    ssize_t rc = REAL(write)(fd, buf, n);
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t n, off64_t off) {
+    if (!armed)
+        return REAL(pwrite64)(fd, buf, n, off);
+    pthread_mutex_lock(&lock);
+    log_write(fd, off, n);
+    ssize_t rc = REAL(pwrite64)(fd, buf, n, off);
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t n, off_t off) {
+    return pwrite64(fd, buf, n, off);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int n) {
+    if (!armed)
+        return REAL(writev)(fd, iov, n);
+    pthread_mutex_lock(&lock);
+    log_write(fd, -1, iov_len(iov, n));
+    ssize_t rc = REAL(writev)(fd, iov, n);
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+ssize_t pwritev64(int fd, const struct iovec *iov, int n, off64_t off) {
+    if (!armed)
+        return REAL(pwritev64)(fd, iov, n, off);
+    pthread_mutex_lock(&lock);
+    log_write(fd, off, iov_len(iov, n));
+    ssize_t rc = REAL(pwritev64)(fd, iov, n, off);
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+ssize_t pwritev(int fd, const struct iovec *iov, int n, off_t off) {
+    return pwritev64(fd, iov, n, off);
+}
+
+int ftruncate64(int fd, off64_t len) {
+    if (!armed)
+        return REAL(ftruncate64)(fd, len);
+    pthread_mutex_lock(&lock);
+    /* the tail it cuts */
+    log_write(fd, len, UINT64_MAX);
+    int rc = REAL(ftruncate64)(fd, len);
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+int ftruncate(int fd, off_t len) {
+    return ftruncate64(fd, len);
+}
+
+int fallocate64(int fd, int mode, off64_t off, off64_t len) {
+    if (!armed)
+        return REAL(fallocate64)(fd, mode, off, len);
+    pthread_mutex_lock(&lock);
+    log_write(fd, off, len);
+    int rc = REAL(fallocate64)(fd, mode, off, len);
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+int fallocate(int fd, int mode, off_t off, off_t len) {
+    return fallocate64(fd, mode, off, len);
+}
+
+/* the writes logged before `fn` starts are synced once it returns */
+static int log_sync(int fd, int (*fn)(int)) {
+    struct stat st;
+    char path[PATH_MAX];
+    if (!armed || !fd_path(fd, &st, path))
+        return fn(fd);
+
+    pthread_mutex_lock(&lock);
+    uint64_t upto = records;
+    pthread_mutex_unlock(&lock);
+    int rc = fn(fd);
+    if (rc == 0) {
+        int e = errno;
+        struct record r = { .type = SYNC, .ino = st.st_ino, .upto = upto,
+                            .flags = fcntl(fd, F_GETFL) };
+        pthread_mutex_lock(&lock);
+        append(&r, path, NULL);
+        pthread_mutex_unlock(&lock);
+        errno = e;
+    }
+    return rc;
+}
+
+int fsync(int fd) {
+    return log_sync(fd, REAL(fsync));
+}
+
+int fdatasync(int fd) {
+    return log_sync(fd, REAL(fdatasync));
+}
+
+int unlinkat(int dirfd, const char *name, int flags) {
+    struct stat st;
+    char path[PATH_MAX];
+    if (!armed || !at_path(dirfd, name, &st, path))
+        return REAL(unlinkat)(dirfd, name, flags);
+
+    /* its writes are gone with it, whatever file gets its inode next */
+    pthread_mutex_lock(&lock);
+    int rc = REAL(unlinkat)(dirfd, name, flags);
+    if (rc == 0) {
+        struct record r = { .type = GONE, .ino = st.st_ino };
+        append(&r, path, NULL);
+    }
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+int unlink(const char *name) {
+    return unlinkat(AT_FDCWD, name, 0);
+}
+
+int renameat(int olddirfd, const char *oldname, int newdirfd, const char *newname) {
+    struct stat st, replaced;
+    char path[PATH_MAX];
+    if (!armed || !at_path(olddirfd, oldname, &st, path))
+        return REAL(renameat)(olddirfd, oldname, newdirfd, newname);
+
+    pthread_mutex_lock(&lock);
+    int gone = at_path(newdirfd, newname, &replaced, path) && replaced.st_ino != st.st_ino;
+    int rc = REAL(renameat)(olddirfd, oldname, newdirfd, newname);
+    if (rc == 0) {
+        int e = errno;
+        if (gone) {
+            struct record r = { .type = GONE, .ino = replaced.st_ino };
+            append(&r, path, NULL);
+        }
+        if (at_path(newdirfd, newname, &st, path)) {
+            struct record r = { .type = MOVE, .ino = st.st_ino };
+            append(&r, path, NULL);
+        }
+        errno = e;
+    }
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+int rename(const char *oldname, const char *newname) {
+    return renameat(AT_FDCWD, oldname, AT_FDCWD, newname);
+}
+
+int crash_arm(const char *path, const char *log) {
+    struct stat st;
+    dir = realpath(path, NULL);
+    if (!dir || stat(dir, &st) < 0) {
+        log_err("realpath %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    dirlen = strlen(dir);
+    dev = st.st_dev;
+
+    logfd = open(log, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (logfd < 0) {
+        log_err("open %s: %s\n", log, strerror(errno));
+        return -1;
+    }
+    armed = 1;
+    return 0;
+}
+
+void crash_note(uint32_t kind, uint32_t thread, uint32_t value) {
+    if (!armed)
+        return;
+    struct record r = { .type = NOTE, .kind = kind, .thread = thread, .value = value };
+    pthread_mutex_lock(&lock);
+    append(&r, "", NULL);
+    pthread_mutex_unlock(&lock);
+}
+
+/* what the log shows of a file */
+struct inode {
+    uint64_t ino;
+    /* writes before `start` were to a removed file, those before `upto` are synced */
+    uint64_t start, upto;
+    const struct record *last;
+    int fd;
+};
+
+static struct inode *find_inode(struct inode **inodes, size_t *n, uint64_t ino) {
+    for (size_t i = 0; i < *n; i++)
+        if ((*inodes)[i].ino == ino)
+            return &(*inodes)[i];
+    struct inode *p = realloc(*inodes, (*n + 1) * sizeof *p);
+    if (!p)
+        return NULL;
+    *inodes = p;
+    p[*n] = (struct inode){ .ino = ino, .fd = -1 };
+    return &p[(*n)++];
+}
+
+static const char *record_path(const struct record *r, char *buf) {
+    memcpy(buf, r + 1, r->pathlen);
+    buf[r->pathlen] = '\0';
+    return buf;
+}
+
+/* opens the file of `in` where it was last seen, unless another took its place */
+static int inode_open(struct inode *in) {
+    char path[PATH_MAX];
+    struct stat st;
+    if (in->fd != -1)
+        return in->fd;
+    in->fd = open(record_path(in->last, path), O_WRONLY | O_CLOEXEC);
+    if (in->fd >= 0 && (fstat(in->fd, &st) < 0 || st.st_ino != in->ino)) {
+        close(in->fd);
+        in->fd = -1;
+    }
+    if (in->fd < 0)
+        in->fd = -2;
+    return in->fd;
+}
+
+int64_t crash_revert(const char *log, const char *path, crash_note_fn fn, void *ctx) {
+    char *buf = NULL;
+    const struct record **writes = NULL, **notes = NULL;
+    uint64_t *writeidx = NULL, *noteidx = NULL, *syncs = NULL;
+    size_t nwrites = 0, nnotes = 0, nsyncs = 0, ninodes = 0;
+    struct inode *inodes = NULL;
+    int64_t undone = -1;
+    struct stat st;
+
+    int fd = open(log, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        log_err("open %s: %s\n", log, strerror(errno));
+        goto end;
+    }
+    size_t len = st.st_size;
+    buf = malloc(len + 1);
+    size_t have = 0;
+    while (buf && have < len) {
+        ssize_t r = read(fd, buf + have, len - have);
+        if (r <= 0)
+            break;
+        have += r;
+    }
+    if (!buf || have < len) {
+        log_err("cannot read %s\n", log);
+        goto end;
+    }
+
+    /* records are at least that large */
+    size_t max = len / sizeof(struct record) + 1;
+    writes = malloc(max * sizeof *writes);
+    notes = malloc(max * sizeof *notes);
+    writeidx = malloc(max * sizeof *writeidx);
+    noteidx = malloc(max * sizeof *noteidx);
+    syncs = malloc(max * sizeof *syncs);
+    if (!writes || !notes || !writeidx || !noteidx || !syncs)
+        goto end;
+
+    size_t pathlen = strlen(path);
+    uint64_t i = 0;
+    for (size_t off = 0; off + sizeof(struct record) <= len; i++) {
+        const struct record *r = (const struct record *)(buf + off);
+        size_t size = sizeof *r + r->pathlen + r->len;
+        /* the last one, cut by the kill, had not been acted on */
+        if (off + size > len)
+            break;
+        off += size;
+
+        if (r->type == NOTE) {
+            notes[nnotes] = r;
+            noteidx[nnotes++] = i;
+            continue;
+        }
+        struct inode *in = find_inode(&inodes, &ninodes, r->ino);
+        if (!in)
+            goto end;
+        if (r->type != GONE)
+            in->last = r;
+        if (r->type == WRITE) {
+            writes[nwrites] = r;
+            writeidx[nwrites++] = i;
+        } else if (r->type == SYNC) {
+            if (r->upto > in->upto)
+                in->upto = r->upto;
+            if (r->pathlen == pathlen && memcmp(r + 1, path, pathlen) == 0
+                && r->flags >= 0 && (r->flags & O_ACCMODE) == O_RDONLY)
+                syncs[nsyncs++] = i;
+        } else if (r->type == GONE) {
+            in->start = in->upto = i + 1;
+            in->last = NULL;
+        }
+    }
+
+    /* newest first, the sizes and data they replaced */
+    undone = 0;
+    while (nwrites--) {
+        const struct record *r = writes[nwrites];
+        struct inode *in = find_inode(&inodes, &ninodes, r->ino);
+        if (!in || !in->last || writeidx[nwrites] < in->upto || inode_open(in) < 0)
+            continue;
+        const char *old = (const char *)(r + 1) + r->pathlen;
+        if (ftruncate(in->fd, r->size) < 0
+            || (r->len && pwrite(in->fd, old, r->len, r->off) != (ssize_t)r->len)) {
+            log_err("cannot undo a write: %s\n", strerror(errno));
+            undone = -1;
+            goto end;
+        }
+        undone++;
+    }
+
+    for (size_t j = 0, k = 0; j < nnotes; j++) {
+        while (k < nsyncs && syncs[k] < noteidx[j])
+            k++;
+        fn(ctx, notes[j]->kind, notes[j]->thread, notes[j]->value, nsyncs - k);
+    }
+
+end:
+    for (size_t j = 0; j < ninodes; j++)
+        if (inodes[j].fd >= 0)
+            close(inodes[j].fd);
+    if (fd >= 0)
+        close(fd);
+    free(inodes);
+    free(writes);
+    free(notes);
+    free(writeidx);
+    free(noteidx);
+    free(syncs);
+    free(buf);
+    return undone;
+}
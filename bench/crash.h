@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Power loss, for crash runs. Once armed, writes and syncs of regular
+ * files under a directory are logged along with the data they overwrite,
+ * so that after the process is killed, every write no later sync covers
+ * can be undone: what is left is what the disk would hold had the kernel
+ * written nothing back by itself. Creating, renaming and removing files
+ * are taken as durable.
+ */
+
+/* starts logging the files under `dir` to `log`, returns 0 or -1 */
+int crash_arm(const char *dir, const char *log);
+/* logs a note for crash_revert(), in order with the writes and syncs */
+void crash_note(uint32_t kind, uint32_t thread, uint32_t value);
+
+/*
+ * Called for each note, with how many syncs of the file given completed
+ * after it, counting those through read-only descriptors only.
+ */
+typedef void (*crash_note_fn)(void *ctx, uint32_t kind, uint32_t thread, uint32_t value,
+                              unsigned syncs);
+
+/* undoes what `log` shows was not synced, returns how many writes or -1 */
+int64_t crash_revert(const char *log, const char *path, crash_note_fn fn, void *ctx);
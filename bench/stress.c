@@ -0,0 +1,820 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "common.h"
+#include "crash.h"
+#include "log.h"
+#include "ops.h"
+#include "tagfs.h"
+
+#define MAX_THREADS 256
+/* names are tracked in bitmasks */
+#define MAX_NAMES 64
+#define MAX_WRITE (16 * 1024)
+/* appended by crash runs, fsync'ed by groups */
+#define RECORD 1000
+#define RECORDS_PER_FSYNC 4
+
+/*
+ * Every thread draws names from the same small pool, used both for tags
+ * and for files, so that ops keep colliding. Each thread also owns a
+ * file whose content is checked against a copy kept in memory.
+ */
+struct created {
+    uint64_t tags;
+    unsigned name;
+};
+
+struct thread {
+    uint64_t rng;
+    struct fuse_file_info fi;
+    char *model;
+    char *buf;
+    size_t size;
+    /* successful mkdirs and rmdirs of each name */
+    size_t mkdirs[MAX_NAMES];
+    size_t rmdirs[MAX_NAMES];
+    struct created *created;
+    size_t ncreated, capcreated;
+    size_t violations;
+    /* records appended by crash runs */
+    uint32_t records;
+};
+
+/* noted by crash runs, with the records appended before */
+enum { NOTE_FSYNCED, NOTE_COMMITTED };
+
+struct ctx {
+    unsigned run;
+    unsigned names;
+    size_t filesize;
+    struct thread threads[MAX_THREADS];
+    /*
+     * Of crash runs: the syncs of the WAL by rounds a commit must be
+     * followed by to survive, -1 for none, then the records fsync'ed, and
+     * those written before the last commit that must have survived.
+     */
+    int commit_syncs;
+    uint32_t acked[MAX_THREADS];
+    uint32_t committed[MAX_THREADS];
+};
+
+static void name_path(const struct ctx *ctx, unsigned name, char *buf, size_t size) {
+    snprintf(buf, size, "/r%u-n%u", ctx->run, name);
+}
+
+/* appends "/r<run>-n<name>" for each bit of `tags`, then `name` */
+static void file_path(const struct ctx *ctx, uint64_t tags, unsigned name,
+                      char *buf, size_t size) {
+    size_t len = 0;
+    for (unsigned i = 0; i < ctx->names; i++)
+        if (tags & (UINT64_C(1) << i))
+            len += snprintf(buf + len, size - len, "/r%u-n%u", ctx->run, i);
+    snprintf(buf + len, size - len, "/r%u-n%u", ctx->run, name);
+}
+
+static void violation(struct thread *t, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char *msg = NULL;
+    if (vasprintf(&msg, fmt, ap) >= 0) {
+        log_err("%s", msg);
+        free(msg);
+    }
+    va_end(ap);
+    t->violations++;
+}
+
+static int op_mkdir(struct ctx *ctx, struct thread *t) {
+    char path[64];
+    unsigned name = bench_rand(&t->rng) % ctx->names;
+    name_path(ctx, name, path, sizeof path);
+
+    int rc = tagfs_ops.mkdir(path, 0755);
+    if (rc == 0)
+        t->mkdirs[name]++;
+    else if (rc != -EEXIST)
+        return rc;
+    return 0;
+}
+
+static int op_rmdir(struct ctx *ctx, struct thread *t) {
+    char path[64];
+    unsigned name = bench_rand(&t->rng) % ctx->names;
+    name_path(ctx, name, path, sizeof path);
+
+    int rc = tagfs_ops.rmdir(path);
+    if (rc == 0)
+        t->rmdirs[name]++;
+    else if (rc != -ENOENT && rc != -ENOTEMPTY)
+        return rc;
+    return 0;
+}
+
+static int op_create(struct ctx *ctx, struct thread *t) {
+    char path[1024];
+    struct fuse_file_info fi = { .flags = O_RDWR | O_CREAT };
+
+    unsigned name = bench_rand(&t->rng) % ctx->names;
+    uint64_t tags = 0;
+    for (unsigned n = bench_rand(&t->rng) % 3; n > 0; n--)
+        tags |= UINT64_C(1) << (bench_rand(&t->rng) % ctx->names);
+    file_path(ctx, tags, name, path, sizeof path);
+
+    int rc = tagfs_ops.create(path, 0644, &fi);
+    if (rc == -ENOENT || rc == -EEXIST)
+        return 0;
+    if (rc < 0)
+        return rc;
+    rc = tagfs_ops.release(path, &fi);
+
+    if (t->ncreated == t->capcreated) {
+        size_t cap = t->capcreated ? t->capcreated * 2 : 64;
+        struct created *p = realloc(t->created, cap * sizeof *p);
+        assert(p != NULL);
+        t->created = p;
+        t->capcreated = cap;
+    }
+    t->created[t->ncreated++] = (struct created){ tags, name };
+    return rc;
+}
+
+struct listing {
+    char **names;
+    char *dirs;
+    size_t n, cap;
+};
+
+static int listing_filler(void *buf, const char *name, const struct stat *stbuf,
+                          off_t off, enum fuse_fill_dir_flags flags) {
+    (void)off;
+    (void)flags;
+    struct listing *l = buf;
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 64;
+        l->names = realloc(l->names, l->cap * sizeof *l->names);
+        l->dirs = realloc(l->dirs, l->cap);
+        assert(l->names != NULL && l->dirs != NULL);
+    }
+    l->dirs[l->n] = stbuf && S_ISDIR(stbuf->st_mode);
+    l->names[l->n] = strdup(name);
+    assert(l->names[l->n] != NULL);
+    l->n++;
+    return 0;
+}
+
+static void listing_free(struct listing *l) {
+    for (size_t i = 0; i < l->n; i++)
+        free(l->names[i]);
+    free(l->names);
+    free(l->dirs);
+}
+
+static int cmp_str(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* lists `path`, whose entries must all be distinct */
+static int list(struct thread *t, const char *path, struct listing *l) {
+    memset(l, 0, sizeof *l);
+    int rc = tagfs_ops.readdir(path, l, listing_filler, 0, NULL, 0);
+    if (rc < 0 || l->n == 0)
+        return rc;
+
+    char **sorted = malloc(l->n * sizeof *sorted);
+    assert(sorted != NULL);
+    memcpy(sorted, l->names, l->n * sizeof *sorted);
+    qsort(sorted, l->n, sizeof *sorted, cmp_str);
+    for (size_t i = 1; i < l->n; i++)
+        if (strcmp(sorted[i - 1], sorted[i]) == 0)
+            violation(t, "%s: %s listed twice\n", path, sorted[i]);
+    free(sorted);
+    return 0;
+}
+
+static int op_readdir(struct ctx *ctx, struct thread *t) {
+    char path[1024];
+    struct listing l;
+
+    uint64_t tags = 0;
+    for (unsigned n = bench_rand(&t->rng) % 2; n > 0; n--)
+        tags |= UINT64_C(1) << (bench_rand(&t->rng) % ctx->names);
+    if (tags) {
+        /* a file path without its last component */
+        file_path(ctx, tags, 0, path, sizeof path);
+        *strrchr(path, '/') = '\0';
+    } else {
+        strcpy(path, "/");
+    }
+
+    int rc = list(t, path, &l);
+    listing_free(&l);
+    return rc == -ENOENT ? 0 : rc;
+}
+
+static int op_write(struct ctx *ctx, struct thread *t) {
+    size_t len = 1 + bench_rand(&t->rng) % MAX_WRITE;
+    off_t off = bench_rand(&t->rng) % (ctx->filesize - len);
+    for (size_t i = 0; i < len; i++)
+        t->buf[i] = (char)bench_rand(&t->rng);
+
+    int rc = tagfs_ops.write(NULL, t->buf, len, off, &t->fi);
+    if (rc < 0)
+        return rc;
+    if ((size_t)rc != len)
+        return -EIO;
+    memcpy(t->model + off, t->buf, len);
+    if ((size_t)off + len > t->size)
+        t->size = off + len;
+    return 0;
+}
+
+static int op_read(struct ctx *ctx, struct thread *t) {
+    size_t len = 1 + bench_rand(&t->rng) % MAX_WRITE;
+    off_t off = bench_rand(&t->rng) % (ctx->filesize - len);
+
+    int rc = tagfs_ops.read(NULL, t->buf, len, off, &t->fi);
+    if (rc < 0)
+        return rc;
+
+    size_t want = (size_t)off >= t->size ? 0 : t->size - off;
+    if (want > len)
+        want = len;
+    if ((size_t)rc != want)
+        violation(t, "read %zu at %jd: got %d bytes instead of %zu\n",
+                  len, (intmax_t)off, rc, want);
+    else if (memcmp(t->buf, t->model + off, want) != 0)
+        violation(t, "read %zu at %jd: wrong data\n", len, (intmax_t)off);
+    return 0;
+}
+
+static int op_mixed(void *_ctx, unsigned thread, size_t i) {
+    (void)i;
+    struct ctx *ctx = _ctx;
+    struct thread *t = &ctx->threads[thread];
+
+    int rc;
+    unsigned r = bench_rand(&t->rng) % 100;
+    if (r < 15)
+        rc = op_mkdir(ctx, t);
+    else if (r < 25)
+        rc = op_rmdir(ctx, t);
+    else if (r < 45)
+        rc = op_create(ctx, t);
+    else if (r < 65)
+        rc = op_readdir(ctx, t);
+    else if (r < 85)
+        rc = op_write(ctx, t);
+    else
+        rc = op_read(ctx, t);
+
+    if (rc < 0)
+        log_err("unexpected result: %s\n", strerror(-rc));
+    return rc;
+}
+
+/* the content of record `i` of thread `thread` */
+static void fill_record(unsigned thread, uint32_t i, char *buf) {
+    uint64_t rng = (((uint64_t)thread << 32) | i) * 0x9E3779B97F4A7C15u + 1;
+    for (size_t off = 0; off < RECORD; off += 8) {
+        uint64_t x = bench_rand(&rng);
+        memcpy(buf + off, &x, RECORD - off < 8 ? RECORD - off : 8);
+    }
+}
+
+/* creates a file after the records, a commit for crash_check() to look for */
+static int op_commit(struct ctx *ctx, unsigned thread, struct thread *t) {
+    char path[64];
+    snprintf(path, sizeof path, "/r%u-w%u-m%" PRIu32, ctx->run, thread, t->records);
+    struct fuse_file_info fi = { .flags = O_WRONLY | O_CREAT };
+    int rc = tagfs_ops.create(path, 0644, &fi);
+    if (rc < 0)
+        return rc;
+    tagfs_ops.release(path, &fi);
+    crash_note(NOTE_COMMITTED, thread, t->records);
+    return 0;
+}
+
+static int op_append(struct ctx *ctx, unsigned thread, struct thread *t) {
+    fill_record(thread, t->records, t->buf);
+    int rc = tagfs_ops.write(NULL, t->buf, RECORD, (off_t)t->records * RECORD, &t->fi);
+    if (rc < 0)
+        return rc;
+    if (rc != RECORD)
+        return -EIO;
+    if (++t->records % RECORDS_PER_FSYNC == RECORDS_PER_FSYNC / 2 && ctx->commit_syncs >= 0)
+        return op_commit(ctx, thread, t);
+    /* with group durability, odd threads leave syncing to rounds */
+    if (t->records % RECORDS_PER_FSYNC || (ctx->commit_syncs > 0 && thread % 2))
+        return 0;
+
+    rc = tagfs_ops.fsync(NULL, 1, &t->fi);
+    if (rc < 0)
+        return rc;
+    crash_note(NOTE_FSYNCED, thread, t->records);
+    return 0;
+}
+
+static int op_crash(void *_ctx, unsigned thread, size_t i) {
+    (void)i;
+    struct ctx *ctx = _ctx;
+    struct thread *t = &ctx->threads[thread];
+
+    int rc;
+    unsigned r = bench_rand(&t->rng) % 100;
+    if (r < 10)
+        rc = op_mkdir(ctx, t);
+    else if (r < 15)
+        rc = op_rmdir(ctx, t);
+    else if (r < 30)
+        rc = op_create(ctx, t);
+    else if (r < 40)
+        rc = op_readdir(ctx, t);
+    else
+        rc = op_append(ctx, thread, t);
+
+    if (rc < 0)
+        log_err("unexpected result: %s\n", strerror(-rc));
+    return rc;
+}
+
+static int run_open(struct ctx *ctx, unsigned threads) {
+    char path[64];
+    for (unsigned i = 0; i < threads; i++) {
+        struct thread *t = &ctx->threads[i];
+        snprintf(path, sizeof path, "/r%u-w%u", ctx->run, i);
+        t->fi = (struct fuse_file_info){ .flags = O_RDWR | O_CREAT };
+        int rc = tagfs_ops.create(path, 0644, &t->fi);
+        if (rc < 0) {
+            log_err("create %s: %s\n", path, strerror(-rc));
+            return -1;
+        }
+        t->model = calloc(1, ctx->filesize);
+        t->buf = malloc(MAX_WRITE);
+        assert(t->model != NULL && t->buf != NULL);
+    }
+    return 0;
+}
+
+/* compares the namespace left by a run with what its ops returned */
+static size_t run_check(struct ctx *ctx, unsigned threads) {
+    struct thread *t0 = &ctx->threads[0];
+    char path[1024], prefix[32];
+    struct listing l;
+    int is_tag[MAX_NAMES] = {0}, is_file[MAX_NAMES] = {0};
+
+    int plen = snprintf(prefix, sizeof prefix, "r%u-n", ctx->run);
+    if (list(t0, "/", &l) < 0)
+        violation(t0, "cannot list /\n");
+    for (size_t i = 0; i < l.n; i++) {
+        if (strncmp(l.names[i], prefix, plen) != 0)
+            continue;
+        unsigned name = strtoul(l.names[i] + plen, NULL, 10);
+        assert(name < ctx->names);
+        if (l.dirs[i])
+            is_tag[name] = 1;
+        else
+            is_file[name] = 1;
+    }
+    listing_free(&l);
+
+    for (unsigned n = 0; n < ctx->names; n++) {
+        size_t mkdirs = 0, rmdirs = 0, created = 0;
+        for (unsigned i = 0; i < threads; i++) {
+            mkdirs += ctx->threads[i].mkdirs[n];
+            rmdirs += ctx->threads[i].rmdirs[n];
+            for (size_t j = 0; j < ctx->threads[i].ncreated; j++)
+                created += ctx->threads[i].created[j].name == n;
+        }
+
+        /* serialized, mkdirs and rmdirs alternate */
+        if (mkdirs - rmdirs != (size_t)is_tag[n])
+            violation(t0, "n%u: %zu mkdirs, %zu rmdirs, but %s\n", n, mkdirs, rmdirs,
+                      is_tag[n] ? "a tag" : "no tag");
+        if (is_tag[n] && is_file[n])
+            violation(t0, "n%u: both a tag and a file\n", n);
+        if (!!created != is_file[n])
+            violation(t0, "n%u: created %zu times, but %s\n", n, created,
+                      is_file[n] ? "a file" : "no file");
+        if (!is_file[n])
+            continue;
+
+        /* the backing file must be there too */
+        struct fuse_file_info fi = { .flags = O_RDONLY };
+        name_path(ctx, n, path, sizeof path);
+        int rc = tagfs_ops.open(path, &fi);
+        if (rc < 0)
+            violation(t0, "n%u: cannot open: %s\n", n, strerror(-rc));
+        else
+            tagfs_ops.release(path, &fi);
+
+        /* and its tags, those of one of the creates that succeeded */
+        uint64_t tags = 0;
+        struct stat st;
+        for (unsigned tag = 0; tag < ctx->names; tag++) {
+            if (!is_tag[tag])
+                continue;
+            file_path(ctx, UINT64_C(1) << tag, n, path, sizeof path);
+            if (tagfs_ops.getattr(path, &st, NULL) == 0)
+                tags |= UINT64_C(1) << tag;
+        }
+        int found = 0;
+        for (unsigned i = 0; i < threads && !found; i++)
+            for (size_t j = 0; j < ctx->threads[i].ncreated && !found; j++)
+                found = ctx->threads[i].created[j].name == n
+                    && ctx->threads[i].created[j].tags == tags;
+        if (!found)
+            violation(t0, "n%u: tags %#" PRIx64 " were never asked for\n", n, tags);
+    }
+
+    /* the files owned by threads, through a fresh descriptor */
+    for (unsigned i = 0; i < threads; i++) {
+        struct thread *t = &ctx->threads[i];
+        struct fuse_file_info fi = { .flags = O_RDONLY };
+        snprintf(path, sizeof path, "/r%u-w%u", ctx->run, i);
+        tagfs_ops.release(NULL, &t->fi);
+
+        int rc = tagfs_ops.open(path, &fi);
+        if (rc < 0) {
+            violation(t0, "%s: cannot open: %s\n", path, strerror(-rc));
+            continue;
+        }
+        char *data = malloc(ctx->filesize);
+        assert(data != NULL);
+        rc = tagfs_ops.read(path, data, ctx->filesize, 0, &fi);
+        if (rc < 0 || (size_t)rc != t->size || memcmp(data, t->model, t->size) != 0)
+            violation(t0, "%s: wrong content\n", path);
+        free(data);
+        tagfs_ops.release(path, &fi);
+    }
+
+    size_t res = 0;
+    for (unsigned i = 0; i < threads; i++) {
+        struct thread *t = &ctx->threads[i];
+        res += t->violations;
+        free(t->model);
+        free(t->buf);
+        free(t->created);
+        *t = (struct thread){0};
+    }
+    return res;
+}
+
+/*
+ * In a process of its own, once what the disk would not hold is undone:
+ * the database must be intact, the commits that must have survived must
+ * be there, and so must every record fsync'ed or, with group durability,
+ * written before them. Returns the violations.
+ */
+static size_t crash_check(struct ctx *ctx, unsigned threads) {
+    char path[64], want[RECORD];
+    size_t violations = 0;
+
+    if (bench_open() < 0) {
+        log_err("cannot open the datadir after the crash\n");
+        return 1;
+    }
+
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(tagfs.db, "PRAGMA integrity_check", -1, &stmt, NULL) != SQLITE_OK) {
+        log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
+        violations++;
+    } else {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char *msg = (const char *)sqlite3_column_text(stmt, 0);
+            if (strcmp(msg, "ok") != 0) {
+                log_err("integrity_check: %s\n", msg);
+                violations++;
+            }
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    char *data = malloc(RECORD);
+    assert(data != NULL);
+    for (unsigned i = 0; i < threads; i++) {
+        struct stat st;
+        uint32_t synced = ctx->acked[i];
+        if (ctx->committed[i]) {
+            snprintf(path, sizeof path, "/r%u-w%u-m%" PRIu32, ctx->run, i, ctx->committed[i]);
+            if (tagfs_ops.getattr(path, &st, NULL) < 0) {
+                log_err("%s: committed but lost\n", path);
+                violations++;
+            }
+            /* written back from write-behind buffers only later */
+            if (ctx->commit_syncs > 0 && !tagfs.write_behind && ctx->committed[i] > synced)
+                synced = ctx->committed[i];
+        }
+
+        struct fuse_file_info fi = { .flags = O_RDONLY };
+        snprintf(path, sizeof path, "/r%u-w%u", ctx->run, i);
+        int rc = tagfs_ops.open(path, &fi);
+        if (rc < 0) {
+            log_err("%s: cannot open: %s\n", path, strerror(-rc));
+            violations++;
+            continue;
+        }
+        for (uint32_t j = 0; j < synced; j++) {
+            fill_record(i, j, want);
+            rc = tagfs_ops.read(path, data, RECORD, (off_t)j * RECORD, &fi);
+            if (rc != RECORD || memcmp(data, want, RECORD) != 0) {
+                log_err("%s: record %" PRIu32 " of %" PRIu32 " synced is lost\n",
+                        path, j, synced);
+                violations++;
+                break;
+            }
+        }
+        tagfs_ops.release(path, &fi);
+    }
+    free(data);
+
+    bench_close();
+    return violations;
+}
+
+/* runs `fsck` on the datadir with `opt`, returns its exit status or -1 */
+static int run_fsck(const char *fsck, const char *opt) {
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        if (opt)
+            execl(fsck, fsck, opt, tagfs.datadir, (char *)NULL);
+        else
+            execl(fsck, fsck, tagfs.datadir, (char *)NULL);
+        log_err("exec %s: %s\n", fsck, strerror(errno));
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+static void crash_noted(void *_ctx, uint32_t kind, uint32_t thread, uint32_t value,
+                        unsigned syncs) {
+    struct ctx *ctx = _ctx;
+    if (thread >= MAX_THREADS)
+        return;
+    if (kind == NOTE_FSYNCED && value > ctx->acked[thread])
+        ctx->acked[thread] = value;
+    if (kind == NOTE_COMMITTED && (int)syncs >= ctx->commit_syncs
+        && value > ctx->committed[thread])
+        ctx->committed[thread] = value;
+}
+
+/*
+ * Runs the ops in a child process, killed after `ms` milliseconds, undoes
+ * what they wrote that no sync covers, then checks the datadir from
+ * another one. The datadir is never opened by this process, which forks
+ * these. Returns the violations.
+ */
+static size_t run_crash(struct ctx *ctx, unsigned threads, size_t ops, unsigned ms,
+                        const char *fsck) {
+    char *log = NULL, *dir = NULL, *walpath = NULL;
+    size_t violations = 0;
+    int status;
+
+    /*
+     * Rounds sync the WAL through a read-only descriptor of their own, SQLite
+     * through its own: after two syncs of rounds, a whole round started
+     * after the commit and synced it, along with the data written before.
+     */
+    const char *durability = tagfs.durability ? tagfs.durability : "strict";
+    ctx->commit_syncs = strcmp(durability, "strict") == 0 ? 0
+                        : strcmp(durability, "group") == 0 ? 2 : -1;
+    memset(ctx->acked, 0, sizeof ctx->acked);
+    memset(ctx->committed, 0, sizeof ctx->committed);
+
+    dir = realpath(tagfs.datadir, NULL);
+    if (dir && asprintf(&log, "%s.undo", dir) < 0)
+        log = NULL;
+    if (dir && asprintf(&walpath, "%s/.yatagfs.db-wal", dir) < 0)
+        walpath = NULL;
+    if (!log || !walpath) {
+        log_err("cannot name the undo log\n");
+        violations++;
+        goto end;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        log_err("fork: %s\n", strerror(errno));
+        violations++;
+        goto end;
+    }
+    if (pid == 0) {
+        /* from a datadir synced once the files are there, as relaxed durability needs */
+        if (bench_open() < 0 || run_open(ctx, threads) < 0 || (sync(), crash_arm(dir, log)) < 0)
+            _exit(2);
+        struct bench_result res;
+        bench_run(&res, "crash", threads, ops, op_crash, ctx);
+        _exit(0);
+    }
+
+    usleep((useconds_t)ms * 1000);
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        log_err("crash run failed before being killed\n");
+        violations++;
+        goto end;
+    }
+
+    /* as the disk would be after losing power, where the kernel wrote nothing back */
+    int64_t lost = crash_revert(log, walpath, crash_noted, ctx);
+    if (lost < 0) {
+        violations++;
+        goto end;
+    }
+
+    uint64_t acked = 0, committed = 0;
+    for (unsigned i = 0; i < threads; i++) {
+        acked += ctx->acked[i];
+        committed += ctx->committed[i];
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        log_err("fork: %s\n", strerror(errno));
+        violations++;
+        goto end;
+    }
+    if (pid == 0)
+        _exit(crash_check(ctx, threads) ? 1 : 0);
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        violations++;
+
+    /* what the crash left must be repairable, fsck(8) statuses */
+    int repaired = -1, clean = -1;
+    if (fsck) {
+        repaired = run_fsck(fsck, "-r");
+        if (repaired != 0 && repaired != 1) {
+            log_err("fsck -r exited with %d\n", repaired);
+            violations++;
+        }
+        clean = run_fsck(fsck, NULL);
+        if (clean != 0) {
+            log_err("fsck exited with %d after repairing\n", clean);
+            violations++;
+        }
+    }
+
+    printf("{\"scenario\":\"crash\",\"threads\":%u,\"killed_after_ms\":%u,"
+           "\"writes_lost\":%" PRId64 ",\"records_synced\":%" PRIu64 ","
+           "\"records_committed\":%" PRIu64 ",\"fsck_repair\":%d,\"violations\":%zu}\n",
+           threads, ms, lost, acked, committed, repaired, violations);
+    fflush(stdout);
+
+end:
+    if (log)
+        unlink(log);
+    free(log);
+    free(dir);
+    free(walpath);
+    return violations;
+}
+
+static void usage(const char *argv0) {
+    printf("usage: %s [options]\n"
+           "\n"
+           "    -n N        number of names shared by tags and files, at most 64 (32)\n"
+           "    -t T,...    thread counts to run with (1,4,16)\n"
+           "    -o N        operations per thread (5000)\n"
+           "    -w KIB      size of the file each thread checks reads against (1024)\n"
+           "    -c          store files compressed\n"
+           "    -W KIB      gather small writes in buffers of KIB per file (0, none)\n"
+           "    -y LEVEL    durability: strict, group or relaxed (strict)\n"
+           "    -D DIR      use DIR as datadir instead of a temporary one\n"
+           "    -k          keep the temporary datadir\n"
+           "    -S SEED     random seed (1)\n"
+           "    -K MS       crash runs instead: kill the ops after MS, undo what they\n"
+           "                wrote that no sync covers, and check what is left, from\n"
+           "                other processes\n"
+           "    -F PATH     with -K, repair the datadir with yatagfs-fsck at PATH\n"
+           "\n"
+           "Each thread mixes mkdir, rmdir, create, readdir, write and read.\n"
+           "Results are printed as one JSON object per line, and whatever\n"
+           "contradicts the results of the ops is logged. Exits with 1 if\n"
+           "anything did.\n"
+           "\n"
+           "In crash runs, threads append records to their file instead of\n"
+           "writing and reading, fsync them by groups, except odd threads with\n"
+           "group durability, and create a file after some. After the kill and\n"
+           "the undo, the database must pass PRAGMA integrity_check, every\n"
+           "record whose fsync returned must be there, so must the files whose\n"
+           "creation must have survived and, with group durability, the records\n"
+           "written before, and with -F, fsck -r must leave the datadir clean.\n",
+           argv0);
+}
+
+int main(int argc, char **argv) {
+    const char *threads_list = "1,4,16";
+    const char *datadir = NULL, *fsck = NULL;
+    size_t ops = 5000, kib = 1024;
+    unsigned names = 32, crash = 0;
+    uint64_t seed = 1;
+    int keep = 0, opt;
+
+    fuse_set_log_func(log_fuse);
+
+    while ((opt = getopt(argc, argv, "n:t:o:w:cW:y:D:kS:K:F:h")) != -1) {
+        switch (opt) {
+        case 'n': names = strtoul(optarg, NULL, 0); break;
+        case 't': threads_list = optarg; break;
+        case 'o': ops = strtoull(optarg, NULL, 0); break;
+        case 'w': kib = strtoull(optarg, NULL, 0); break;
+        case 'c': tagfs.compress = 1; break;
+        case 'W': tagfs.write_behind = strtol(optarg, NULL, 0); break;
+        case 'y': tagfs.durability = optarg; break;
+        case 'D': datadir = optarg; break;
+        case 'k': keep = 1; break;
+        case 'S': seed = strtoull(optarg, NULL, 0); break;
+        case 'K': crash = strtoul(optarg, NULL, 0); break;
+        case 'F': fsck = optarg; break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (names == 0 || names > MAX_NAMES || kib * 1024 <= MAX_WRITE) {
+        log_err("invalid parameters\n");
+        return 1;
+    }
+
+    struct ctx *ctx = calloc(1, sizeof *ctx);
+    assert(ctx != NULL);
+    ctx->names = names;
+    ctx->filesize = kib * 1024;
+
+    /* crash runs open the datadir from children only */
+    if ((crash ? bench_datadir(datadir) : bench_setup(datadir)) < 0) {
+        log_err("cannot set up datadir\n");
+        return 1;
+    }
+
+    printf("{\"bench\":\"yatagfs-stress\",\"names\":%u,\"ops_per_thread\":%zu,"
+           "\"file_kib\":%zu,\"compress\":%s,\"write_behind\":%d,\"durability\":\"%s\","
+           "\"seed\":%" PRIu64 "}\n",
+           names, ops, kib, tagfs.compress ? "true" : "false", tagfs.write_behind,
+           tagfs.durability ? tagfs.durability : "strict", seed);
+
+    int ret = 0;
+    char *list = strdup(threads_list);
+    assert(list != NULL);
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        unsigned threads = strtoul(tok, NULL, 0);
+        if (threads == 0 || threads > MAX_THREADS) {
+            log_err("invalid thread count\n");
+            ret = 1;
+            break;
+        }
+        /* a fresh set of names for every run */
+        ctx->run++;
+        for (unsigned i = 0; i < threads; i++)
+            ctx->threads[i].rng = seed + i + 1;
+        if (crash) {
+            if (run_crash(ctx, threads, ops, crash, fsck))
+                ret = 1;
+            continue;
+        }
+        if (run_open(ctx, threads) < 0) {
+            ret = 1;
+            break;
+        }
+
+        struct bench_result res;
+        bench_run(&res, "stress", threads, ops, op_mixed, ctx);
+        bench_print(&res);
+        size_t violations = run_check(ctx, threads);
+        if (violations)
+            log_err("%zu violations with %u threads\n", violations, threads);
+        if (res.errors || violations)
+            ret = 1;
+    }
+
+    free(list);
+    bench_teardown(keep);
+    free(ctx);
+    return ret;
+}
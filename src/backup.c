@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "backup.h"
+#include "log.h"
+#include "tagfs.h"
+
+#define BACKUP_DEFAULT ".yatagfs.db.bak"
+#define BACKUP_TRIGGER ".yatagfs.backup"
+/* how long a batch may hold the connection, and the pause between batches */
+#define STEP_TARGET_NS 2000000
+#define STEP_PAUSE_NS 10000000
+#define MIN_PAGES 8
+#define MAX_PAGES 4096
+
+struct stats {
+    int64_t steps;
+    int64_t busy;
+    uint64_t held_ns;
+    uint64_t max_held_ns;
+};
+
+static atomic_bool running;
+static atomic_bool stopping;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* sleeps, returns non-zero if stopping */
+static int pause_ns(uint64_t ns) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec += ns % 1000000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (!stopping)
+        pthread_cond_timedwait(&cond, &lock, &ts);
+    pthread_mutex_unlock(&lock);
+    return stopping;
+}
+
+/* relative to the directory of the database */
+static char *backup_path(const char *suffix) {
+    const char *name = tagfs.backup ? tagfs.backup : BACKUP_DEFAULT;
+    char *path;
+    int n;
+
+    if (name[0] == '/') {
+        n = asprintf(&path, "%s%s", name, suffix);
+    } else {
+        const char *slash = strrchr(tagfs.dbpath, '/');
+        n = asprintf(&path, "%.*s/%s%s", (int)(slash - tagfs.dbpath), tagfs.dbpath, name, suffix);
+    }
+    return n < 0 ? NULL : path;
+}
+
+static int backup_run(void) {
+    struct stats st = {0};
+    sqlite3 *dest = NULL;
+    sqlite3_backup *backup = NULL;
+    char *tmp = backup_path(".tmp"), *path = backup_path("");
+    int res = -1, rc, pages = MIN_PAGES;
+    uint64_t start = now_ns();
+
+    if (!tmp || !path)
+        goto end;
+
+    unlink(tmp);
+    rc = sqlite3_open(tmp, &dest);
+    if (rc != SQLITE_OK) {
+        log_err("cannot open %s: %s\n", tmp, dest ? sqlite3_errmsg(dest) : sqlite3_errstr(rc));
+        goto end;
+    }
+
+    backup = sqlite3_backup_init(dest, "main", tagfs.db, "main");
+    if (!backup) {
+        log_err("sqlite3_backup_init: %s\n", sqlite3_errmsg(dest));
+        goto end;
+    }
+
+    do {
+        uint64_t t = now_ns();
+        rc = sqlite3_backup_step(backup, pages);
+        uint64_t held = now_ns() - t;
+
+        st.steps++;
+        st.held_ns += held;
+        if (held > st.max_held_ns)
+            st.max_held_ns = held;
+
+        switch (rc) {
+        case SQLITE_OK:
+        case SQLITE_DONE:
+            /* keep each batch around the target */
+            if (held > STEP_TARGET_NS && pages > MIN_PAGES)
+                pages /= 2;
+            else if (held < STEP_TARGET_NS / 2 && pages < MAX_PAGES)
+                pages *= 2;
+            break;
+        case SQLITE_BUSY:
+        case SQLITE_LOCKED:
+            /* a transaction is open, try again later */
+            st.busy++;
+            break;
+        default:
+            log_err("sqlite3_backup_step: %s\n", sqlite3_errstr(rc));
+            goto end;
+        }
+        if (rc != SQLITE_DONE && pause_ns(STEP_PAUSE_NS)) {
+            log_notice("backup interrupted\n");
+            goto end;
+        }
+    } while (rc != SQLITE_DONE);
+
+    int64_t npages = sqlite3_backup_pagecount(backup);
+    rc = sqlite3_backup_finish(backup);
+    backup = NULL;
+    if (rc != SQLITE_OK) {
+        log_err("sqlite3_backup_finish: %s\n", sqlite3_errstr(rc));
+        goto end;
+    }
+
+    rc = sqlite3_close(dest);
+    dest = NULL;
+    if (rc != SQLITE_OK) {
+        log_err("sqlite3_close: %s\n", sqlite3_errstr(rc));
+        goto end;
+    }
+
+    if (rename(tmp, path) < 0) {
+        log_err("rename %s: %s\n", path, strerror(errno));
+        goto end;
+    }
+
+    log_notice("backup to %s done: %" PRId64 " pages in %.3f s, %" PRId64 " batches "
+               "holding the database %.3f ms at most and %.3f ms in total, %" PRId64 " retries\n",
+               path, npages, (now_ns() - start) / 1e9, st.steps,
+               st.max_held_ns / 1e6, st.held_ns / 1e6, st.busy);
+    res = 0;
+
+end:
+    if (backup)
+        sqlite3_backup_finish(backup);
+    if (dest) {
+        sqlite3_close(dest);
+        unlink(tmp);
+    }
+    free(tmp);
+    free(path);
+    return res;
+}
+
+static void *backup_main(void *arg) {
+    (void)arg;
+    time_t next = tagfs.backup_interval > 0 ? time(NULL) + tagfs.backup_interval : 0;
+
+    while (!pause_ns(1000000000)) {
+        int triggered = unlinkat(tagfs.datadirfd, BACKUP_TRIGGER, 0) == 0;
+        if (!triggered && (!next || time(NULL) < next))
+            continue;
+
+        backup_run();
+        if (tagfs.backup_interval > 0)
+            next = time(NULL) + tagfs.backup_interval;
+    }
+
+    return NULL;
+}
+
+int tagfs_backup_start(void) {
+    if (running)
+        return 0;
+
+    stopping = 0;
+    running = 1;
+    if (pthread_create(&thread, NULL, backup_main, NULL) != 0) {
+        running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void tagfs_backup_stop(void) {
+    if (!atomic_exchange(&running, 0))
+        return;
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+}
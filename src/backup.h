@@ -0,0 +1,11 @@
+#pragma once
+
+/*
+ * Online backups of the database, to tagfs.backup, taken by a background
+ * thread every tagfs.backup_interval seconds and whenever a file named
+ * .yatagfs.backup appears in the datadir. Pages are copied in small
+ * batches with the connection of the mount, so that foreground ops are
+ * only stalled for the duration of one batch at a time.
+ */
+int tagfs_backup_start(void);
+void tagfs_backup_stop(void);
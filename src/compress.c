@@ -0,0 +1,778 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "compress.h"
+#include "log.h"
+#include "tagfs.h"
+
+#define MAGIC "YTFSBLK"
+#define VERSION 2
+#define HEADER_SIZE 4096
+/* room for a block stored as is, aligned so that copies can be punched whole */
+#define COPY_SIZE (TAGFS_BLOCK_SIZE + 4096)
+#define SLOT_SIZE (2 * COPY_SIZE)
+#define BLOCK_CACHE_DEFAULT 64
+
+struct header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t size;
+};
+
+/* at the start of each copy, all zeros for a block never written */
+struct copy {
+    uint32_t len;
+    uint32_t flags;
+    /* the copy with the greater one holds the last version, 0 is never */
+    uint32_t gen;
+    /* of the fields above then the len bytes following */
+    uint32_t crc;
+};
+#define COPY_STORED 1
+
+/* blocks written since the last sync, with the copy holding their last version */
+struct written {
+    struct written_entry {
+        /* index + 1, 0 for free */
+        uint64_t key;
+        int copy;
+    } *e;
+    size_t n, cap;
+};
+
+struct tagfs_shadow {
+    /* serializes syncs */
+    pthread_mutex_t sync_lock;
+    /* protected by the lock of the file, like its blocks */
+    struct written current;
+    /* written before the sync in progress started */
+    struct written syncing;
+};
+
+struct block {
+    int64_t id;
+    uint64_t index;
+    unsigned refs;
+    /* in the cache, otherwise freed by its last user */
+    int cached;
+    struct block *hnext;
+    struct block *prev, *next;
+    char data[];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct block **buckets;
+static size_t nbuckets;
+/* every cached block, most recently used first */
+static struct block lru = { .prev = &lru, .next = &lru };
+static size_t count;
+
+static off_t slot_offset(uint64_t index) {
+    return HEADER_SIZE + (off_t)index * SLOT_SIZE;
+}
+
+static off_t copy_offset(uint64_t index, int c) {
+    return slot_offset(index) + c * COPY_SIZE;
+}
+
+static size_t written_hash(const struct written *w, uint64_t key) {
+    return ((key * 0x9E3779B97F4A7C15u) >> 32) & (w->cap - 1);
+}
+
+static struct written_entry *written_find(const struct written *w, uint64_t index) {
+    if (!w->n)
+        return NULL;
+    for (size_t i = written_hash(w, index + 1);; i = (i + 1) & (w->cap - 1)) {
+        if (w->e[i].key == index + 1)
+            return &w->e[i];
+        if (!w->e[i].key)
+            return NULL;
+    }
+}
+
+/* records the copy of block `index` last written, returns 0 or -1 with errno set */
+static int written_add(struct written *w, uint64_t index, int copy) {
+    struct written_entry *e = written_find(w, index);
+    if (e) {
+        e->copy = copy;
+        return 0;
+    }
+
+    if (2 * (w->n + 1) > w->cap) {
+        struct written old = *w;
+        size_t cap = old.cap ? old.cap * 2 : 64;
+        w->e = calloc(cap, sizeof *w->e);
+        if (!w->e) {
+            *w = old;
+            errno = ENOMEM;
+            return -1;
+        }
+        w->n = 0;
+        w->cap = cap;
+        for (size_t i = 0; i < old.cap; i++)
+            if (old.e[i].key)
+                written_add(w, old.e[i].key - 1, old.e[i].copy);
+        free(old.e);
+    }
+
+    size_t i = written_hash(w, index + 1);
+    while (w->e[i].key)
+        i = (i + 1) & (w->cap - 1);
+    w->e[i] = (struct written_entry){ index + 1, copy };
+    w->n++;
+    return 0;
+}
+
+static void written_clear(struct written *w) {
+    free(w->e);
+    *w = (struct written){0};
+}
+
+static uint64_t nblocks(off_t size) {
+    return ((uint64_t)size + TAGFS_BLOCK_SIZE - 1) / TAGFS_BLOCK_SIZE;
+}
+
+static int maybe_compressed(off_t size) {
+    return size >= HEADER_SIZE && (size - HEADER_SIZE) % SLOT_SIZE == 0;
+}
+
+static int check_header(const struct header *h) {
+    if (memcmp(h->magic, MAGIC, sizeof MAGIC) != 0)
+        return 0;
+    if (h->version != VERSION || h->block_size != TAGFS_BLOCK_SIZE) {
+        log_warn("unsupported compressed file, version %u, blocks of %u bytes\n",
+                 h->version, h->block_size);
+        return 0;
+    }
+    return 1;
+}
+
+static size_t capacity(void) {
+    if (tagfs.block_cache < 0)
+        return 0;
+    return tagfs.block_cache ? (size_t)tagfs.block_cache : BLOCK_CACHE_DEFAULT;
+}
+
+static size_t bucket(int64_t id, uint64_t index) {
+    uint64_t h = ((uint64_t)id * 0x9E3779B97F4A7C15u) ^ (index * 0xC2B2AE3D27D4EB4Fu);
+    return (h >> 32) & (nbuckets - 1);
+}
+
+static void lru_unlink(struct block *b) {
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+}
+
+static void lru_push(struct block *b) {
+    b->next = lru.next;
+    b->prev = &lru;
+    lru.next->prev = b;
+    lru.next = b;
+}
+
+static struct block *lookup(int64_t id, uint64_t index) {
+    if (!nbuckets)
+        return NULL;
+    struct block *b = buckets[bucket(id, index)];
+    while (b && (b->id != id || b->index != index))
+        b = b->hnext;
+    return b;
+}
+
+/* takes a block out of the cache, it is freed once unused */
+static void uncache(struct block *b) {
+    struct block **p = &buckets[bucket(b->id, b->index)];
+    while (*p != b)
+        p = &(*p)->hnext;
+    *p = b->hnext;
+    lru_unlink(b);
+    b->cached = 0;
+    count--;
+}
+
+/* unlinks the least recently used blocks over `cap`, to be freed by the caller */
+static struct block *evict(size_t cap) {
+    struct block *list = NULL;
+    for (struct block *b = lru.prev, *prev; b != &lru && count > cap; b = prev) {
+        prev = b->prev;
+        if (b->refs)
+            continue;
+        uncache(b);
+        b->hnext = list;
+        list = b;
+    }
+    return list;
+}
+
+static void free_list(struct block *list) {
+    for (struct block *next; list; list = next) {
+        next = list->hnext;
+        free(list);
+    }
+}
+
+/* drops the cached blocks of `id` from `from` on */
+static void forget(int64_t id, uint64_t from) {
+    struct block *list = NULL;
+
+    pthread_mutex_lock(&lock);
+    for (struct block *b = lru.next, *next; b != &lru; b = next) {
+        next = b->next;
+        if (b->id != id || b->index < from)
+            continue;
+        uncache(b);
+        if (!b->refs) {
+            b->hnext = list;
+            list = b;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    free_list(list);
+}
+
+
+static uint32_t copy_crc(const struct copy *h, const char *data) {
+    uLong crc = crc32(0, (const Bytef *)h, offsetof(struct copy, crc));
+    return crc32(crc, (const Bytef *)data, h->len);
+}
+
+/* whether copy `a` was written after copy `b` */
+static int newer(const struct copy *a, const struct copy *b) {
+    return a->gen && (!b->gen || (int32_t)(a->gen - b->gen) > 0);
+}
+
+/* the headers of both copies of block `index`, zeros past the end of the file */
+static int read_copies(struct tagfs_file *f, uint64_t index, struct copy h[2]) {
+    for (int c = 0; c < 2; c++) {
+        ssize_t n = pread(f->fd, &h[c], sizeof h[c], copy_offset(index, c));
+        if (n < 0) {
+            log_err("pread: %s\n", strerror(errno));
+            return -1;
+        }
+        if ((size_t)n < sizeof h[c])
+            memset(&h[c], 0, sizeof h[c]);
+    }
+    return 0;
+}
+
+/*
+ * Reads what follows the header `h` of copy `c` into `buf`, returns 0, 1
+ * if the copy is torn, or -1.
+ */
+static int read_copy(struct tagfs_file *f, uint64_t index, int c, const struct copy *h, char *buf) {
+    if (!h->gen)
+        return 0;
+    if (h->len > COPY_SIZE - sizeof *h
+        || ((h->flags & COPY_STORED) && h->len != TAGFS_BLOCK_SIZE))
+        return 1;
+
+    off_t off = copy_offset(index, c) + sizeof *h;
+    size_t n = 0;
+    while (n < h->len) {
+        ssize_t m = pread(f->fd, buf + n, h->len - n, off + n);
+        if (m < 0) {
+            log_err("pread: %s\n", strerror(errno));
+            return -1;
+        }
+        if (m == 0)
+            return 1;
+        n += m;
+    }
+    return copy_crc(h, buf) != h->crc;
+}
+
+/* the version of block `index` that was completely written last */
+static int load(struct tagfs_file *f, uint64_t index, char *out) {
+    char *buf = malloc(COPY_SIZE);
+    struct copy h[2];
+    int res = -1;
+
+    if (!buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (read_copies(f, index, h) < 0)
+        goto end;
+
+    int c = newer(&h[1], &h[0]);
+    int rc = read_copy(f, index, c, &h[c], buf);
+    if (rc > 0) {
+        log_warn("block %" PRIu64 " of file %" PRId64 " was torn, reading its previous version\n",
+                 index, f->id);
+        c = !c;
+        rc = read_copy(f, index, c, &h[c], buf);
+    }
+    if (rc > 0) {
+        log_err("block %" PRIu64 " of file %" PRId64 " is corrupted\n", index, f->id);
+        errno = EIO;
+    }
+    if (rc != 0)
+        goto end;
+
+    if (!h[c].gen || !h[c].len) {
+        memset(out, 0, TAGFS_BLOCK_SIZE);
+    } else if (h[c].flags & COPY_STORED) {
+        memcpy(out, buf, TAGFS_BLOCK_SIZE);
+    } else {
+        uLongf len = TAGFS_BLOCK_SIZE;
+        int zrc = uncompress((Bytef *)out, &len, (const Bytef *)buf, h[c].len);
+        if (zrc != Z_OK || len != TAGFS_BLOCK_SIZE) {
+            log_err("block %" PRIu64 " of file %" PRId64 ": %s\n", index, f->id,
+                    zrc == Z_OK ? "short block" : zError(zrc));
+            errno = EIO;
+            goto end;
+        }
+    }
+    res = 0;
+
+end:
+    free(buf);
+    return res;
+}
+
+/* frees the disk space from `off` to the end of copy `c` */
+static void punch(struct tagfs_file *f, uint64_t index, int c, off_t off) {
+    off_t end = copy_offset(index, c) + COPY_SIZE;
+    off = (off + 4095) & ~(off_t)4095;
+    if (off >= end)
+        return;
+    if (fallocate(f->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, end - off) < 0
+        && errno != EOPNOTSUPP)
+        log_warn("fallocate: %s\n", strerror(errno));
+}
+
+/*
+ * Writes a new version of block `index`. Until the file is synced, the
+ * previous version stays in the other copy, to fall back to if a crash
+ * tears the write.
+ */
+static int store(struct tagfs_file *f, uint64_t index, const char *data) {
+    struct tagfs_shadow *s = f->shadow;
+    struct copy h[2];
+    int c, res = -1;
+
+    char *buf = malloc(sizeof *h + COPY_SIZE);
+    if (!buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (read_copies(f, index, h) < 0)
+        goto end;
+
+    struct written_entry *e = written_find(&s->current, index);
+    if (!e)
+        e = written_find(&s->syncing, index);
+    if (e) {
+        /* not synced since, the previous version is still there */
+        c = e->copy;
+    } else {
+        /* the last version, unless a crash tore it and the other one is what reads see */
+        int last = newer(&h[1], &h[0]);
+        int rc = read_copy(f, index, last, &h[last], buf);
+        if (rc < 0)
+            goto end;
+        c = rc ? last : !last;
+    }
+    if (written_add(&s->current, index, c) < 0)
+        goto end;
+
+    struct copy n = { .gen = h[!c].gen + 1 };
+    if (!n.gen)
+        n.gen = 1;
+    if (data[0] == 0 && memcmp(data, data + 1, TAGFS_BLOCK_SIZE - 1) == 0) {
+        /* a hole */
+    } else {
+        /* stored as is unless deflating saves something */
+        uLongf len = TAGFS_BLOCK_SIZE - 1;
+        int zrc = compress2((Bytef *)buf + sizeof n, &len, (const Bytef *)data,
+                            TAGFS_BLOCK_SIZE, Z_BEST_SPEED);
+        if (zrc == Z_OK) {
+            n.len = len;
+        } else if (zrc == Z_BUF_ERROR) {
+            memcpy(buf + sizeof n, data, TAGFS_BLOCK_SIZE);
+            n.len = TAGFS_BLOCK_SIZE;
+            n.flags = COPY_STORED;
+        } else {
+            log_err("compress2: %s\n", zError(zrc));
+            errno = EIO;
+            goto end;
+        }
+    }
+    n.crc = copy_crc(&n, buf + sizeof n);
+    memcpy(buf, &n, sizeof n);
+
+    off_t off = copy_offset(index, c);
+    ssize_t w = pwrite(f->fd, buf, sizeof n + n.len, off);
+    if (w != (ssize_t)(sizeof n + n.len)) {
+        if (w >= 0)
+            errno = EIO;
+        log_err("pwrite: %s\n", strerror(errno));
+        goto end;
+    }
+
+    punch(f, index, c, off + sizeof n + n.len);
+    res = 0;
+
+end:
+    free(buf);
+    return res;
+}
+
+/*
+ * Returns a reference to block `index` of `f`, with its data if `fill`,
+ * otherwise to be overwritten whole. Returns NULL with errno set on
+ * errors. The lock of `f` must be held.
+ */
+static struct block *acquire(struct tagfs_file *f, uint64_t index, int fill) {
+    struct block *b;
+    size_t cap = capacity();
+
+    pthread_mutex_lock(&lock);
+    b = lookup(f->id, index);
+    if (b) {
+        b->refs++;
+        lru_unlink(b);
+        lru_push(b);
+    }
+    pthread_mutex_unlock(&lock);
+    if (b)
+        return b;
+
+    b = malloc(sizeof *b + TAGFS_BLOCK_SIZE);
+    if (!b) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    *b = (struct block){ .id = f->id, .index = index, .refs = 1 };
+    if (fill && load(f, index, b->data) < 0) {
+        free(b);
+        return NULL;
+    }
+    if (!cap)
+        return b;
+
+    /* loaded outside of the lock, so a racing reader may beat us */
+    struct block *evicted = NULL;
+    pthread_mutex_lock(&lock);
+    struct block *other = lookup(f->id, index);
+    if (other) {
+        other->refs++;
+    } else {
+        if (!nbuckets) {
+            size_t n = 16;
+            while (n < 2 * cap)
+                n *= 2;
+            buckets = calloc(n, sizeof *buckets);
+            if (buckets)
+                nbuckets = n;
+        }
+        if (nbuckets) {
+            size_t i = bucket(f->id, index);
+            b->hnext = buckets[i];
+            buckets[i] = b;
+            b->cached = 1;
+            lru_push(b);
+            count++;
+            evicted = evict(cap);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    free_list(evicted);
+    if (other) {
+        free(b);
+        return other;
+    }
+    return b;
+}
+
+static void release(struct block *b, int invalid) {
+    pthread_mutex_lock(&lock);
+    if (invalid && b->cached)
+        uncache(b);
+    int unused = --b->refs == 0 && !b->cached;
+    pthread_mutex_unlock(&lock);
+
+    if (unused)
+        free(b);
+}
+
+static int write_header(struct tagfs_file *f, off_t size) {
+    struct header h = { .version = VERSION, .block_size = TAGFS_BLOCK_SIZE, .size = size };
+    memcpy(h.magic, MAGIC, sizeof MAGIC);
+
+    ssize_t w = pwrite(f->fd, &h, sizeof h, 0);
+    if (w != sizeof h) {
+        if (w >= 0)
+            errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Sets the size of the data, the lock of `f` being held for writing. The
+ * whole header is written, the backing file may have been truncated.
+ */
+static int resize(struct tagfs_file *f, off_t size) {
+    if (ftruncate(f->fd, slot_offset(nblocks(size))) < 0) {
+        log_err("ftruncate: %s\n", strerror(errno));
+        return -1;
+    }
+    if (write_header(f, size) < 0) {
+        log_err("pwrite: %s\n", strerror(errno));
+        return -1;
+    }
+    f->size = size;
+    return 0;
+}
+
+static int shadow_init(struct tagfs_file *f) {
+    f->shadow = calloc(1, sizeof *f->shadow);
+    if (!f->shadow) {
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_mutex_init(&f->shadow->sync_lock, NULL);
+    return 0;
+}
+
+int tagfs_compress_open(struct tagfs_file *f, int init) {
+    struct header h;
+    struct stat st;
+
+    if (fstat(f->fd, &st) < 0)
+        return -1;
+
+    if (init && tagfs.compress && st.st_size == 0) {
+        if (write_header(f, 0) < 0 || ftruncate(f->fd, HEADER_SIZE) < 0)
+            return -1;
+        f->compressed = 1;
+        f->size = 0;
+        return shadow_init(f);
+    }
+
+    if (!S_ISREG(st.st_mode) || !maybe_compressed(st.st_size))
+        return 0;
+    ssize_t n = pread(f->fd, &h, sizeof h, 0);
+    if (n < 0)
+        return -1;
+    if (n == sizeof h && check_header(&h)) {
+        f->compressed = 1;
+        f->size = h.size;
+        return shadow_init(f);
+    }
+    return 0;
+}
+
+int tagfs_compress_sync(struct tagfs_file *f, int datasync) {
+    struct tagfs_shadow *s = f->shadow;
+    if (!s)
+        return datasync ? fdatasync(f->fd) : fsync(f->fd);
+
+    pthread_mutex_lock(&s->sync_lock);
+    pthread_rwlock_wrlock(&f->lock);
+    s->syncing = s->current;
+    s->current = (struct written){0};
+    pthread_rwlock_unlock(&f->lock);
+
+    int res = datasync ? fdatasync(f->fd) : fsync(f->fd);
+    int e = errno;
+
+    pthread_rwlock_wrlock(&f->lock);
+    for (size_t i = 0; i < s->syncing.cap; i++) {
+        struct written_entry *w = &s->syncing.e[i];
+        if (!w->key)
+            continue;
+        uint64_t index = w->key - 1;
+        if (res < 0) {
+            /* their previous versions must stay, until the next sync */
+            if (!written_find(&s->current, index) && written_add(&s->current, index, w->copy) < 0)
+                log_warn("block %" PRIu64 " of file %" PRId64 " may not survive a crash\n",
+                         index, f->id);
+        } else if (!written_find(&s->current, index)) {
+            /* the last version is on disk, unless written again meanwhile */
+            punch(f, index, !w->copy, copy_offset(index, !w->copy));
+        }
+    }
+    written_clear(&s->syncing);
+    pthread_rwlock_unlock(&f->lock);
+    pthread_mutex_unlock(&s->sync_lock);
+
+    errno = e;
+    return res;
+}
+
+void tagfs_compress_close(struct tagfs_file *f) {
+    struct tagfs_shadow *s = f->shadow;
+
+    if (f->compressed) {
+        /* so that the next opening does not write over the previous versions */
+        if (s && s->current.n && tagfs_compress_sync(f, 1) < 0)
+            log_err("fdatasync: %s\n", strerror(errno));
+        forget(f->id, 0);
+    }
+    if (s) {
+        written_clear(&s->current);
+        pthread_mutex_destroy(&s->sync_lock);
+        free(s);
+        f->shadow = NULL;
+    }
+}
+
+int tagfs_compress_stat_at(int dirfd, const char *name, struct stat *st) {
+    struct header h;
+
+    if (!S_ISREG(st->st_mode) || !maybe_compressed(st->st_size))
+        return 0;
+
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t n = pread(fd, &h, sizeof h, 0);
+    int e = errno;
+    close(fd);
+    if (n < 0) {
+        errno = e;
+        return -1;
+    }
+
+    if (n == sizeof h && check_header(&h))
+        st->st_size = h.size;
+    return 0;
+}
+
+ssize_t tagfs_compress_read(struct tagfs_file *f, char *buf, size_t size, off_t offset) {
+    ssize_t res = 0;
+
+    pthread_rwlock_rdlock(&f->lock);
+    if (offset >= f->size)
+        goto end;
+    if ((off_t)size > f->size - offset)
+        size = f->size - offset;
+
+    while ((size_t)res < size) {
+        off_t pos = offset + res;
+        size_t in = pos % TAGFS_BLOCK_SIZE;
+        size_t n = TAGFS_BLOCK_SIZE - in;
+        if (n > size - res)
+            n = size - res;
+
+        struct block *b = acquire(f, pos / TAGFS_BLOCK_SIZE, 1);
+        if (!b) {
+            res = -errno;
+            goto end;
+        }
+        memcpy(buf + res, b->data + in, n);
+        release(b, 0);
+        res += n;
+    }
+
+end:
+    pthread_rwlock_unlock(&f->lock);
+    return res;
+}
+
+ssize_t tagfs_compress_write(struct tagfs_file *f, const char *buf, size_t size, off_t offset) {
+    ssize_t res = 0;
+
+    pthread_rwlock_wrlock(&f->lock);
+    while ((size_t)res < size) {
+        off_t pos = offset + res;
+        uint64_t index = pos / TAGFS_BLOCK_SIZE;
+        size_t in = pos % TAGFS_BLOCK_SIZE;
+        size_t n = TAGFS_BLOCK_SIZE - in;
+        if (n > size - res)
+            n = size - res;
+
+        /* blocks past the end only hold zeros */
+        off_t start = (off_t)index * TAGFS_BLOCK_SIZE;
+        int whole = n == TAGFS_BLOCK_SIZE;
+        struct block *b = acquire(f, index, !whole && start < f->size);
+        if (!b) {
+            res = res ? res : -errno;
+            break;
+        }
+        if (!whole && start >= f->size)
+            memset(b->data, 0, TAGFS_BLOCK_SIZE);
+        memcpy(b->data + in, buf + res, n);
+
+        if (store(f, index, b->data) < 0) {
+            int e = errno;
+            release(b, 1);
+            res = res ? res : -e;
+            break;
+        }
+        release(b, 0);
+        res += n;
+    }
+
+    if (res > 0 && offset + res > f->size && resize(f, offset + res) < 0)
+        res = -errno;
+    pthread_rwlock_unlock(&f->lock);
+    return res;
+}
+
+int tagfs_compress_truncate(struct tagfs_file *f, off_t size) {
+    int res = 0;
+
+    pthread_rwlock_wrlock(&f->lock);
+    if (size < f->size) {
+        /* the end of the last block must read as zeros if the file grows again */
+        size_t in = size % TAGFS_BLOCK_SIZE;
+        if (in) {
+            struct block *b = acquire(f, size / TAGFS_BLOCK_SIZE, 1);
+            if (!b) {
+                res = -errno;
+                goto end;
+            }
+            memset(b->data + in, 0, TAGFS_BLOCK_SIZE - in);
+            if (store(f, size / TAGFS_BLOCK_SIZE, b->data) < 0) {
+                res = -errno;
+                release(b, 1);
+                goto end;
+            }
+            release(b, 0);
+        }
+        forget(f->id, nblocks(size));
+    }
+
+    if (resize(f, size) < 0)
+        res = -errno;
+
+end:
+    pthread_rwlock_unlock(&f->lock);
+    return res;
+}
+
+/* holes are not tracked, the data is all there is */
+off_t tagfs_compress_lseek(struct tagfs_file *f, off_t offset, int whence) {
+    pthread_rwlock_rdlock(&f->lock);
+    off_t size = f->size;
+    pthread_rwlock_unlock(&f->lock);
+
+    if (offset < 0)
+        return -EINVAL;
+    if (offset >= size)
+        return -ENXIO;
+    switch (whence) {
+    case SEEK_DATA:
+        return offset;
+    case SEEK_HOLE:
+        return size;
+    default:
+        return -EINVAL;
+    }
+}
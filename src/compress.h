@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "file.h"
+
+/*
+ * Compressed backing files, used for files created or truncated while
+ * mounted with -o compress. Data is cut in blocks of TAGFS_BLOCK_SIZE
+ * bytes, each deflated on its own into a slot of the backing file whose
+ * position is given by the index of the block, the unused end of slots
+ * being punched out. Reads only inflate the blocks they touch, through a
+ * cache of tagfs.block_cache blocks, and writes only deflate again the
+ * blocks they change.
+ *
+ * A slot holds two copies of its block, each with a generation and a
+ * checksum. Blocks are written to the copy not holding the last version
+ * synced, so a write torn by a crash leaves that version to read instead.
+ * Once the file is synced, through tagfs_compress_sync() or on closing,
+ * the copies of previous versions are punched out.
+ *
+ * A header holds the size of the data. Backing files are kept exactly as
+ * long as their slots, so that a stat is enough to rule out most raw
+ * files before looking for the header.
+ */
+
+#define TAGFS_BLOCK_SIZE (64 * 1024)
+
+/*
+ * Looks for the header of `f`, or writes one if `init`, tagfs.compress
+ * is set and the file is empty. Returns 0 or -1 with errno set.
+ */
+int tagfs_compress_open(struct tagfs_file *f, int init);
+/* syncs a file being closed, drops its cached blocks */
+void tagfs_compress_close(struct tagfs_file *f);
+/* fsync or fdatasync, then frees the copies of previous versions, returns 0 or -1 with errno set */
+int tagfs_compress_sync(struct tagfs_file *f, int datasync);
+
+/* replaces st_size with the size of the data if `name` is compressed */
+int tagfs_compress_stat_at(int dirfd, const char *name, struct stat *st);
+
+/* like pread, pwrite, ftruncate and lseek, but return -errno */
+ssize_t tagfs_compress_read(struct tagfs_file *f, char *buf, size_t size, off_t offset);
+ssize_t tagfs_compress_write(struct tagfs_file *f, const char *buf, size_t size, off_t offset);
+int tagfs_compress_truncate(struct tagfs_file *f, off_t size);
+off_t tagfs_compress_lseek(struct tagfs_file *f, off_t offset, int whence);
@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "file.h"
+#include "log.h"
+#include "tagfs.h"
+#include "writeback.h"
+
+#define FD_CACHE_DEFAULT 256
+#define MIN_BUCKETS 64
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tagfs_file **buckets;
+static size_t nbuckets;
+static size_t count;
+/* unused files, most recently released first */
+static struct tagfs_file lru = { .prev = &lru, .next = &lru };
+static size_t nidle;
+
+static size_t capacity(void) {
+    if (tagfs.fd_cache < 0)
+        return 0;
+    return tagfs.fd_cache ? (size_t)tagfs.fd_cache : FD_CACHE_DEFAULT;
+}
+
+static size_t bucket(int64_t id, size_t n) {
+    uint64_t h = (uint64_t)id * 0x9E3779B97F4A7C15u;
+    return (h >> 32) & (n - 1);
+}
+
+static void lru_unlink(struct tagfs_file *f) {
+    f->prev->next = f->next;
+    f->next->prev = f->prev;
+    f->prev = f->next = NULL;
+    nidle--;
+}
+
+static void lru_push(struct tagfs_file *f) {
+    f->next = lru.next;
+    f->prev = &lru;
+    lru.next->prev = f;
+    lru.next = f;
+    nidle++;
+}
+
+static int grow(void) {
+    size_t n = nbuckets ? nbuckets * 2 : MIN_BUCKETS;
+    struct tagfs_file **b = calloc(n, sizeof *b);
+    if (!b)
+        return -1;
+
+    for (size_t i = 0; i < nbuckets; i++) {
+        struct tagfs_file *f = buckets[i], *next;
+        for (; f; f = next) {
+            next = f->hnext;
+            size_t j = bucket(f->id, n);
+            f->hnext = b[j];
+            b[j] = f;
+        }
+    }
+
+    free(buckets);
+    buckets = b;
+    nbuckets = n;
+    return 0;
+}
+
+static void unhash(struct tagfs_file *f) {
+    struct tagfs_file **p = &buckets[bucket(f->id, nbuckets)];
+    while (*p != f)
+        p = &(*p)->hnext;
+    *p = f->hnext;
+    count--;
+}
+
+/* closes a file removed from the cache, outside of the lock */
+static int destroy(struct tagfs_file *f) {
+    int res = 0;
+
+    tagfs_writeback_free(f);
+    tagfs_file_sync_stat(f);
+    tagfs_compress_close(f);
+    if (close(f->fd) < 0) {
+        res = -errno;
+        log_err("close: %s\n", strerror(errno));
+    }
+
+    pthread_rwlock_destroy(&f->lock);
+    free(f);
+    return res;
+}
+
+/* unlinks the least recently used files over `cap`, to be destroyed by the caller */
+static struct tagfs_file *evict(size_t cap) {
+    struct tagfs_file *list = NULL;
+    while (nidle > cap) {
+        struct tagfs_file *f = lru.prev;
+        lru_unlink(f);
+        unhash(f);
+        f->hnext = list;
+        list = f;
+    }
+    return list;
+}
+
+static struct tagfs_file *lookup(int64_t id) {
+    if (!nbuckets)
+        return NULL;
+    struct tagfs_file *f = buckets[bucket(id, nbuckets)];
+    while (f && f->id != id)
+        f = f->hnext;
+    return f;
+}
+
+struct tagfs_file *tagfs_file_get(int64_t id, const char *name, int flags, mode_t mode) {
+    struct tagfs_file *f;
+
+    pthread_mutex_lock(&lock);
+    f = lookup(id);
+    if (f) {
+        if (f->refs++ == 0)
+            lru_unlink(f);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (f) {
+        if ((flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+            tagfs_file_put(f);
+            errno = EEXIST;
+            return NULL;
+        }
+        if (flags & O_TRUNC) {
+            int rc = tagfs_writeback_flush_range(f, 0, SIZE_MAX);
+            if (rc == 0)
+                rc = f->compressed ? tagfs_compress_truncate(f, 0)
+                    : ftruncate(f->fd, 0) < 0 ? -errno : 0;
+            if (rc < 0) {
+                tagfs_file_put(f);
+                errno = -rc;
+                return NULL;
+            }
+            f->dirty = 1;
+        }
+        return f;
+    }
+
+    /* opened outside of the lock, so a racing open may beat us */
+    int fd = openat(tagfs.datadirfd, name, (tagfs.ro ? O_RDONLY : O_RDWR) | O_CLOEXEC
+                    | (flags & (O_CREAT | O_EXCL | O_TRUNC)), mode);
+    if (fd < 0)
+        return NULL;
+
+    f = calloc(1, sizeof *f);
+    if (!f) {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    f->id = id;
+    f->fd = fd;
+    f->refs = 1;
+    f->dirty = (flags & O_TRUNC) != 0;
+    pthread_rwlock_init(&f->lock, NULL);
+    if (tagfs_compress_open(f, flags & (O_CREAT | O_TRUNC)) < 0
+        || tagfs_writeback_init(f) < 0) {
+        int e = errno;
+        log_err("cannot open %s: %s\n", name, strerror(e));
+        f->dirty = 0;
+        destroy(f);
+        errno = e;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+    struct tagfs_file *other = lookup(id);
+    if (other) {
+        if (other->refs++ == 0)
+            lru_unlink(other);
+    } else if (count >= nbuckets && grow() < 0) {
+        pthread_mutex_unlock(&lock);
+        f->dirty = 0;
+        destroy(f);
+        errno = ENOMEM;
+        return NULL;
+    } else {
+        size_t b = bucket(id, nbuckets);
+        f->hnext = buckets[b];
+        buckets[b] = f;
+        count++;
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (other) {
+        /* both refer to the same file, O_TRUNC already happened on ours */
+        if (flags & O_TRUNC)
+            other->dirty = 1;
+        /* which may have dropped the header of theirs, or written one */
+        if (other->compressed && flags & O_TRUNC)
+            tagfs_compress_truncate(other, 0);
+        else if (!other->compressed && f->compressed && ftruncate(other->fd, 0) < 0)
+            log_err("ftruncate: %s\n", strerror(errno));
+        /* their blocks are cached under the same id */
+        f->compressed = 0;
+        f->dirty = 0;
+        destroy(f);
+        return other;
+    }
+    return f;
+}
+
+struct tagfs_file *tagfs_file_find(int64_t id) {
+    pthread_mutex_lock(&lock);
+    /* idle files have their attributes stored already */
+    struct tagfs_file *f = lookup(id);
+    if (f && f->refs)
+        f->refs++;
+    else
+        f = NULL;
+    pthread_mutex_unlock(&lock);
+    return f;
+}
+
+int tagfs_file_is_open(int64_t id) {
+    pthread_mutex_lock(&lock);
+    struct tagfs_file *f = lookup(id);
+    int res = f && f->refs;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+void tagfs_file_ref(struct tagfs_file *f) {
+    pthread_mutex_lock(&lock);
+    f->refs++;
+    pthread_mutex_unlock(&lock);
+}
+
+int tagfs_file_put(struct tagfs_file *f) {
+    int res = 0;
+
+    /* while we still hold a reference, idle files are not dirty */
+    tagfs_file_sync_stat(f);
+
+    pthread_mutex_lock(&lock);
+    if (--f->refs == 0)
+        lru_push(f);
+    struct tagfs_file *evicted = evict(capacity());
+    pthread_mutex_unlock(&lock);
+
+    for (struct tagfs_file *next; evicted; evicted = next) {
+        next = evicted->hnext;
+        int rc = destroy(evicted);
+        if (evicted == f)
+            res = rc;
+    }
+
+    return res;
+}
+
+void tagfs_file_clear(void) {
+    pthread_mutex_lock(&lock);
+    struct tagfs_file *evicted = evict(0);
+    pthread_mutex_unlock(&lock);
+
+    for (struct tagfs_file *next; evicted; evicted = next) {
+        next = evicted->hnext;
+        destroy(evicted);
+    }
+}
+
+int tagfs_file_fsync(struct tagfs_file *f, int datasync) {
+    /* which frees the previous versions of their blocks */
+    if (f->compressed)
+        return tagfs_compress_sync(f, datasync);
+    return datasync ? fdatasync(f->fd) : fsync(f->fd);
+}
+
+int tagfs_file_stat(struct tagfs_file *f, struct stat *st) {
+    int rc = tagfs_writeback_flush_range(f, 0, SIZE_MAX);
+    if (rc < 0) {
+        errno = -rc;
+        return -1;
+    }
+    if (fstat(f->fd, st) < 0)
+        return -1;
+
+    if (f->compressed) {
+        pthread_rwlock_rdlock(&f->lock);
+        st->st_size = f->size;
+        pthread_rwlock_unlock(&f->lock);
+    }
+    return 0;
+}
+
+int tagfs_file_sync_stat(struct tagfs_file *f) {
+    struct stat st;
+
+    if (!atomic_exchange(&f->dirty, 0))
+        return 0;
+
+    if (tagfs_file_stat(f, &st) < 0) {
+        log_err("fstat: %s\n", strerror(errno));
+        f->dirty = 1;
+        return -1;
+    }
+
+    if (tagfs_set_file_stat(f->id, &st) < 0) {
+        f->dirty = 1;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ * A backing file, what fi->fh points to. Opens of the same file share
+ * it: it is refcounted and, once unused, kept open in an LRU of at most
+ * tagfs.fd_cache entries.
+ */
+struct tagfs_file {
+    int64_t id;
+    int fd;
+    /* written to since its cached attributes were last updated */
+    atomic_bool dirty;
+    /* written to since the last sync round, see sync.h */
+    atomic_bool unsynced;
+    /* set once opened, see compress.h */
+    int compressed;
+    /* of the data of compressed files, which hold the lock to change their blocks */
+    off_t size;
+    pthread_rwlock_t lock;
+    /* of compressed files, blocks written since they were synced */
+    struct tagfs_shadow *shadow;
+    /* small writes not written yet, see writeback.h */
+    struct tagfs_writeback *wb;
+
+    /* protected by the cache lock */
+    unsigned refs;
+    struct tagfs_file *hnext;
+    struct tagfs_file *prev, *next;
+};
+
+#define TAGFS_FILE(fi) ((struct tagfs_file *)(uintptr_t)(fi)->fh)
+
+/*
+ * Returns a reference to the backing file of `id`, opening `name` with
+ * `flags` and `mode` if it is not cached. O_CREAT, O_EXCL and O_TRUNC
+ * are honoured, the access mode is always O_RDWR, or O_RDONLY on
+ * replicas. Returns NULL with errno set on errors.
+ */
+struct tagfs_file *tagfs_file_get(int64_t id, const char *name, int flags, mode_t mode);
+/* a reference to the backing file of `id` if it is open, NULL otherwise */
+struct tagfs_file *tagfs_file_find(int64_t id);
+/* non-zero if `id` is open, whose stored attributes may lag behind */
+int tagfs_file_is_open(int64_t id);
+/* takes another reference to a file the caller holds */
+void tagfs_file_ref(struct tagfs_file *f);
+/* drops a reference, returns 0 or -errno if the file had to be closed and failed */
+int tagfs_file_put(struct tagfs_file *f);
+/* closes every unused file */
+void tagfs_file_clear(void);
+
+/* after changing the backing file */
+static inline void tagfs_file_touch(struct tagfs_file *f) {
+    /* avoid bouncing the cache line when it is already set */
+    if (!atomic_load_explicit(&f->dirty, memory_order_relaxed))
+        atomic_store_explicit(&f->dirty, 1, memory_order_relaxed);
+}
+
+/* fsync or fdatasync, returns 0 or -1 with errno set */
+int tagfs_file_fsync(struct tagfs_file *f, int datasync);
+/* fstat, with the size of the data for compressed files, after writing buffered writes */
+int tagfs_file_stat(struct tagfs_file *f, struct stat *st);
+/* stores the attributes of the backing file if it is dirty */
+int tagfs_file_sync_stat(struct tagfs_file *f);
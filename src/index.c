@@ -0,0 +1,967 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "index.h"
+#include "log.h"
+#include "sql_queries.h"
+#include "tagfs.h"
+
+#define INDEX_NAME ".yatagfs.idx"
+#define INDEX_TMP_NAME ".yatagfs.idx.tmp"
+#define INDEX_MAGIC "YTFSIDX\0"
+#define INDEX_VERSION 1
+/* seconds without changes before rebuilding, and after a failed build */
+#define QUIET 1
+#define RETRY 60
+/* rebuilds take at most one DUTY-th of the time */
+#define DUTY 10
+/* rows or files read by each transaction of a build */
+#define CHUNK 4096
+
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t ntags;
+    uint32_t nfiles;
+    uint32_t nposts;
+    uint64_t generation;
+    uint64_t strings_size;
+    /* of everything after the header */
+    uint64_t checksum;
+};
+
+struct index_entry {
+    int64_t id;
+    /* offset of the NUL-terminated name in the string pool */
+    uint32_t name;
+    uint32_t len;
+};
+
+struct index {
+    void *map;
+    size_t size;
+    /* of INDEX_NAME when mapped, which the writer replaces by renaming */
+    ino_t ino;
+    const struct index_header *hdr;
+    /* sorted by name */
+    const struct index_entry *tags;
+    const struct index_entry *files;
+    /* files of tag t, by index, are tag_files[tag_off[t]..tag_off[t + 1]] */
+    const uint32_t *tag_off;
+    const uint32_t *tag_files;
+    const uint32_t *file_off;
+    const uint32_t *file_tags;
+    const char *strings;
+};
+
+struct layout {
+    size_t tags, files, tag_off, tag_files, file_off, file_tags, strings, size;
+};
+
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct index *current;
+/* the current snapshot matches the database */
+static atomic_bool fresh;
+static atomic_uint_fast64_t mutations;
+/* of the last INDEX_NAME looked at by tagfs_index_reload() */
+static ino_t reloaded;
+
+static atomic_bool running;
+static atomic_bool stopping;
+static pthread_t thread;
+static pthread_mutex_t thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t thread_cond = PTHREAD_COND_INITIALIZER;
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+static struct layout layout_of(uint32_t ntags, uint32_t nfiles, uint32_t nposts,
+                               uint64_t strings_size) {
+    struct layout l;
+    l.tags = align8(sizeof(struct index_header));
+    l.files = l.tags + (size_t)ntags * sizeof(struct index_entry);
+    l.tag_off = l.files + (size_t)nfiles * sizeof(struct index_entry);
+    l.tag_files = align8(l.tag_off + ((size_t)ntags + 1) * sizeof(uint32_t));
+    l.file_off = align8(l.tag_files + (size_t)nposts * sizeof(uint32_t));
+    l.file_tags = align8(l.file_off + ((size_t)nfiles + 1) * sizeof(uint32_t));
+    l.strings = align8(l.file_tags + (size_t)nposts * sizeof(uint32_t));
+    l.size = l.strings + strings_size;
+    return l;
+}
+
+static uint64_t checksum(const unsigned char *p, size_t n) {
+    uint64_t h = 0xcbf29ce484222325u;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof w);
+        h = (h ^ w) * 0x100000001b3u;
+        h ^= h >> 32;
+    }
+    for (; i < n; i++)
+        h = (h ^ p[i]) * 0x100000001b3u;
+    return h;
+}
+
+static int64_t db_generation(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    int64_t gen = -1;
+
+    if (sqlite3_prepare_v2(db, tagfs_sql_get_generation, -1, &stmt, NULL) != SQLITE_OK) {
+        log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        gen = sqlite3_column_int64(stmt, 0);
+    else
+        log_err("sqlite3_step: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return gen;
+}
+
+/* maps INDEX_NAME, checking everything but the checksum */
+static struct index *index_map(void) {
+    struct index *idx = NULL;
+    struct stat st;
+    void *map = MAP_FAILED;
+
+    int fd = openat(tagfs.datadirfd, INDEX_NAME, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            log_warn("cannot open index: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct index_header)) {
+        log_warn("index is truncated\n");
+        goto end;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        log_warn("cannot map index: %s\n", strerror(errno));
+        goto end;
+    }
+
+    const struct index_header *hdr = map;
+    if (memcmp(hdr->magic, INDEX_MAGIC, sizeof hdr->magic) != 0
+        || hdr->version != INDEX_VERSION) {
+        log_warn("index has an unknown format\n");
+        goto end;
+    }
+
+    struct layout l = layout_of(hdr->ntags, hdr->nfiles, hdr->nposts, hdr->strings_size);
+    if (l.size != (size_t)st.st_size) {
+        log_warn("index is truncated\n");
+        goto end;
+    }
+
+    idx = malloc(sizeof *idx);
+    if (!idx)
+        goto end;
+
+    const char *base = map;
+    *idx = (struct index){
+        .map = map,
+        .size = l.size,
+        .ino = st.st_ino,
+        .hdr = hdr,
+        .tags = (const void *)(base + l.tags),
+        .files = (const void *)(base + l.files),
+        .tag_off = (const void *)(base + l.tag_off),
+        .tag_files = (const void *)(base + l.tag_files),
+        .file_off = (const void *)(base + l.file_off),
+        .file_tags = (const void *)(base + l.file_tags),
+        .strings = base + l.strings,
+    };
+    madvise(map, l.size, MADV_WILLNEED);
+    map = MAP_FAILED;
+
+end:
+    if (map != MAP_FAILED)
+        munmap(map, st.st_size);
+    close(fd);
+    return idx;
+}
+
+static void index_unmap(struct index *idx) {
+    if (!idx)
+        return;
+    munmap(idx->map, idx->size);
+    free(idx);
+}
+
+/* replaces the current snapshot, which is fresh if it is of generation `gen` */
+static void index_swap(struct index *idx, int64_t gen) {
+    pthread_rwlock_wrlock(&lock);
+    struct index *old = current;
+    current = idx;
+    fresh = 0;
+    if (idx && (int64_t)idx->hdr->generation == gen) {
+        uint_fast64_t m = mutations;
+        fresh = 1;
+        /* pairs with tagfs_index_invalidate() */
+        if (mutations != m || db_generation(tagfs.db) != gen)
+            fresh = 0;
+    }
+    pthread_rwlock_unlock(&lock);
+
+    index_unmap(old);
+}
+
+void tagfs_index_open(void) {
+    if (tagfs.noindex)
+        return;
+
+    struct index *idx = index_map();
+    if (!idx)
+        return;
+
+    index_swap(idx, db_generation(tagfs.db));
+    if (fresh)
+        log_info("using index of generation %" PRIu64 "\n", idx->hdr->generation);
+    else
+        log_info("index is stale, it will be rebuilt\n");
+}
+
+void tagfs_index_close(void) {
+    index_swap(NULL, -1);
+    reloaded = 0;
+}
+
+void tagfs_index_invalidate(void) {
+    mutations++;
+    fresh = 0;
+}
+
+/* bounds checks, for snapshots whose checksum was not verified yet */
+static const char *entry_name(const struct index *idx, const struct index_entry *e) {
+    if ((uint64_t)e->name + e->len >= idx->hdr->strings_size)
+        return NULL;
+    return idx->strings + e->name;
+}
+
+static int cmp_name(const struct index *idx, const struct index_entry *e,
+                    struct tagfs_str name, int *valid) {
+    const char *s = entry_name(idx, e);
+    if (!s) {
+        *valid = 0;
+        return 0;
+    }
+    size_t n = e->len < name.len ? e->len : name.len;
+    int c = memcmp(s, name.ptr, n);
+    if (c)
+        return c;
+    return (e->len > name.len) - (e->len < name.len);
+}
+
+/* index of `name` in `entries`, -1 if absent, TAGFS_INDEX_MISS if corrupted */
+static int64_t find(const struct index *idx, const struct index_entry *entries,
+                    uint32_t n, struct tagfs_str name) {
+    size_t lo = 0, hi = n;
+    int valid = 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = cmp_name(idx, &entries[mid], name, &valid);
+        if (!valid)
+            return TAGFS_INDEX_MISS;
+        if (c == 0)
+            return mid;
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+static int posts(const struct index *idx, const uint32_t *off, uint32_t i,
+                 uint32_t *begin, uint32_t *end) {
+    *begin = off[i];
+    *end = off[i + 1];
+    return *begin <= *end && *end <= idx->hdr->nposts ? 0 : -1;
+}
+
+static int contains(const uint32_t *list, uint32_t begin, uint32_t end, uint32_t v) {
+    while (begin < end) {
+        uint32_t mid = begin + (end - begin) / 2;
+        if (list[mid] == v)
+            return 1;
+        if (list[mid] < v)
+            begin = mid + 1;
+        else
+            end = mid;
+    }
+    return 0;
+}
+
+/* takes the read lock, NULL if there is no fresh snapshot */
+static const struct index *acquire(void) {
+    if (!fresh)
+        return NULL;
+    pthread_rwlock_rdlock(&lock);
+    if (!fresh || !current) {
+        pthread_rwlock_unlock(&lock);
+        return NULL;
+    }
+    return current;
+}
+
+static void release(void) {
+    pthread_rwlock_unlock(&lock);
+}
+
+int64_t tagfs_index_get_tag(struct tagfs_str name) {
+    const struct index *idx = acquire();
+    if (!idx)
+        return TAGFS_INDEX_MISS;
+
+    int64_t i = find(idx, idx->tags, idx->hdr->ntags, name);
+    int64_t res = i >= 0 ? idx->tags[i].id : i == -1 ? 0 : i;
+    release();
+    return res;
+}
+
+int64_t tagfs_index_get_file(struct tagfs_str name) {
+    const struct index *idx = acquire();
+    if (!idx)
+        return TAGFS_INDEX_MISS;
+
+    int64_t i = find(idx, idx->files, idx->hdr->nfiles, name);
+    int64_t res = i >= 0 ? idx->files[i].id : i == -1 ? 0 : i;
+    release();
+    return res;
+}
+
+int64_t tagfs_index_has_file_tags(struct tagfs_str name, const struct tagfs_str *tags, size_t ntags) {
+    const struct index *idx = acquire();
+    if (!idx)
+        return TAGFS_INDEX_MISS;
+
+    int64_t res;
+    uint32_t begin, end;
+    int64_t f = find(idx, idx->files, idx->hdr->nfiles, name);
+    if (f < 0) {
+        res = f == -1 ? 0 : f;
+        goto end;
+    }
+    if (posts(idx, idx->file_off, f, &begin, &end) < 0) {
+        res = TAGFS_INDEX_MISS;
+        goto end;
+    }
+
+    res = idx->files[f].id;
+    for (size_t i = 0; i < ntags; i++) {
+        int64_t t = find(idx, idx->tags, idx->hdr->ntags, tags[i]);
+        if (t == TAGFS_INDEX_MISS) {
+            res = t;
+            goto end;
+        }
+        if (t < 0 || !contains(idx->file_tags, begin, end, t)) {
+            res = 0;
+            goto end;
+        }
+    }
+
+end:
+    release();
+    return res;
+}
+
+int tagfs_index_tags_not_in(const struct tagfs_str *tags, size_t ntags,
+                            tagfs_index_fn fn, void *ctx) {
+    const struct index *idx = acquire();
+    if (!idx)
+        return TAGFS_INDEX_MISS;
+
+    int64_t *skip = tagfs_arena_alloc(ntags * sizeof *skip);
+    if (ntags && !skip) {
+        release();
+        return TAGFS_INDEX_MISS;
+    }
+    for (size_t i = 0; i < ntags; i++)
+        skip[i] = find(idx, idx->tags, idx->hdr->ntags, tags[i]);
+
+    for (uint32_t t = 0; t < idx->hdr->ntags; t++) {
+        size_t i = 0;
+        while (i < ntags && skip[i] != t)
+            i++;
+        if (i < ntags)
+            continue;
+        const char *name = entry_name(idx, &idx->tags[t]);
+        if (name && fn(ctx, name))
+            break;
+    }
+
+    release();
+    return 0;
+}
+
+int tagfs_index_files_in_tags(const struct tagfs_str *tags, size_t ntags,
+                              tagfs_index_fn fn, void *ctx) {
+    const struct index *idx = acquire();
+    if (!idx)
+        return TAGFS_INDEX_MISS;
+
+    int res = 0;
+    uint32_t begin = 0, end = idx->hdr->nfiles;
+    const uint32_t *list = NULL;
+    uint32_t (*ranges)[2] = tagfs_arena_alloc(ntags * sizeof *ranges);
+    if (ntags && !ranges) {
+        res = TAGFS_INDEX_MISS;
+        goto end;
+    }
+
+    /* walk the shortest posting list, look up the others */
+    size_t shortest = 0;
+    for (size_t i = 0; i < ntags; i++) {
+        int64_t t = find(idx, idx->tags, idx->hdr->ntags, tags[i]);
+        if (t == -1)
+            goto end;
+        if (t < 0 || posts(idx, idx->tag_off, t, &ranges[i][0], &ranges[i][1]) < 0) {
+            res = TAGFS_INDEX_MISS;
+            goto end;
+        }
+        if (ranges[i][1] - ranges[i][0] < ranges[shortest][1] - ranges[shortest][0])
+            shortest = i;
+    }
+    if (ntags) {
+        list = idx->tag_files;
+        begin = ranges[shortest][0];
+        end = ranges[shortest][1];
+    }
+
+    for (uint32_t p = begin; p < end; p++) {
+        uint32_t f = list ? list[p] : p;
+        if (f >= idx->hdr->nfiles)
+            continue;
+        size_t i = 0;
+        while (i < ntags
+               && (i == shortest || contains(idx->tag_files, ranges[i][0], ranges[i][1], f)))
+            i++;
+        if (i < ntags)
+            continue;
+        const char *name = entry_name(idx, &idx->files[f]);
+        if (name && fn(ctx, name))
+            break;
+    }
+
+end:
+    release();
+    return res;
+}
+
+int64_t tagfs_index_largest_tags(size_t n, char **names) {
+    const struct index *idx = acquire();
+    if (!idx)
+        return TAGFS_INDEX_MISS;
+
+    /* kept sorted by size, n is small */
+    uint32_t *top = tagfs_arena_alloc(n * sizeof *top);
+    size_t ntop = 0;
+    int64_t res = 0;
+    if (n && !top) {
+        res = TAGFS_INDEX_MISS;
+        goto end;
+    }
+    for (uint32_t t = 0; t < idx->hdr->ntags; t++) {
+        uint32_t size = idx->tag_off[t + 1] - idx->tag_off[t];
+        size_t i = ntop < n ? ntop++ : n;
+        for (; i > 0 && idx->tag_off[top[i - 1] + 1] - idx->tag_off[top[i - 1]] < size; i--)
+            if (i < n)
+                top[i] = top[i - 1];
+        if (i < n)
+            top[i] = t;
+    }
+
+    for (size_t i = 0; i < ntop; i++) {
+        const char *name = entry_name(idx, &idx->tags[top[i]]);
+        if (!name)
+            continue;
+        names[res] = strdup(name);
+        if (!names[res])
+            break;
+        res++;
+    }
+
+end:
+    release();
+    return res;
+}
+
+/* building */
+
+struct id_map {
+    int64_t id;
+    uint32_t i;
+};
+
+static int cmp_id_map(const void *a, const void *b) {
+    const struct id_map *x = a, *y = b;
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t map_id(const struct id_map *m, size_t n, int64_t id) {
+    struct id_map key = { .id = id };
+    const struct id_map *e = bsearch(&key, m, n, sizeof *m, cmp_id_map);
+    return e ? (int64_t)e->i : -1;
+}
+
+struct names {
+    struct index_entry *entries;
+    struct id_map *ids;
+    size_t n, cap;
+};
+
+struct strings {
+    char *buf;
+    size_t len, cap;
+};
+
+static int strings_add(struct strings *s, const char *str, size_t len, uint32_t *off) {
+    if (s->len + len + 1 > UINT32_MAX)
+        return -1;
+    if (s->len + len + 1 > s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 1 << 16;
+        while (cap < s->len + len + 1)
+            cap *= 2;
+        char *buf = realloc(s->buf, cap);
+        if (!buf)
+            return -1;
+        s->buf = buf;
+        s->cap = cap;
+    }
+    *off = s->len;
+    memcpy(s->buf + s->len, str, len);
+    s->buf[s->len + len] = '\0';
+    s->len += len + 1;
+    return 0;
+}
+
+/*
+ * Begins one of the short read transactions of a build, returns 0, 1 if
+ * the database changed since the first one, or -1.
+ */
+static int chunk_begin(sqlite3 *db, int64_t *gen) {
+    if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+        log_err("BEGIN: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    int64_t g = db_generation(db);
+    if (g >= 0 && *gen < 0)
+        *gen = g;
+    if (g < 0 || g != *gen) {
+        sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+        return g < 0 ? -1 : 1;
+    }
+    return 0;
+}
+
+/* reads names by chunks of CHUNK, returns 0, 1 if the database changed, or -1 */
+static int read_names(sqlite3 *db, int64_t *gen, const char *sql,
+                      struct names *names, struct strings *strings) {
+    sqlite3_stmt *stmt;
+    int res = -1, rc;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    size_t n;
+    do {
+        n = names->n;
+        res = chunk_begin(db, gen);
+        if (res != 0)
+            goto end;
+        res = -1;
+
+        /* after the last name read, names are never empty */
+        const struct index_entry *last = n ? &names->entries[n - 1] : NULL;
+        sqlite3_bind_text(stmt, 1, last ? strings->buf + last->name : "",
+                          last ? (int)last->len : 0, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, 2, CHUNK);
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            if (names->n == names->cap) {
+                size_t cap = names->cap ? names->cap * 2 : 1024;
+                struct index_entry *e = realloc(names->entries, cap * sizeof *e);
+                if (e)
+                    names->entries = e;
+                struct id_map *m = realloc(names->ids, cap * sizeof *m);
+                if (m)
+                    names->ids = m;
+                if (!e || !m || cap > UINT32_MAX)
+                    break;
+                names->cap = cap;
+            }
+            struct index_entry *e = &names->entries[names->n];
+            e->id = sqlite3_column_int64(stmt, 0);
+            e->len = sqlite3_column_bytes(stmt, 1);
+            if (strings_add(strings, (const char *)sqlite3_column_text(stmt, 1), e->len, &e->name) < 0)
+                break;
+            names->ids[names->n] = (struct id_map){ e->id, names->n };
+            names->n++;
+        }
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+            log_err("sqlite3_step: %s\n", sqlite3_errmsg(db));
+        sqlite3_reset(stmt);
+        sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+        if (rc != SQLITE_DONE)
+            goto end;
+    } while (names->n - n == CHUNK);
+
+    qsort(names->ids, names->n, sizeof *names->ids, cmp_id_map);
+    res = 0;
+
+end:
+    sqlite3_finalize(stmt);
+    return res;
+}
+
+/*
+ * Reads the (file, tag) pairs in the order of files, by chunks of CHUNK
+ * files, returns 0, 1 if the database changed, or -1.
+ */
+static int read_pairs(sqlite3 *db, int64_t *gen, const struct names *tags,
+                      const struct names *files, const struct strings *strings,
+                      uint32_t **pairs, size_t *npairs) {
+    sqlite3_stmt *stmt;
+    size_t cap = 0;
+    int res = -1, rc;
+
+    if (sqlite3_prepare_v2(db, tagfs_sql_get_index_files_tags, -1, &stmt, NULL) != SQLITE_OK) {
+        log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+
+    for (size_t i = 0; i < files->n; i += CHUNK) {
+        res = chunk_begin(db, gen);
+        if (res != 0)
+            goto end;
+        res = -1;
+
+        /* paths in (files[i - 1], files[j - 1]] */
+        size_t j = files->n - i > CHUNK ? i + CHUNK : files->n;
+        const struct index_entry *lo = i ? &files->entries[i - 1] : NULL;
+        const struct index_entry *hi = &files->entries[j - 1];
+        sqlite3_bind_text(stmt, 1, lo ? strings->buf + lo->name : "", lo ? (int)lo->len : 0, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, strings->buf + hi->name, hi->len, SQLITE_STATIC);
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            int64_t f = map_id(files->ids, files->n, sqlite3_column_int64(stmt, 0));
+            int64_t t = map_id(tags->ids, tags->n, sqlite3_column_int64(stmt, 1));
+            if (f < 0 || t < 0)
+                continue;
+            if (*npairs == cap) {
+                size_t c = cap ? cap * 2 : 4096;
+                /* posting offsets are 32 bits */
+                if (c > UINT32_MAX) {
+                    log_err("too many tags on files for the index\n");
+                    break;
+                }
+                uint32_t *p = realloc(*pairs, c * 2 * sizeof *p);
+                if (!p)
+                    break;
+                *pairs = p;
+                cap = c;
+            }
+            (*pairs)[2 * *npairs] = f;
+            (*pairs)[2 * *npairs + 1] = t;
+            (*npairs)++;
+        }
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+            log_err("sqlite3_step: %s\n", sqlite3_errmsg(db));
+        sqlite3_reset(stmt);
+        sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+        if (rc != SQLITE_DONE)
+            goto end;
+    }
+    res = 0;
+
+end:
+    sqlite3_finalize(stmt);
+    return res;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+/*
+ * writes INDEX_NAME from a consistent read of the database, returns its
+ * generation, -2 if the database changed meanwhile, or -1
+ */
+static int64_t index_build(void) {
+    sqlite3 *db = NULL;
+    struct names tags = {0}, files = {0};
+    struct strings strings = {0};
+    uint32_t *pairs = NULL, *buf32 = NULL;
+    char *out = NULL;
+    size_t npairs = 0;
+    int64_t gen = -1;
+    int rc, fd = -1;
+
+    rc = sqlite3_open_v2(tagfs.dbpath, &db, SQLITE_OPEN_READONLY, NULL);
+    if (rc != SQLITE_OK) {
+        log_err("cannot open SQLite database: %s\n", db ? sqlite3_errmsg(db) : sqlite3_errstr(rc));
+        goto end;
+    }
+    sqlite3_busy_timeout(db, 5000);
+
+    /*
+     * by short transactions, so that commits wait for one chunk at most,
+     * which all see the same generation, so the same database
+     */
+    int64_t g = -1;
+    rc = read_names(db, &g, tagfs_sql_get_index_tags, &tags, &strings);
+    if (rc == 0)
+        rc = read_names(db, &g, tagfs_sql_get_index_files, &files, &strings);
+    if (rc == 0)
+        rc = read_pairs(db, &g, &tags, &files, &strings, &pairs, &npairs);
+    if (rc != 0) {
+        if (rc > 0)
+            gen = -2;
+        goto end;
+    }
+
+    struct layout l = layout_of(tags.n, files.n, npairs, strings.len);
+    out = calloc(1, l.size);
+    if (!out)
+        goto end;
+
+    struct index_header *hdr = (void *)out;
+    memcpy(hdr->magic, INDEX_MAGIC, sizeof hdr->magic);
+    hdr->version = INDEX_VERSION;
+    hdr->ntags = tags.n;
+    hdr->nfiles = files.n;
+    hdr->nposts = npairs;
+    hdr->generation = g;
+    hdr->strings_size = strings.len;
+    memcpy(out + l.tags, tags.entries, tags.n * sizeof *tags.entries);
+    memcpy(out + l.files, files.entries, files.n * sizeof *files.entries);
+    memcpy(out + l.strings, strings.buf, strings.len);
+
+    /* tags to files: counting sort, files come in order already */
+    uint32_t *tag_off = (void *)(out + l.tag_off);
+    uint32_t *tag_files = (void *)(out + l.tag_files);
+    for (size_t i = 0; i < npairs; i++)
+        tag_off[pairs[2 * i + 1] + 1]++;
+    for (size_t t = 0; t < tags.n; t++)
+        tag_off[t + 1] += tag_off[t];
+    buf32 = malloc((tags.n + 1) * sizeof *buf32);
+    if (!buf32)
+        goto end;
+    memcpy(buf32, tag_off, (tags.n + 1) * sizeof *buf32);
+    for (size_t i = 0; i < npairs; i++)
+        tag_files[buf32[pairs[2 * i + 1]]++] = pairs[2 * i];
+
+    /* files to tags: pairs are grouped by file */
+    uint32_t *file_off = (void *)(out + l.file_off);
+    uint32_t *file_tags = (void *)(out + l.file_tags);
+    for (size_t i = 0; i < npairs; i++) {
+        file_off[pairs[2 * i] + 1]++;
+        file_tags[i] = pairs[2 * i + 1];
+    }
+    for (size_t f = 0; f < files.n; f++) {
+        file_off[f + 1] += file_off[f];
+        qsort(file_tags + file_off[f], file_off[f + 1] - file_off[f], sizeof *file_tags, cmp_u32);
+    }
+
+    hdr->checksum = checksum((unsigned char *)out + sizeof *hdr, l.size - sizeof *hdr);
+
+    fd = openat(tagfs.datadirfd, INDEX_TMP_NAME, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_err("openat: %s\n", strerror(errno));
+        goto end;
+    }
+    if (write_all(fd, out, l.size) < 0 || fsync(fd) < 0) {
+        log_err("cannot write index: %s\n", strerror(errno));
+        unlinkat(tagfs.datadirfd, INDEX_TMP_NAME, 0);
+        goto end;
+    }
+    if (renameat(tagfs.datadirfd, INDEX_TMP_NAME, tagfs.datadirfd, INDEX_NAME) < 0) {
+        log_err("renameat: %s\n", strerror(errno));
+        unlinkat(tagfs.datadirfd, INDEX_TMP_NAME, 0);
+        goto end;
+    }
+    gen = g;
+
+end:
+    if (fd >= 0)
+        close(fd);
+    sqlite3_close(db);
+    free(tags.entries);
+    free(tags.ids);
+    free(files.entries);
+    free(files.ids);
+    free(strings.buf);
+    free(pairs);
+    free(buf32);
+    free(out);
+    return gen;
+}
+
+static int verify(const struct index *idx) {
+    const unsigned char *p = idx->map;
+    return checksum(p + sizeof *idx->hdr, idx->size - sizeof *idx->hdr) == idx->hdr->checksum;
+}
+
+static int index_verify(void) {
+    pthread_rwlock_rdlock(&lock);
+    int ok = !current || verify(current);
+    pthread_rwlock_unlock(&lock);
+    return ok;
+}
+
+void tagfs_index_reload(int changed) {
+    struct stat st;
+
+    if (tagfs.noindex)
+        return;
+
+    /* commits leaving files, tags and files_tags alone leave it fresh */
+    if (changed && fresh) {
+        pthread_rwlock_rdlock(&lock);
+        if (current && (int64_t)current->hdr->generation != db_generation(tagfs.db))
+            tagfs_index_invalidate();
+        pthread_rwlock_unlock(&lock);
+    }
+    if (fresh && reloaded)
+        return;
+
+    if (fstatat(tagfs.datadirfd, INDEX_NAME, &st, 0) < 0) {
+        if (errno != ENOENT)
+            log_warn("cannot stat index: %s\n", strerror(errno));
+        return;
+    }
+    /* the one mapped holds its inode, which cannot have been reused */
+    if (st.st_ino == reloaded)
+        return;
+    reloaded = st.st_ino;
+
+    struct index *idx = index_map();
+    if (!idx)
+        return;
+    if (!verify(idx)) {
+        log_warn("index checksum mismatch, not using it\n");
+        index_unmap(idx);
+        index_swap(NULL, -1);
+        return;
+    }
+    reloaded = idx->ino;
+    index_swap(idx, db_generation(tagfs.db));
+    log_debug("reloaded index of generation %" PRIu64 "%s\n", idx->hdr->generation,
+              fresh ? "" : ", stale");
+}
+
+static void *index_main(void *arg) {
+    (void)arg;
+    uint_fast64_t seen = mutations;
+    /* CLOCK_MONOTONIC time before which not to build again */
+    uint64_t next = 0;
+
+    if (!index_verify()) {
+        log_warn("index checksum mismatch, rebuilding it\n");
+        index_swap(NULL, -1);
+    }
+
+    pthread_mutex_lock(&thread_lock);
+    while (!stopping) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += QUIET;
+        pthread_cond_timedwait(&thread_cond, &thread_lock, &ts);
+        if (stopping)
+            break;
+
+        /* wait for changes to settle */
+        uint_fast64_t m = mutations;
+        if (fresh || m != seen || now_ns() < next) {
+            seen = m;
+            continue;
+        }
+
+        pthread_mutex_unlock(&thread_lock);
+        uint64_t start = now_ns();
+        int64_t gen = index_build();
+        struct index *idx = gen >= 0 ? index_map() : NULL;
+        uint64_t end = now_ns();
+        next = end + (end - start) * (DUTY - 1);
+        if (idx) {
+            index_swap(idx, gen);
+            log_debug("rebuilt index of generation %" PRId64 "%s in %.3f s\n", gen,
+                      fresh ? "" : ", already stale", (end - start) / 1e9);
+        } else if (gen == -2) {
+            log_debug("database changed while rebuilding index, %.3f s lost\n", (end - start) / 1e9);
+        } else {
+            log_warn("cannot rebuild index, retrying in %d seconds\n", RETRY);
+            next = end + (uint64_t)RETRY * 1000000000;
+        }
+        pthread_mutex_lock(&thread_lock);
+    }
+    pthread_mutex_unlock(&thread_lock);
+
+    return NULL;
+}
+
+int tagfs_index_start(void) {
+    if (tagfs.noindex || running)
+        return 0;
+
+    stopping = 0;
+    running = 1;
+    if (pthread_create(&thread, NULL, index_main, NULL) != 0) {
+        running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void tagfs_index_stop(void) {
+    if (!atomic_exchange(&running, 0))
+        return;
+
+    pthread_mutex_lock(&thread_lock);
+    stopping = 1;
+    pthread_cond_signal(&thread_cond);
+    pthread_mutex_unlock(&thread_lock);
+    pthread_join(thread, NULL);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+/*
+ * Snapshot of the tags of every file, written next to the database as
+ * .yatagfs.idx and mmap'd. It holds the names of tags and files sorted
+ * for binary search, and CSR posting lists from tags to files and back.
+ *
+ * It records the generation of the database it was built from, which
+ * triggers bump on any change to files, tags or files_tags. It is only
+ * used while that generation is current, and is rebuilt in the
+ * background once changes settle, by short read transactions seeing the
+ * same generation.
+ */
+
+/* returned by lookups when there is no usable snapshot */
+#define TAGFS_INDEX_MISS (-2)
+
+/* maps the snapshot if it exists, never fails */
+void tagfs_index_open(void);
+void tagfs_index_close(void);
+
+/* the thread verifying the checksum of the snapshot and rebuilding it */
+int tagfs_index_start(void);
+void tagfs_index_stop(void);
+
+/* to be called once a change to files, tags or files_tags is committed */
+void tagfs_index_invalidate(void);
+
+/*
+ * For replicas, which do not build it. If `changed`, the database may
+ * have changed since the last call, and the snapshot stops being used if
+ * its generation is not current anymore. A snapshot that is not is
+ * mapped again once replaced, after verifying its checksum. The first
+ * call always maps it again.
+ */
+void tagfs_index_reload(int changed);
+
+/* like their tagfs_* counterparts */
+int64_t tagfs_index_get_tag(struct tagfs_str name);
+int64_t tagfs_index_get_file(struct tagfs_str name);
+int64_t tagfs_index_has_file_tags(struct tagfs_str name, const struct tagfs_str *tags, size_t ntags);
+
+/* names are NUL-terminated, a non-zero return stops the iteration */
+typedef int (*tagfs_index_fn)(void *ctx, const char *name);
+
+/* 0 once done, TAGFS_INDEX_MISS if nothing was listed */
+int tagfs_index_tags_not_in(const struct tagfs_str *tags, size_t ntags,
+                            tagfs_index_fn fn, void *ctx);
+int tagfs_index_files_in_tags(const struct tagfs_str *tags, size_t ntags,
+                              tagfs_index_fn fn, void *ctx);
+
+/*
+ * The names of the `n` tags with the most files, largest first, copied
+ * into `names`. Returns how many, or TAGFS_INDEX_MISS.
+ */
+int64_t tagfs_index_largest_tags(size_t n, char **names);
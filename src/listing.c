@@ -0,0 +1,511 @@
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "listing.h"
+#include "log.h"
+#include "tagfs.h"
+
+#define LISTING_CACHE_DEFAULT 4096
+#define MIN_BUCKETS 64
+/* of the budget a single entry may take */
+#define MAX_SHARE 4
+
+/* NUL-separated names, in the order they were listed */
+struct names {
+    char *buf;
+    size_t len, cap;
+    int valid;
+};
+
+struct listing {
+    uint64_t hash;
+    unsigned refs;
+    /* in the cache, otherwise freed by its last user */
+    int cached;
+    struct names halves[2];
+    struct listing *hnext;
+    struct listing *prev, *next;
+    size_t keylen;
+    char key[];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct listing **buckets;
+static size_t nbuckets;
+/* every cached entry, most recently used first */
+static struct listing lru = { .prev = &lru, .next = &lru };
+static size_t count;
+/* bytes taken by cached entries */
+static size_t used;
+/* bumped by every change, so that fills started before do not cache stale names */
+static atomic_uint_fast64_t epoch;
+static uint64_t hits, misses, evictions, invalidations;
+
+static size_t budget(void) {
+    if (tagfs.listing_cache < 0)
+        return 0;
+    return (size_t)(tagfs.listing_cache ? tagfs.listing_cache : LISTING_CACHE_DEFAULT) * 1024;
+}
+
+int tagfs_listing_enabled(void) {
+    return budget() > 0;
+}
+
+static uint64_t hash_key(const char *key, size_t len) {
+    uint64_t h = 0xcbf29ce484222325u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)key[i]) * 0x100000001b3u;
+    return h;
+}
+
+static int cmp_str(const void *a, const void *b) {
+    const struct tagfs_str *x = a, *y = b;
+    size_t n = x->len < y->len ? x->len : y->len;
+    int c = memcmp(x->ptr, y->ptr, n);
+    if (c)
+        return c;
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+int64_t tagfs_listing_key(const struct tagfs_str *tags, size_t ntags, struct tagfs_str *key) {
+    struct tagfs_str *sorted = tagfs_arena_alloc(ntags * sizeof *sorted);
+    size_t len = 0;
+    int64_t n = 0;
+
+    if (ntags) {
+        if (!sorted)
+            return -1;
+        memcpy(sorted, tags, ntags * sizeof *sorted);
+        qsort(sorted, ntags, sizeof *sorted, cmp_str);
+    }
+    for (size_t i = 0; i < ntags; i++)
+        len += sorted[i].len + 1;
+
+    /* names cannot hold slashes, which separate them */
+    char *buf = tagfs_arena_alloc(len + 1);
+    if (!buf)
+        return -1;
+    char *p = buf;
+    for (size_t i = 0; i < ntags; i++) {
+        if (i > 0 && cmp_str(&sorted[i - 1], &sorted[i]) == 0)
+            continue;
+        if (p != buf)
+            *p++ = '/';
+        memcpy(p, sorted[i].ptr, sorted[i].len);
+        p += sorted[i].len;
+        n++;
+    }
+    *p = '\0';
+
+    key->ptr = buf;
+    key->len = p - buf;
+    return n;
+}
+
+/* the next tag of `key` after `*pos`, 0 once there are none */
+static int key_next(const struct listing *l, size_t *pos, struct tagfs_str *tag) {
+    if (*pos >= l->keylen)
+        return 0;
+    const char *s = l->key + *pos;
+    const char *end = memchr(s, '/', l->keylen - *pos);
+    tag->ptr = s;
+    tag->len = end ? (size_t)(end - s) : l->keylen - *pos;
+    *pos += tag->len + 1;
+    return 1;
+}
+
+static int str_eq(struct tagfs_str a, struct tagfs_str b) {
+    return a.len == b.len && memcmp(a.ptr, b.ptr, a.len) == 0;
+}
+
+static int key_has(const struct listing *l, struct tagfs_str name) {
+    struct tagfs_str tag;
+    for (size_t pos = 0; key_next(l, &pos, &tag);)
+        if (str_eq(tag, name))
+            return 1;
+    return 0;
+}
+
+/* every tag of the key is in `tags` */
+static int key_within(const struct listing *l, const struct tagfs_str *tags, size_t ntags) {
+    struct tagfs_str tag;
+    for (size_t pos = 0; key_next(l, &pos, &tag);) {
+        size_t i = 0;
+        while (i < ntags && !str_eq(tag, tags[i]))
+            i++;
+        if (i == ntags)
+            return 0;
+    }
+    return 1;
+}
+
+static size_t entry_size(const struct listing *l) {
+    return sizeof *l + l->keylen + 1 + l->halves[0].cap + l->halves[1].cap;
+}
+
+static void half_drop(struct names *n) {
+    used -= n->cap;
+    free(n->buf);
+    *n = (struct names){0};
+}
+
+/* offset of `name` in `n`, or -1 */
+static ssize_t half_find(const struct names *n, struct tagfs_str name) {
+    for (size_t off = 0; off < n->len;) {
+        size_t len = strlen(n->buf + off);
+        if (len == name.len && memcmp(n->buf + off, name.ptr, len) == 0)
+            return off;
+        off += len + 1;
+    }
+    return -1;
+}
+
+static void half_remove(struct names *n, struct tagfs_str name) {
+    ssize_t off = half_find(n, name);
+    if (off < 0)
+        return;
+    memmove(n->buf + off, n->buf + off + name.len + 1, n->len - off - name.len - 1);
+    n->len -= name.len + 1;
+}
+
+static int half_append(struct names *n, struct tagfs_str name) {
+    if (n->len + name.len + 1 > n->cap) {
+        size_t cap = n->cap ? n->cap * 2 : 256;
+        while (cap < n->len + name.len + 1)
+            cap *= 2;
+        char *buf = realloc(n->buf, cap);
+        if (!buf)
+            return -1;
+        used += cap - n->cap;
+        n->buf = buf;
+        n->cap = cap;
+    }
+    memcpy(n->buf + n->len, name.ptr, name.len);
+    n->buf[n->len + name.len] = '\0';
+    n->len += name.len + 1;
+    return 0;
+}
+
+static size_t bucket(uint64_t hash, size_t n) {
+    return (hash >> 32) & (n - 1);
+}
+
+static void lru_unlink(struct listing *l) {
+    l->prev->next = l->next;
+    l->next->prev = l->prev;
+}
+
+static void lru_push(struct listing *l) {
+    l->next = lru.next;
+    l->prev = &lru;
+    lru.next->prev = l;
+    lru.next = l;
+}
+
+static int grow(void) {
+    size_t n = nbuckets ? nbuckets * 2 : MIN_BUCKETS;
+    struct listing **b = calloc(n, sizeof *b);
+    if (!b)
+        return -1;
+
+    for (size_t i = 0; i < nbuckets; i++) {
+        struct listing *l = buckets[i], *next;
+        for (; l; l = next) {
+            next = l->hnext;
+            size_t j = bucket(l->hash, n);
+            l->hnext = b[j];
+            b[j] = l;
+        }
+    }
+
+    free(buckets);
+    buckets = b;
+    nbuckets = n;
+    return 0;
+}
+
+static struct listing *lookup(struct tagfs_str key, uint64_t hash) {
+    if (!nbuckets)
+        return NULL;
+    struct listing *l = buckets[bucket(hash, nbuckets)];
+    while (l && (l->hash != hash || l->keylen != key.len || memcmp(l->key, key.ptr, key.len) != 0))
+        l = l->hnext;
+    return l;
+}
+
+/* takes an entry out of the cache, it is freed once unused */
+static void uncache(struct listing *l) {
+    struct listing **p = &buckets[bucket(l->hash, nbuckets)];
+    while (*p != l)
+        p = &(*p)->hnext;
+    *p = l->hnext;
+    lru_unlink(l);
+    l->cached = 0;
+    used -= entry_size(l);
+    count--;
+}
+
+static void destroy(struct listing *l) {
+    free(l->halves[0].buf);
+    free(l->halves[1].buf);
+    free(l);
+}
+
+static void free_list(struct listing *list) {
+    for (struct listing *next; list; list = next) {
+        next = list->hnext;
+        destroy(list);
+    }
+}
+
+/* uncaches `l`, adding it to `list` if nobody uses it */
+static void drop(struct listing *l, struct listing **list) {
+    uncache(l);
+    if (!l->refs) {
+        l->hnext = *list;
+        *list = l;
+    }
+}
+
+/* unlinks the least recently used entries over `cap` bytes, to be freed by the caller */
+static struct listing *evict(size_t cap) {
+    struct listing *list = NULL;
+    for (struct listing *l = lru.prev, *prev; l != &lru && used > cap; l = prev) {
+        prev = l->prev;
+        if (l->refs)
+            continue;
+        drop(l, &list);
+        evictions++;
+    }
+    return list;
+}
+
+int tagfs_listing_list(struct tagfs_str key, enum tagfs_listing_half half,
+                       tagfs_listing_fn fn, void *ctx) {
+    if (!tagfs_listing_enabled())
+        return TAGFS_LISTING_MISS;
+
+    uint64_t hash = hash_key(key.ptr, key.len);
+    pthread_mutex_lock(&lock);
+    struct listing *l = lookup(key, hash);
+    if (!l || !l->halves[half].valid) {
+        misses++;
+        pthread_mutex_unlock(&lock);
+        return TAGFS_LISTING_MISS;
+    }
+    hits++;
+    l->refs++;
+    lru_unlink(l);
+    lru_push(l);
+    pthread_mutex_unlock(&lock);
+
+    /* patches drop entries in use instead of changing them */
+    const struct names *n = &l->halves[half];
+    for (size_t off = 0; off < n->len;) {
+        const char *name = n->buf + off;
+        if (fn(ctx, name))
+            break;
+        off += strlen(name) + 1;
+    }
+
+    pthread_mutex_lock(&lock);
+    int unused = --l->refs == 0 && !l->cached;
+    pthread_mutex_unlock(&lock);
+    if (unused)
+        destroy(l);
+    return 0;
+}
+
+void tagfs_listing_fill_start(struct tagfs_listing_fill *f) {
+    *f = (struct tagfs_listing_fill){
+        .epoch = epoch,
+        .failed = !tagfs_listing_enabled(),
+    };
+}
+
+void tagfs_listing_fill_add(struct tagfs_listing_fill *f, const char *name) {
+    size_t len = strlen(name) + 1;
+
+    if (f->failed)
+        return;
+    if (f->len + len > f->cap) {
+        size_t cap = f->cap ? f->cap * 2 : 256;
+        while (cap < f->len + len)
+            cap *= 2;
+        char *buf = cap <= budget() / MAX_SHARE ? realloc(f->buf, cap) : NULL;
+        if (!buf) {
+            /* too large to be worth caching */
+            free(f->buf);
+            f->buf = NULL;
+            f->failed = 1;
+            return;
+        }
+        f->buf = buf;
+        f->cap = cap;
+    }
+    memcpy(f->buf + f->len, name, len);
+    f->len += len;
+}
+
+void tagfs_listing_fill_end(struct tagfs_listing_fill *f, struct tagfs_str key,
+                            enum tagfs_listing_half half, int complete) {
+    struct listing *evicted = NULL;
+
+    if (f->failed || !complete)
+        goto end;
+
+    uint64_t hash = hash_key(key.ptr, key.len);
+    pthread_mutex_lock(&lock);
+    if (f->epoch != epoch) {
+        pthread_mutex_unlock(&lock);
+        goto end;
+    }
+    struct listing *l = lookup(key, hash);
+    if (!l) {
+        if (count >= nbuckets && grow() < 0) {
+            pthread_mutex_unlock(&lock);
+            goto end;
+        }
+        l = calloc(1, sizeof *l + key.len + 1);
+        if (!l) {
+            pthread_mutex_unlock(&lock);
+            goto end;
+        }
+        l->hash = hash;
+        l->cached = 1;
+        l->keylen = key.len;
+        memcpy(l->key, key.ptr, key.len);
+        size_t b = bucket(hash, nbuckets);
+        l->hnext = buckets[b];
+        buckets[b] = l;
+        lru_push(l);
+        used += entry_size(l);
+        count++;
+    } else if (l->halves[half].valid) {
+        /* listed meanwhile by another thread */
+        pthread_mutex_unlock(&lock);
+        goto end;
+    }
+
+    half_drop(&l->halves[half]);
+    l->halves[half] = (struct names){ f->buf, f->len, f->cap, 1 };
+    used += f->cap;
+    f->buf = NULL;
+    evicted = evict(budget());
+    pthread_mutex_unlock(&lock);
+
+end:
+    free(f->buf);
+    f->buf = NULL;
+    free_list(evicted);
+}
+
+/* applies `fn` to every cached entry, dropping those it returns non-zero for */
+static void patch(int (*fn)(struct listing *l, const void *arg), const void *arg) {
+    struct listing *list = NULL;
+
+    pthread_mutex_lock(&lock);
+    epoch++;
+    for (struct listing *l = lru.next, *next; l != &lru; l = next) {
+        next = l->next;
+        /* in use, which the namespace lock should prevent */
+        if (l->refs || fn(l, arg)) {
+            drop(l, &list);
+            invalidations++;
+        }
+    }
+    struct listing *evicted = evict(budget());
+    pthread_mutex_unlock(&lock);
+
+    free_list(list);
+    free_list(evicted);
+}
+
+static int patch_add_tag(struct listing *l, const void *arg) {
+    const struct tagfs_str *name = arg;
+    struct names *n = &l->halves[TAGFS_LISTING_TAGS];
+    return n->valid && half_append(n, *name) < 0;
+}
+
+void tagfs_listing_add_tag(struct tagfs_str name) {
+    patch(patch_add_tag, &name);
+}
+
+static int patch_remove_tag(struct listing *l, const void *arg) {
+    const struct tagfs_str *name = arg;
+    if (key_has(l, *name))
+        return 1;
+    if (l->halves[TAGFS_LISTING_TAGS].valid)
+        half_remove(&l->halves[TAGFS_LISTING_TAGS], *name);
+    return 0;
+}
+
+void tagfs_listing_remove_tag(struct tagfs_str name) {
+    patch(patch_remove_tag, &name);
+}
+
+struct file_arg {
+    struct tagfs_str name;
+    const struct tagfs_str *tags;
+    size_t ntags;
+};
+
+static int patch_add_file(struct listing *l, const void *arg) {
+    const struct file_arg *a = arg;
+    struct names *n = &l->halves[TAGFS_LISTING_FILES];
+    if (!n->valid || !key_within(l, a->tags, a->ntags))
+        return 0;
+    return half_append(n, a->name) < 0;
+}
+
+void tagfs_listing_add_file(struct tagfs_str name, const struct tagfs_str *tags, size_t ntags) {
+    struct file_arg a = { name, tags, ntags };
+    patch(patch_add_file, &a);
+}
+
+static int patch_remove_file(struct listing *l, const void *arg) {
+    const struct tagfs_str *name = arg;
+    if (l->halves[TAGFS_LISTING_FILES].valid)
+        half_remove(&l->halves[TAGFS_LISTING_FILES], *name);
+    return 0;
+}
+
+void tagfs_listing_remove_file(struct tagfs_str name) {
+    patch(patch_remove_file, &name);
+}
+
+static int patch_drop(struct listing *l, const void *arg) {
+    (void)l;
+    (void)arg;
+    return 1;
+}
+
+void tagfs_listing_clear(void) {
+    patch(patch_drop, NULL);
+}
+
+void tagfs_listing_fini(void) {
+    pthread_mutex_lock(&lock);
+    uint64_t lookups = hits + misses;
+    if (lookups)
+        log_info("listing cache: %" PRIu64 " hits out of %" PRIu64 " lookups (%.1f%%), "
+                 "%" PRIu64 " entries invalidated, %" PRIu64 " evicted\n",
+                 hits, lookups, 100.0 * hits / lookups, invalidations, evictions);
+    hits = misses = evictions = invalidations = 0;
+    pthread_mutex_unlock(&lock);
+
+    tagfs_listing_clear();
+
+    pthread_mutex_lock(&lock);
+    invalidations = 0;
+    free(buckets);
+    buckets = NULL;
+    nbuckets = 0;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+/*
+ * Cache of what readdir lists, by set of tags: the names of the other
+ * tags, and of the files having all of them. The key is the set sorted
+ * and without duplicates, so /a/b and /b/a share an entry. Entries are
+ * kept in an LRU within tagfs.listing_cache KiB, and patched by the ops
+ * changing names, which hold the namespace lock for writing.
+ */
+
+/* returned by tagfs_listing_list() when the names are not cached */
+#define TAGFS_LISTING_MISS (-2)
+
+enum tagfs_listing_half {
+    TAGFS_LISTING_TAGS,
+    TAGFS_LISTING_FILES,
+};
+
+/* names are NUL-terminated, a non-zero return stops the iteration */
+typedef int (*tagfs_listing_fn)(void *ctx, const char *name);
+
+/* the key of `tags`, allocated in the arena, returns how many distinct tags it has or -1 */
+int64_t tagfs_listing_key(const struct tagfs_str *tags, size_t ntags, struct tagfs_str *key);
+
+/* 0 once done, TAGFS_LISTING_MISS if nothing was listed */
+int tagfs_listing_list(struct tagfs_str key, enum tagfs_listing_half half,
+                       tagfs_listing_fn fn, void *ctx);
+
+/* collects the names listed after a miss, to be cached by tagfs_listing_fill_end() */
+struct tagfs_listing_fill {
+    uint64_t epoch;
+    char *buf;
+    size_t len, cap;
+    int failed;
+};
+
+void tagfs_listing_fill_start(struct tagfs_listing_fill *f);
+void tagfs_listing_fill_add(struct tagfs_listing_fill *f, const char *name);
+/* caches the names if `complete` and nothing changed since the start, frees them */
+void tagfs_listing_fill_end(struct tagfs_listing_fill *f, struct tagfs_str key,
+                            enum tagfs_listing_half half, int complete);
+
+/* after the change succeeded */
+void tagfs_listing_add_tag(struct tagfs_str name);
+void tagfs_listing_remove_tag(struct tagfs_str name);
+/* a file now having exactly `tags` */
+void tagfs_listing_add_file(struct tagfs_str name, const struct tagfs_str *tags, size_t ntags);
+/* a file that may be listed already, before it is added again */
+void tagfs_listing_remove_file(struct tagfs_str name);
+
+/* drops every entry, for changes made elsewhere */
+void tagfs_listing_clear(void);
+/* non-zero if entries may be cached */
+int tagfs_listing_enabled(void);
+/* drops every entry and logs how useful they were */
+void tagfs_listing_fini(void);
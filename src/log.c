@@ -1,6 +1,16 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <sqlite3.h>
 
@@ -28,29 +38,379 @@ static const char *colors[] = {
     [FUSE_LOG_DEBUG] = "36",
 };
 
-static void vlog(enum fuse_log_level level, const char *restrict file,
-                     int line, const char *restrict fmt, va_list ap) {
-    static_assert(sizeof strings / sizeof *strings == 8);
-    static_assert(sizeof colors / sizeof *colors == 8);
+#define RING_SIZE 64 /* records per thread, power of two */
+#define MSG_SIZE 256
+/* ends messages cut at MSG_SIZE */
+#define ELLIPSIS "\u2026\n"
+#define DRAIN_INTERVAL_NS 10000000
+/* messages per call site and per second before rate limiting kicks in */
+#define BURST 10
+#define NSITES 256
+
+struct record {
+    enum fuse_log_level level;
+    const char *file;
+    int line;
+    unsigned suppressed;
+    char msg[MSG_SIZE];
+};
+
+/* single producer (its owner thread), single consumer (the drainer) */
+struct ring {
+    struct ring *next;
+    atomic_int owned;
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_uint dropped;
+    struct record records[RING_SIZE];
+};
+
+struct site {
+    /* last message let through, for reporting */
+    _Atomic(const char *) file;
+    atomic_int line;
+    atomic_int_fast64_t window;
+    atomic_uint count;
+    atomic_uint suppressed;
+};
+
+static atomic_int max_level = FUSE_LOG_DEBUG;
+static _Atomic(struct ring *) rings;
+static _Thread_local struct ring *thread_ring;
+static pthread_key_t ring_key;
+static struct site sites[NSITES];
 
+static atomic_bool running;
+static atomic_bool stopping;
+static pthread_t drainer;
+/* the drainer waits for messages once the rings are empty */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static atomic_bool sleeping;
+
+void log_set_level(enum fuse_log_level level) {
+    max_level = level;
+}
+
+int log_parse_level(const char *name, enum fuse_log_level *level) {
+    static const char *aliases[] = {
+        [FUSE_LOG_ERR] = "err",
+        [FUSE_LOG_WARNING] = "warning",
+        [FUSE_LOG_NOTICE] = "notice",
+        [FUSE_LOG_INFO] = "info",
+        [FUSE_LOG_DEBUG] = "debug",
+    };
+    for (size_t i = 0; i < sizeof aliases / sizeof *aliases; i++) {
+        if ((aliases[i] && strcasecmp(name, aliases[i]) == 0)
+            || strcasecmp(name, strings[i]) == 0) {
+            *level = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static size_t format(char *buf, size_t size, enum fuse_log_level level,
+                     const char *file, int line, unsigned suppressed, const char *msg) {
+    int n;
     if (file != NULL && line >= 0)
-        fprintf(stderr, "\033[%sm%-7s\033[m \033[90m%s:%d\033[m ",
-                colors[level], strings[level], file, line);
+        n = snprintf(buf, size, "\033[%sm%-7s\033[m \033[90m%s:%d\033[m %s",
+                     colors[level], strings[level], file, line, msg);
     else
-        fprintf(stderr, "\033[%sm%-7s\033[m ", colors[level], strings[level]);
-    vfprintf(stderr, fmt, ap);
+        n = snprintf(buf, size, "\033[%sm%-7s\033[m %s", colors[level], strings[level], msg);
+    if (n < 0)
+        return 0;
+    if ((size_t)n >= size)
+        n = size - 1;
+
+    if (suppressed) {
+        int m = snprintf(buf + n, size - n, "\033[90m(%u similar messages suppressed)\033[m\n",
+                         suppressed);
+        if (m > 0)
+            n += (size_t)m < size - n ? (size_t)m : size - n - 1;
+    }
+    return n;
+}
+
+static void format_msg(char *msg, size_t size, const char *fmt, va_list ap) {
+    int n = vsnprintf(msg, size, fmt, ap);
+    /* so that the next message still starts on its own line */
+    if (n >= 0 && (size_t)n >= size)
+        memcpy(msg + size - sizeof ELLIPSIS, ELLIPSIS, sizeof ELLIPSIS);
+}
+
+static void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(STDERR_FILENO, buf, len);
+        if (w <= 0)
+            return;
+        buf += w;
+        len -= w;
+    }
+}
+
+static int64_t now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/*
+ * Returns -1 if the message must be dropped, otherwise the number of
+ * messages dropped since the last one from the same site.
+ */
+static int rate_limit(const void *site, int siteline, const char *file, int line) {
+    uintptr_t key = (uintptr_t)site ^ ((uintptr_t)siteline * 0x9E3779B97F4A7C15u);
+    /* collisions merely share a budget */
+    struct site *s = &sites[(key ^ (key >> 17)) % NSITES];
+
+    int64_t now = now_seconds(), window = s->window;
+    if (now != window && atomic_compare_exchange_strong(&s->window, &window, now))
+        s->count = 0;
+
+    if (atomic_fetch_add(&s->count, 1) >= BURST) {
+        s->suppressed++;
+        return -1;
+    }
+    s->file = file;
+    s->line = line;
+    return (int)atomic_exchange(&s->suppressed, 0);
+}
+
+static void ring_release(void *arg) {
+    struct ring *r = arg;
+    /* the drainer still empties it, then it can be reused by a new thread */
+    r->owned = 0;
+}
+
+static struct ring *ring_acquire(void) {
+    struct ring *r;
+
+    for (r = rings; r; r = r->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&r->owned, &expected, 1))
+            break;
+    }
+
+    if (!r) {
+        r = calloc(1, sizeof *r);
+        if (!r)
+            return NULL;
+        r->owned = 1;
+        r->next = rings;
+        while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+            ;
+    }
+
+    pthread_setspecific(ring_key, r);
+    return r;
+}
+
+static void vlog(enum fuse_log_level level, const char *restrict file, int line,
+                 const void *site, int siteline, const char *restrict fmt, va_list ap) {
+    static_assert(sizeof strings / sizeof *strings == 8);
+    static_assert(sizeof colors / sizeof *colors == 8);
+
+    if ((int)level > max_level)
+        return;
+
+    /* callers log an error and then return -errno */
+    int saved_errno = errno;
+
+    int suppressed = rate_limit(site, siteline, file, line);
+    if (suppressed < 0)
+        return;
+
+    if (!running) {
+        char msg[MSG_SIZE], buf[MSG_SIZE + 128];
+        format_msg(msg, sizeof msg, fmt, ap);
+        write_all(buf, format(buf, sizeof buf, level, file, line, suppressed, msg));
+        errno = saved_errno;
+        return;
+    }
+
+    struct ring *r = thread_ring;
+    if (!r) {
+        r = thread_ring = ring_acquire();
+        if (!r) {
+            errno = saved_errno;
+            return;
+        }
+    }
+
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head - tail >= RING_SIZE) {
+        r->dropped++;
+        return;
+    }
+
+    struct record *rec = &r->records[head & (RING_SIZE - 1)];
+    rec->level = level;
+    rec->file = file;
+    rec->line = line;
+    rec->suppressed = suppressed;
+    format_msg(rec->msg, sizeof rec->msg, fmt, ap);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+
+    /* pairs with the fence in drainer_main(), one of us sees the other */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&sleeping, memory_order_relaxed)) {
+        pthread_mutex_lock(&lock);
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+    }
+    errno = saved_errno;
+}
+
+/* returns non-zero if rate limited sites are left to report */
+static int drain(void) {
+    char buf[1 << 16];
+    size_t len = 0;
+    int left = 0;
+
+    for (struct ring *r = rings; r; r = r->next) {
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+        for (; tail != head; tail++) {
+            struct record *rec = &r->records[tail & (RING_SIZE - 1)];
+            if (sizeof buf - len < MSG_SIZE + 128) {
+                write_all(buf, len);
+                len = 0;
+            }
+            len += format(buf + len, sizeof buf - len, rec->level, rec->file,
+                          rec->line, rec->suppressed, rec->msg);
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+        unsigned dropped = atomic_exchange(&r->dropped, 0);
+        if (dropped) {
+            char msg[64];
+            snprintf(msg, sizeof msg, "%u log messages dropped\n", dropped);
+            if (sizeof buf - len < MSG_SIZE + 128) {
+                write_all(buf, len);
+                len = 0;
+            }
+            len += format(buf + len, sizeof buf - len, FUSE_LOG_WARNING, NULL, -1, 0, msg);
+        }
+    }
+
+    /* sites that went quiet since being rate limited */
+    int64_t now = now_seconds();
+    for (size_t i = 0; i < NSITES; i++) {
+        struct site *s = &sites[i];
+        if (!s->suppressed)
+            continue;
+        if (s->window == now) {
+            left = 1;
+            continue;
+        }
+        unsigned suppressed = atomic_exchange(&s->suppressed, 0);
+        if (!suppressed)
+            continue;
+        if (sizeof buf - len < MSG_SIZE + 128) {
+            write_all(buf, len);
+            len = 0;
+        }
+        len += format(buf + len, sizeof buf - len, FUSE_LOG_WARNING, s->file, s->line,
+                      suppressed, "");
+    }
+
+    write_all(buf, len);
+    return left;
+}
+
+static int rings_empty(void) {
+    for (struct ring *r = rings; r; r = r->next)
+        if (atomic_load_explicit(&r->head, memory_order_acquire)
+            != atomic_load_explicit(&r->tail, memory_order_relaxed))
+            return 0;
+    return 1;
+}
+
+static void *drainer_main(void *arg) {
+    (void)arg;
+    struct timespec interval = { 0, DRAIN_INTERVAL_NS };
+
+    while (!stopping) {
+        int left = drain();
+        /* batches messages while they keep coming */
+        nanosleep(&interval, NULL);
+
+        pthread_mutex_lock(&lock);
+        atomic_store_explicit(&sleeping, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!stopping && rings_empty()) {
+            if (left) {
+                /* to report them once their second is over */
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec++;
+                pthread_cond_timedwait(&cond, &lock, &ts);
+            } else {
+                pthread_cond_wait(&cond, &lock);
+            }
+        }
+        sleeping = 0;
+        pthread_mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+static void make_key(void) {
+    pthread_key_create(&ring_key, ring_release);
+}
+
+int log_start(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, make_key);
+
+    if (running)
+        return 0;
+
+    stopping = 0;
+    running = 1;
+    if (pthread_create(&drainer, NULL, drainer_main, NULL) != 0) {
+        running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void log_stop(void) {
+    if (!atomic_exchange(&running, 0))
+        return;
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(drainer, NULL);
+    /* anything logged while we were stopping */
+    drain();
+}
+
+/* untraced message, rate limited by `site` and `siteline` */
+static void log_site(enum fuse_log_level level, const void *site, int siteline,
+                     const char *restrict fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vlog(level, NULL, -1, site, siteline, fmt, args);
+    va_end(args);
 }
 
 void log_log(enum fuse_log_level level, const char *restrict file,
              int line, const char *restrict fmt, ...) {
     va_list args;
     va_start(args, fmt);
-    vlog(level, file, line, fmt, args);
+    vlog(level, file, line, file, line, fmt, args);
     va_end(args);
 }
 
 void log_fuse(enum fuse_log_level level, const char *fmt, va_list ap) {
-    vlog(level, NULL, -1, fmt, ap);
+    vlog(level, NULL, -1, fmt, -1, fmt, ap);
 }
 
 void log_sqlite(void *data, int code, const char *msg) {
@@ -64,5 +424,5 @@ void log_sqlite(void *data, int code, const char *msg) {
     default:
         level = FUSE_LOG_ERR;
     }
-    log_log(level, NULL, -1, "SQLite: (%d) %s\n", code, msg);
+    log_site(level, log_sqlite, code, "SQLite: (%d) %s\n", code, msg);
 }
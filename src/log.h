@@ -2,16 +2,28 @@
 
 #include <stdarg.h>
 
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 35
+#endif
 #include <fuse.h>
 
-#define log_err(...) log_log(FUSE_LOG_ERR, __FILE__, __LINE__, __VA_ARGS__)
-#define log_warn(...) log_log(FUSE_LOG_WARNING, __FILE__, __LINE__, __VA_ARGS__)
-#define log_notice(...) log_log(FUSE_LOG_NOTICE, __FILE__, __LINE__, __VA_ARGS__)
-#define log_info(...) log_log(FUSE_LOG_INFO, __FILE__, __LINE__, __VA_ARGS__)
-#define log_debug(...) log_log(FUSE_LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
+/* messages above this level are compiled out */
+#ifndef TAGFS_LOG_LEVEL
+#define TAGFS_LOG_LEVEL FUSE_LOG_DEBUG
+#endif
 
-#define log_fatal(...) do { log_err(__VA_ARGS__); exit(1); } while (0)
+#define log_at(level, ...) do {                                 \
+        if ((level) <= TAGFS_LOG_LEVEL)                         \
+            log_log(level, __FILE__, __LINE__, __VA_ARGS__);    \
+    } while (0)
+
+#define log_err(...) log_at(FUSE_LOG_ERR, __VA_ARGS__)
+#define log_warn(...) log_at(FUSE_LOG_WARNING, __VA_ARGS__)
+#define log_notice(...) log_at(FUSE_LOG_NOTICE, __VA_ARGS__)
+#define log_info(...) log_at(FUSE_LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(FUSE_LOG_DEBUG, __VA_ARGS__)
+
+#define log_fatal(...) do { log_err(__VA_ARGS__); log_stop(); exit(1); } while (0)
 
 void log_log(enum fuse_log_level level, const char *restrict file, int line, const char *restrict fmt, ...)
     __attribute__((format(printf, 4, 5)));
@@ -19,3 +31,15 @@ void log_log(enum fuse_log_level level, const char *restrict file, int line, con
 void log_fuse(enum fuse_log_level level, const char *fmt, va_list ap);
 
 void log_sqlite(void *data, int code, const char *msg);
+
+/* messages above `level` are dropped at runtime */
+void log_set_level(enum fuse_log_level level);
+int log_parse_level(const char *name, enum fuse_log_level *level);
+
+/*
+ * Until log_start() is called, and after log_stop(), messages are written
+ * synchronously. In between, they go through per-thread ring buffers
+ * drained by a background thread. Start it after daemonizing.
+ */
+int log_start(void);
+void log_stop(void);
@@ -1,28 +1,24 @@
 #define _GNU_SOURCE
 
-#include <assert.h>
-#include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
-#include <unistd.h>
 
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 35
+#endif
 #include <fuse.h>
 #include <fuse_lowlevel.h>
 
-#include <sqlite3.h>
-#include "carray.h"
-
 #include "log.h"
 #include "ops.h"
-#include "sql_queries.h"
 #include "tagfs.h"
 
 enum {
     KEY_VERSION,
     KEY_HELP,
+    KEY_RO,
 };
 
 #define TAG_OPT(t, p, v) { t, offsetof(struct tagfs, p), v }
@@ -31,6 +27,26 @@ static const struct fuse_opt tagfs_opts[] = {
     FUSE_OPT_KEY("--version", KEY_VERSION),
     FUSE_OPT_KEY("-h", KEY_HELP),
     FUSE_OPT_KEY("--help", KEY_HELP),
+    FUSE_OPT_KEY("ro", KEY_RO),
+    TAG_OPT("log_level=%s", log_level, 0),
+    TAG_OPT("stat_timeout=%d", stat_timeout, 0),
+    TAG_OPT("fd_cache=%d", fd_cache, 0),
+    TAG_OPT("noindex", noindex, 1),
+    TAG_OPT("journal_max=%d", journal_max, 0),
+    TAG_OPT("backup=%s", backup, 0),
+    TAG_OPT("backup_interval=%d", backup_interval, 0),
+    TAG_OPT("compress", compress, 1),
+    TAG_OPT("block_cache=%d", block_cache, 0),
+    TAG_OPT("durability=%s", durability, 0),
+    TAG_OPT("sync_ms=%d", sync_ms, 0),
+    TAG_OPT("sync_ops=%d", sync_ops, 0),
+    TAG_OPT("noprewarm", noprewarm, 1),
+    TAG_OPT("meta_threads=%d", meta_threads, 0),
+    TAG_OPT("data_threads=%d", data_threads, 0),
+    TAG_OPT("refresh_ms=%d", refresh_ms, 0),
+    TAG_OPT("listing_cache=%d", listing_cache, 0),
+    TAG_OPT("write_behind=%d", write_behind, 0),
+    TAG_OPT("write_behind_ms=%d", write_behind_ms, 0),
     FUSE_OPT_END
 };
 
@@ -41,8 +57,45 @@ static void tagfs_usage(struct fuse_args *args) {
            "    -V   --version   print version\n"
            "    -o opt,[opt...]  mount options\n"
            "\n"
+           "YATAGFS options:\n"
+           "    -o log_level=LEVEL     err, warning, notice, info or debug (debug)\n"
+           "    -o stat_timeout=SECS   recheck cached file attributes after SECS, for\n"
+           "                           datadirs modified outside the mount (0, never,\n"
+           "                           and sizes and times of files changed outside it\n"
+           "                           are then silently wrong)\n"
+           "    -o fd_cache=N          unused backing files kept open (256), -1 for none\n"
+           "    -o noindex             do not use nor maintain the tag index snapshot\n"
+           "    -o journal_max=N       changes kept in the journal (1000000)\n"
+           "    -o backup=PATH         online backups of the database, relative to\n"
+           "                           datadir (.yatagfs.db.bak)\n"
+           "    -o backup_interval=SECS  back up every SECS (0, only when a file named\n"
+           "                           .yatagfs.backup is created in datadir)\n"
+           "    -o compress            store files created from now on compressed; each\n"
+           "                           64 KiB block takes two 68 KiB slots, so space is\n"
+           "                           only saved where the datadir can punch holes\n"
+           "    -o block_cache=N       decompressed 64 KiB blocks cached (64), -1 for none\n"
+           "    -o durability=LEVEL    strict, group or relaxed (strict); fsync and\n"
+           "                           O_SYNC or O_DSYNC writes sync data with any\n"
+           "                           level\n"
+           "    -o sync_ms=MS          with group durability, sync every MS (50)\n"
+           "    -o sync_ops=N          or once N commits are pending (1000)\n"
+           "    -o noprewarm           do not load the hottest tags after mounting\n"
+           "    -o meta_threads=N      metadata ops (lookups, listings, creations) run\n"
+           "                           at once (CPUs - 1, at most max_threads less a\n"
+           "                           quarter), -1 for no limit\n"
+           "    -o data_threads=N      data ops (reads, writes, flush, close) run at\n"
+           "                           once (no limit)\n"
+           "    -o ro                  read-only replica of a datadir mounted read-write\n"
+           "                           elsewhere, or of an unmounted one\n"
+           "    -o refresh_ms=MS       with ro, check for changes every MS (100)\n"
+           "    -o listing_cache=KIB   memory for cached listings (4096), -1 for none\n"
+           "    -o write_behind=KIB    gather small writes in buffers of KIB per file (0,\n"
+           "                           none)\n"
+           "    -o write_behind_ms=MS  write buffered writes after MS (50)\n"
+           "\n"
            "FUSE options:\n",
            args->argv[0]);
+    fuse_cmdline_help();
     fuse_lib_help(args);
 }
 
@@ -67,103 +120,129 @@ static int tagfs_opt_proc(void *data, const char *arg, int key, struct fuse_args
     case KEY_HELP:
         tagfs_usage(outargs);
         exit(1);
+
+    case KEY_RO:
+        /* also for the kernel, which then rejects most writes itself */
+        tagfs.ro = 1;
+        return 1;
     }
 
     return 1;
 }
 
-int main(int argc, char **argv) {
-    fuse_set_log_func(log_fuse);
+/* what fuse_main() does, with the loop configured from our options */
+static int tagfs_main(struct fuse_args *args) {
+    struct fuse_cmdline_opts opts;
+    struct fuse *fuse = NULL;
+    int res;
 
-    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-    int rc = fuse_opt_parse(&args, NULL, tagfs_opts, tagfs_opt_proc);
-    if (rc < 0)
+    if (fuse_parse_cmdline(args, &opts) != 0)
         return 1;
+    if (!opts.mountpoint) {
+        log_err("no mountpoint specified\n");
+        res = 2;
+        goto end;
+    }
 
-    if (!tagfs.datadir) {
-        tagfs_usage(&args);
-        return 1;
+    fuse = fuse_new(args, &tagfs_ops, sizeof tagfs_ops, NULL);
+    if (!fuse) {
+        res = 3;
+        goto end;
+    }
+    if (fuse_mount(fuse, opts.mountpoint) != 0) {
+        res = 4;
+        goto end;
+    }
+    if (fuse_daemonize(opts.foreground) != 0) {
+        res = 5;
+        goto unmount;
+    }
+    struct fuse_session *se = fuse_get_session(fuse);
+    if (fuse_set_signal_handlers(se) != 0) {
+        res = 6;
+        goto unmount;
     }
 
-    struct stat stbuf;
-    rc = stat(tagfs.datadir, &stbuf);
-    if (!rc) {
-        if ((stbuf.st_mode & S_IFMT) == S_IFDIR) {
-            rc = open(tagfs.datadir, O_DIRECTORY);
-            if (rc < 0)
-                log_fatal("open: %s\n", strerror(errno));
-            tagfs.datadirfd = rc;
-        } else {
-            log_fatal("%s is not a directory\n", tagfs.datadir);
-        }
+    if (opts.singlethread) {
+        log_info("single-threaded loop\n");
+        res = fuse_loop(fuse);
     } else {
-        if (errno == ENOENT) {
-            rc = mkdir(tagfs.datadir, 0755);
-            if (rc < 0)
-                log_fatal("mkdir: %s\n", strerror(errno));
-            tagfs.datadirfd = rc;
-        } else {
-            log_fatal("stat: %s\n", strerror(errno));
+#if FUSE_USE_VERSION >= 312
+        /* which is what caps the workers, fuse_main() sets it the same way */
+        struct fuse_loop_config *config = fuse_loop_cfg_create();
+        if (!config) {
+            res = 7;
+            goto signals;
         }
+        fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
+        fuse_loop_cfg_set_idle_threads(config, opts.max_idle_threads);
+        fuse_loop_cfg_set_max_threads(config, opts.max_threads);
+        /* the lanes leave some to data ops */
+        tagfs.max_workers = opts.max_threads;
+        log_info("multi-threaded loop, %s, %u idle threads kept, at most %u\n",
+                 opts.clone_fd ? "one channel per thread" : "shared channel",
+                 opts.max_idle_threads, opts.max_threads);
+        res = fuse_loop_mt(fuse, config);
+        fuse_loop_cfg_destroy(config);
+#else
+        /* before libfuse 3.12, nothing caps how many workers it starts */
+        struct fuse_loop_config config = {
+            .clone_fd = opts.clone_fd,
+            .max_idle_threads = opts.max_idle_threads,
+        };
+        log_info("multi-threaded loop, %s, %u idle threads kept, no limit\n",
+                 config.clone_fd ? "one channel per thread" : "shared channel",
+                 config.max_idle_threads);
+        res = fuse_loop_mt(fuse, &config);
+#endif
     }
+    if (res)
+        res = 7;
+#if FUSE_USE_VERSION >= 312
+signals:
+#endif
+    fuse_remove_signal_handlers(se);
+
+unmount:
+    fuse_unmount(fuse);
+end:
+    if (fuse)
+        fuse_destroy(fuse);
+    free(opts.mountpoint);
+    return res;
+}
 
-    char *path = realpath(tagfs.datadir, NULL);
-    if (!path) {
-        perror("realpath");
-        return 1;
-    }
-    size_t dirpathlen = strlen(path);
-    char filename[] = "/.yatagfs.db";
-    size_t filenamelen = sizeof filename;
-    path = realloc(path, dirpathlen + filenamelen);
-    assert(path != NULL);
-    memcpy(path + dirpathlen, filename, filenamelen);
-
-    rc = sqlite3_config(SQLITE_CONFIG_LOG, log_sqlite, NULL);
-    if (rc != SQLITE_OK) {
-        log_err("cannot set SQLite error callback: %s\n", sqlite3_errstr(rc));
-        rc = 1;
-        goto err;
-    }
+int main(int argc, char **argv) {
+    fuse_set_log_func(log_fuse);
 
-    rc = sqlite3_open(path, &tagfs.db);
-    free(path);
-    if (rc != SQLITE_OK) {
-        log_err("cannot open SQLite database: %s\n",
-                tagfs.db ? sqlite3_errmsg(tagfs.db) : sqlite3_errstr(rc));
-        rc = 1;
-        goto err;
-    }
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    int rc = fuse_opt_parse(&args, &tagfs, tagfs_opts, tagfs_opt_proc);
+    if (rc < 0)
+        return 1;
 
-    char *errormsg;
-    rc = sqlite3_carray_init(tagfs.db, &errormsg, NULL);
-    if (rc != SQLITE_OK) {
-        log_err("cannot load SQLite carray extension: %s\n", errormsg);
-        sqlite3_free(errormsg);
-        rc = 1;
-        goto err;
+    if (tagfs.log_level) {
+        enum fuse_log_level level;
+        if (log_parse_level(tagfs.log_level, &level) < 0)
+            log_fatal("invalid log level: %s\n", tagfs.log_level);
+        log_set_level(level);
     }
 
-    rc = sqlite3_exec(tagfs.db, tagfs_sql_set_recursive_triggers, NULL, NULL, &errormsg);
-    if (rc != SQLITE_OK) {
-        log_err("cannot set recursive_triggers pragma: %s\n", errormsg);
-        sqlite3_free(errormsg);
-        rc = 1;
-        goto err;
+    if (!tagfs.datadir) {
+        tagfs_usage(&args);
+        return 1;
     }
 
-    rc = sqlite3_exec(tagfs.db, tagfs_sql_create_tables, NULL, NULL, &errormsg);
-    if (rc != SQLITE_OK) {
-        log_err("cannot create tables: %s\n", errormsg);
-        sqlite3_free(errormsg);
+    rc = tagfs_init();
+    if (rc < 0) {
         rc = 1;
         goto err;
     }
 
-    rc = fuse_main(args.argc, args.argv, &tagfs_ops, NULL);
+    rc = tagfs_main(&args);
 
 err:
-    sqlite3_close(tagfs.db);
+    log_stop();
+    tagfs_fini();
     fuse_opt_free_args(&args);
 
     return rc;
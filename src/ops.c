@@ -2,35 +2,78 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sqlite3.h>
 #include "carray.h"
 
+#include "backup.h"
+#include "compress.h"
+#include "file.h"
+#include "index.h"
+#include "listing.h"
 #include "log.h"
 #include "ops.h"
+#include "prewarm.h"
+#include "replica.h"
 #include "sql_queries.h"
+#include "sync.h"
 #include "tagfs.h"
 #include "utils.h"
+#include "writeback.h"
+
+/*
+ * Written by ops adding or removing names, between checking that a name
+ * is free or a tag empty and changing it, as tags and files share names.
+ * Read by readdir, which lists tags and files separately.
+ */
+static pthread_rwlock_t namespace_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* names of the files we keep in the datadir next to those of users */
+static int is_reserved(struct tagfs_str name) {
+    return name.len >= 8 && memcmp(name.ptr, ".yatagfs", 8) == 0;
+}
+
+/* reads the attributes of a file from its backing file and caches them */
+static int tagfs_stat_file(int64_t fid, const char *name, struct stat *stbuf) {
+    if (fstatat(tagfs.datadirfd, name, stbuf, 0) < 0
+        || tagfs_compress_stat_at(tagfs.datadirfd, name, stbuf) < 0)
+        return -errno;
+    /* replicas leave that to the writer */
+    if (!tagfs.ro && tagfs_set_file_stat(fid, stbuf) < 0)
+        log_warn("cannot cache attributes of %s\n", name);
+    return 0;
+}
 
 static int tagfs_getattr(const char *_path, struct stat *stbuf, struct fuse_file_info *fi) {
     int res;
-    (void)fi;
-    char *path = strdup(_path);
     memset(stbuf, 0, sizeof *stbuf);
 
+    if (fi) {
+        if (tagfs_file_stat(TAGFS_FILE(fi), stbuf) < 0) {
+            log_err("fstat: %s\n", strerror(errno));
+            return -errno;
+        }
+        return 0;
+    }
+
     stbuf->st_uid = getuid();
     stbuf->st_gid = getgid();
 
-    char **parts = tagfs_separate_path(path);
-    assert(parts != NULL);
+    struct tagfs_path path;
+    if (tagfs_split_path(_path, &path) < 0)
+        return -ENOMEM;
 
-    size_t nparts = 0;
-    for (char **p = parts; *p != NULL; p++)
-        nparts++;
+    struct tagfs_str *parts = path.parts;
+    size_t nparts = path.nparts;
 
     if (nparts == 0) {
         assert(strcmp(_path, "/") == 0);
@@ -40,26 +83,39 @@ static int tagfs_getattr(const char *_path, struct stat *stbuf, struct fuse_file
         goto end;
     }
 
-    int64_t fid = tagfs_get_file(parts[nparts - 1]);
+    int64_t checked;
+    int64_t fid = tagfs_get_file_stat(parts[nparts - 1], stbuf, &checked);
     if (fid < 0) {
         res = -EIO;
         goto end;
     }
     if (fid) {
-        int rc = tagfs_has_file_tags(parts[nparts - 1], parts, nparts - 1);
-        if (rc < 0) {
-            res = -EIO;
-            goto end;
-        }
-        if (rc) {
-            rc = fstatat(tagfs.datadirfd, parts[nparts - 1], stbuf, 0);
+        if (nparts > 1) {
+            int64_t rc = tagfs_has_file_tags(parts[nparts - 1], parts, nparts - 1);
             if (rc < 0) {
-                res = -errno;
+                res = -EIO;
                 goto end;
             }
+            if (!rc) {
+                res = -ENOENT;
+                goto end;
+            }
+        }
+
+        /* the stored attributes lag behind writes until the file is flushed */
+        struct tagfs_file *f = tagfs_file_find(fid);
+        if (f) {
             res = 0;
+            if (tagfs_file_stat(f, stbuf) < 0) {
+                res = -errno;
+                log_err("fstat: %s\n", strerror(errno));
+            }
+            tagfs_file_put(f);
+        } else if (checked < 0
+                   || (tagfs.stat_timeout > 0 && time(NULL) - checked >= tagfs.stat_timeout)) {
+            res = tagfs_stat_file(fid, parts[nparts - 1].ptr, stbuf);
         } else {
-            res = -ENOENT;
+            res = 0;
         }
     } else {
         for (size_t i = 0; i < nparts; i++) {
@@ -80,7 +136,7 @@ static int tagfs_getattr(const char *_path, struct stat *stbuf, struct fuse_file
     }
 
 end:
-    free(path);
+    tagfs_arena_reset();
     return res;
 }
 
@@ -88,21 +144,23 @@ static int tagfs_mkdir(const char *_path, mode_t mode) {
     (void)mode;
     int res, rc;
 
-    char *path = strdup(_path);
-    assert(path != NULL);
+    struct tagfs_path path;
+    if (tagfs_split_path(_path, &path) < 0)
+        return -ENOMEM;
 
-    char **parts = tagfs_separate_path(path);
-    assert(parts != NULL);
-
-    size_t nparts = 0;
-    for (char **p = parts; *p != NULL; p++)
-        nparts++;
+    struct tagfs_str *parts = path.parts;
+    size_t nparts = path.nparts;
+    pthread_rwlock_wrlock(&namespace_lock);
 
     if (nparts == 0) {
         assert(strcmp(_path, "/") == 0);
         res = -EEXIST;
         goto end;
     }
+    if (is_reserved(parts[nparts - 1])) {
+        res = -EINVAL;
+        goto end;
+    }
 
     for (size_t i = 0; i < nparts - 1; i++) {
         int64_t tid = tagfs_get_tag(parts[i]);
@@ -126,9 +184,21 @@ static int tagfs_mkdir(const char *_path, mode_t mode) {
         goto end;
     }
 
+    /* not left to the constraint, which would log an error */
+    int64_t tid = tagfs_get_tag(parts[nparts - 1]);
+    if (tid < 0) {
+        res = -EIO;
+        goto end;
+    }
+    if (tid) {
+        res = -EEXIST;
+        goto end;
+    }
+
     rc = tagfs_create_tag(parts[nparts - 1]);
     switch (rc) {
     case 1:
+        tagfs_listing_add_tag(parts[nparts - 1]);
         res = 0;
         break;
     case 0:
@@ -140,7 +210,139 @@ static int tagfs_mkdir(const char *_path, mode_t mode) {
     }
 
 end:
-    free(path);
+    pthread_rwlock_unlock(&namespace_lock);
+    tagfs_arena_reset();
+    return res;
+}
+
+struct fill_ctx {
+    void *buf;
+    fuse_fill_dir_t filler;
+    struct stat *st;
+    enum fuse_fill_dir_flags flags;
+    /* collects the names for the listing cache, unless NULL */
+    struct tagfs_listing_fill *cache;
+    /* the filler refused a name, the listing is incomplete */
+    int full;
+    /* collects the names instead of listing them, unless NULL */
+    struct fill_names *names;
+};
+
+/* names of files from the cache or the snapshot, listed once their attributes are read */
+struct fill_names {
+    char *buf;
+    size_t len, cap, n;
+    int failed;
+};
+
+/* names of files whose attributes are read at once */
+#define STAT_BATCH 256
+
+static void fill_names_add(struct fill_names *names, const char *name) {
+    size_t len = strlen(name) + 1;
+
+    if (names->failed)
+        return;
+    if (names->len + len > names->cap) {
+        size_t cap = names->cap ? names->cap * 2 : 4096;
+        while (cap < names->len + len)
+            cap *= 2;
+        char *buf = realloc(names->buf, cap);
+        if (!buf) {
+            names->failed = 1;
+            return;
+        }
+        names->buf = buf;
+        names->cap = cap;
+    }
+    memcpy(names->buf + names->len, name, len);
+    names->len += len;
+    names->n++;
+}
+
+static int fill_entry(void *_ctx, const char *name) {
+    struct fill_ctx *ctx = _ctx;
+    if (ctx->cache)
+        tagfs_listing_fill_add(ctx->cache, name);
+    if (ctx->names) {
+        fill_names_add(ctx->names, name);
+        return 0;
+    }
+    int rc = ctx->filler(ctx->buf, name, ctx->st, 0, ctx->flags);
+    if (rc)
+        ctx->full = 1;
+    return rc;
+}
+
+/*
+ * Lists a file from a row of id, path, size, mtime, ctime and mode, with
+ * its attributes for readdirplus when they are trusted as much as in
+ * getattr. The kernel keeps them, so open files, whose stored attributes
+ * lag behind writes until flushed, are left to getattr.
+ */
+static void fill_file(struct fill_ctx *ctx, enum fuse_readdir_flags flags, sqlite3_stmt *stmt) {
+    const char *file = (const char *)sqlite3_column_text(stmt, 1);
+    assert(file != NULL);
+
+    if (flags & FUSE_READDIR_PLUS && sqlite3_column_type(stmt, 5) != SQLITE_NULL
+        && tagfs.stat_timeout <= 0 && !tagfs_file_is_open(sqlite3_column_int64(stmt, 0))) {
+        tagfs_fill_stat(ctx->st, sqlite3_column_int64(stmt, 2), sqlite3_column_int64(stmt, 3),
+                        sqlite3_column_int64(stmt, 4), sqlite3_column_int64(stmt, 5));
+        ctx->flags = FUSE_FILL_DIR_PLUS;
+    } else {
+        ctx->st->st_mode = 0644;
+        ctx->flags = 0;
+    }
+    fill_entry(ctx, file);
+}
+
+/* lists the collected names with their attributes, by batches, returns 0 or -errno */
+static int fill_stats(struct fill_ctx *ctx, enum fuse_readdir_flags flags, struct fill_names *names) {
+    sqlite3_stmt *stmt = NULL;
+    int res = -EIO, rc;
+
+    ctx->cache = NULL;
+    ctx->names = NULL;
+    if (names->failed)
+        return -ENOMEM;
+
+    struct tagfs_str *batch = tagfs_arena_alloc(STAT_BATCH * sizeof *batch);
+    if (!batch)
+        return -ENOMEM;
+
+    rc = sqlite3_prepare_v2(tagfs.db, tagfs_sql_get_files_stat, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
+        return -EIO;
+    }
+    assert(stmt != NULL);
+
+    const char *p = names->buf;
+    for (size_t i = 0; i < names->n && !ctx->full;) {
+        size_t n = 0;
+        for (; n < STAT_BATCH && i < names->n; n++, i++) {
+            batch[n].ptr = p;
+            batch[n].len = strlen(p);
+            p += batch[n].len + 1;
+        }
+
+        rc = sqlite3_carray_bind(stmt, 1, batch, n, CARRAY_TEXTV, SQLITE_STATIC);
+        if (rc != SQLITE_OK) {
+            log_err("sqlite3_carray_bind: %s\n", sqlite3_errmsg(tagfs.db));
+            goto end;
+        }
+        while (!ctx->full && (rc = sqlite3_step(stmt)) == SQLITE_ROW)
+            fill_file(ctx, flags, stmt);
+        if (!ctx->full && rc != SQLITE_DONE) {
+            log_err("sqlite3_step: %s\n", sqlite3_errmsg(tagfs.db));
+            goto end;
+        }
+        sqlite3_reset(stmt);
+    }
+    res = 0;
+
+end:
+    sqlite3_finalize(stmt);
     return res;
 }
 
@@ -148,20 +350,20 @@ static int tagfs_readdir(const char *_path, void *buf, fuse_fill_dir_t filler,
                          off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
     (void)offset;
     (void)fi;
-    (void)flags;
 
     int res, rc;
     struct stat st = {0};
+    sqlite3_stmt *stmt = NULL;
+    struct tagfs_listing_fill cache = {0};
+    struct fill_names names = {0};
 
-    char *path = strdup(_path);
-    assert(path != NULL);
+    struct tagfs_path path;
+    if (tagfs_split_path(_path, &path) < 0)
+        return -ENOMEM;
 
-    char **parts = tagfs_separate_path(path);
-    assert(parts != NULL);
-
-    size_t nparts = 0;
-    for (char **p = parts; *p != NULL; p++)
-        nparts++;
+    struct tagfs_str *parts = path.parts;
+    size_t nparts = path.nparts;
+    pthread_rwlock_rdlock(&namespace_lock);
 
     for (size_t i = 0; i < nparts; i++) {
         int64_t tid = tagfs_get_tag(parts[i]);
@@ -175,42 +377,81 @@ static int tagfs_readdir(const char *_path, void *buf, fuse_fill_dir_t filler,
         }
     }
 
-    sqlite3_stmt *stmt;
-    rc = sqlite3_prepare_v2(tagfs.db, tagfs_sql_get_tags_not_in, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
-        res = -EIO;
-        goto end;
-    }
-    assert(stmt != NULL);
-
-    rc = sqlite3_carray_bind(stmt, 1, parts, nparts, CARRAY_TEXT, SQLITE_STATIC);
-    if (rc != SQLITE_OK) {
-        log_err("sqlite3_carray_bind: %s\n", sqlite3_errmsg(tagfs.db));
-        res = -EIO;
+    /* as a set, like the snapshot does */
+    struct tagfs_str key;
+    int64_t ntags = tagfs_listing_key(parts, nparts, &key);
+    if (ntags < 0) {
+        res = -ENOMEM;
         goto end;
     }
 
+    st.st_uid = getuid();
+    st.st_gid = getgid();
     st.st_mode = S_IFDIR | 0755;
     st.st_nlink = 2;
-    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-        const char *dir = (const char *)sqlite3_column_text(stmt, 1);
-        assert(dir != NULL);
-        filler(buf, dir, &st, 0, 0);
+    struct fill_ctx fill = { buf, filler, &st, flags & FUSE_READDIR_PLUS ? FUSE_FILL_DIR_PLUS : 0, NULL, 0, NULL };
+    if (tagfs_listing_list(key, TAGFS_LISTING_TAGS, fill_entry, &fill) == 0)
+        goto files;
+    tagfs_listing_fill_start(&cache);
+    fill.cache = &cache;
+    if (tagfs_index_tags_not_in(parts, nparts, fill_entry, &fill) != 0) {
+        rc = sqlite3_prepare_v2(tagfs.db, tagfs_sql_get_tags_not_in, -1, &stmt, NULL);
+        if (rc != SQLITE_OK) {
+            log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
+            res = -EIO;
+            goto end;
+        }
+        assert(stmt != NULL);
+
+        rc = sqlite3_carray_bind(stmt, 1, parts, nparts, CARRAY_TEXTV, SQLITE_STATIC);
+        if (rc != SQLITE_OK) {
+            log_err("sqlite3_carray_bind: %s\n", sqlite3_errmsg(tagfs.db));
+            res = -EIO;
+            goto end;
+        }
+
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const char *dir = (const char *)sqlite3_column_text(stmt, 1);
+            assert(dir != NULL);
+            fill_entry(&fill, dir);
+        }
+
+        if (rc != SQLITE_DONE) {
+            log_err("sqlite3_step: %s\n", sqlite3_errmsg(tagfs.db));
+            res = -EIO;
+            goto end;
+        }
+
+        rc = sqlite3_finalize(stmt);
+        if (rc != SQLITE_OK) {
+            log_err("sqlite3_finalize: %s\n", sqlite3_errmsg(tagfs.db));
+            /* I guess we can continue */
+        }
+        stmt = NULL;
     }
+    tagfs_listing_fill_end(&cache, key, TAGFS_LISTING_TAGS, !fill.full);
 
-    if (rc != SQLITE_DONE) {
-        log_err("sqlite3_step: %s\n", sqlite3_errmsg(tagfs.db));
-        res = -EIO;
+files:
+    fill.cache = NULL;
+    fill.full = 0;
+    st.st_mode = 0644;
+    st.st_nlink = 1;
+    fill.flags = 0;
+    /* the snapshot and the cache have names only, attributes are read for them */
+    if (flags & FUSE_READDIR_PLUS && tagfs.stat_timeout <= 0)
+        fill.names = &names;
+    if (tagfs_listing_list(key, TAGFS_LISTING_FILES, fill_entry, &fill) == 0) {
+        res = fill.names ? fill_stats(&fill, flags, &names) : 0;
         goto end;
     }
-
-    rc = sqlite3_finalize(stmt);
-    if (rc != SQLITE_OK) {
-        log_err("sqlite3_finalize: %s\n", sqlite3_errmsg(tagfs.db));
-        /* I guess we can continue */
+    tagfs_listing_fill_start(&cache);
+    fill.cache = &cache;
+    if (tagfs_index_files_in_tags(parts, nparts, fill_entry, &fill) == 0) {
+        tagfs_listing_fill_end(&cache, key, TAGFS_LISTING_FILES, !fill.full);
+        res = fill.names ? fill_stats(&fill, flags, &names) : 0;
+        goto end;
     }
-    stmt = NULL;
+    fill.names = NULL;
 
     if (nparts > 0) {
         rc = sqlite3_prepare_v2(tagfs.db, tagfs_sql_get_files_in_tags, -1, &stmt, NULL);
@@ -221,14 +462,14 @@ static int tagfs_readdir(const char *_path, void *buf, fuse_fill_dir_t filler,
         }
         assert(stmt != NULL);
 
-        rc = sqlite3_carray_bind(stmt, 1, parts, nparts, CARRAY_TEXT, SQLITE_STATIC);
+        rc = sqlite3_carray_bind(stmt, 1, parts, nparts, CARRAY_TEXTV, SQLITE_STATIC);
         if (rc != SQLITE_OK) {
             log_err("sqlite3_carray_bind: %s\n", sqlite3_errmsg(tagfs.db));
             res = -EIO;
             goto end;
         }
 
-        rc = sqlite3_bind_int64(stmt, 2, (int64_t)nparts);
+        rc = sqlite3_bind_int64(stmt, 2, ntags);
         if (rc != SQLITE_OK) {
             log_err("sqlite3_bind_int64: %s\n", sqlite3_errmsg(tagfs.db));
             res = -EIO;
@@ -244,19 +485,16 @@ static int tagfs_readdir(const char *_path, void *buf, fuse_fill_dir_t filler,
         assert(stmt != NULL);
     }        
 
-    st.st_mode = 0644;
-    st.st_nlink = 1;
-    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-        const char *file = (const char *)sqlite3_column_text(stmt, 1);
-        assert(file != NULL);
-        filler(buf, file, &st, 0, 0);        
-    }
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        fill_file(&fill, flags, stmt);
 
     if (rc != SQLITE_DONE) {
         log_err("sqlite3_step: %s\n", sqlite3_errmsg(tagfs.db));
         res = -EIO;
         goto end;
     }
+    if (fill.cache)
+        tagfs_listing_fill_end(&cache, key, TAGFS_LISTING_FILES, !fill.full);
     res = 0;
 
 end:
@@ -265,21 +503,22 @@ end:
         log_err("sqlite3_finalize: %s\n", sqlite3_errmsg(tagfs.db));
         /* it should be fine to still return `res` */
     }
-    free(path);
+    /* left by errors */
+    free(cache.buf);
+    free(names.buf);
+    pthread_rwlock_unlock(&namespace_lock);
+    tagfs_arena_reset();
     return res;
 }
 
 static int tagfs_open(const char *_path, struct fuse_file_info *fi) {
-    int res, rc;
-    char *path = strdup(_path);
-    assert(path != NULL);
-
-    char **parts = tagfs_separate_path(path);
-    assert(parts != NULL);
+    int res;
+    struct tagfs_path path;
+    if (tagfs_split_path(_path, &path) < 0)
+        return -ENOMEM;
 
-    size_t nparts = 0;
-    for (char **p = parts; *p != NULL; p++)
-        nparts++;
+    struct tagfs_str *parts = path.parts;
+    size_t nparts = path.nparts;
 
     if (nparts == 0) {
         assert(strcmp(_path, "/") == 0);
@@ -287,46 +526,42 @@ static int tagfs_open(const char *_path, struct fuse_file_info *fi) {
         goto end;
     }
 
-    rc = tagfs_has_file_tags(parts[nparts - 1], parts, nparts - 1);
-    if (rc < 0) {
+    int64_t fid = tagfs_has_file_tags(parts[nparts - 1], parts, nparts - 1);
+    if (fid < 0) {
         res = -EIO;
         goto end;
     }
-    if (!rc) {
+    if (!fid) {
         res = -ENOENT;
         goto end;
     }
 
-    rc = openat(tagfs.datadirfd, parts[nparts - 1], O_RDWR);
-    if (rc < 0) {
+    struct tagfs_file *f = tagfs_file_get(fid, parts[nparts - 1].ptr, fi->flags, 0);
+    if (!f) {
         log_err("openat: %s\n", strerror(errno));
         res = -EIO;
         goto end;
     }
 
-    fi->fh = rc;
+    fi->fh = (uintptr_t)f;
     fi->direct_io = 1;
     res = 0;
 
 end:
-    free(path);
+    tagfs_arena_reset();
     return res;
 }
 
 static int tagfs_create(const char *_path, mode_t mode, struct fuse_file_info *fi) {
     int res, rc;
 
-    char *path = strdup(_path);
-    assert(path != NULL);
-
-    char **parts = tagfs_separate_path(path);
-    assert(parts != NULL);
-
-    size_t nparts = 0;
-    for (char **p = parts; *p != NULL; p++)
-        nparts++;
+    struct tagfs_path path;
+    if (tagfs_split_path(_path, &path) < 0)
+        return -ENOMEM;
 
-    char *filename = parts[nparts - 1];
+    struct tagfs_str *parts = path.parts;
+    size_t nparts = path.nparts;
+    pthread_rwlock_wrlock(&namespace_lock);
 
     if (nparts == 0) {
         assert(strcmp(_path, "/") == 0);
@@ -334,6 +569,12 @@ static int tagfs_create(const char *_path, mode_t mode, struct fuse_file_info *f
         goto end;
     }
 
+    struct tagfs_str filename = parts[nparts - 1];
+    if (is_reserved(filename)) {
+        res = -EINVAL;
+        goto end;
+    }
+
     for (size_t i = 0; i < nparts - 1; i++) {
         int64_t tid = tagfs_get_tag(parts[i]);
         if (tid < 0) {
@@ -356,78 +597,103 @@ static int tagfs_create(const char *_path, mode_t mode, struct fuse_file_info *f
         goto end;
     }
 
-    rc = tagfs_create_file(filename);
-    if (rc < 0) {
+    /* which replaces it, with only these tags */
+    int64_t existed = tagfs_listing_enabled() ? tagfs_get_file(filename) : 0;
+    if (existed < 0) {
+        res = -EIO;
+        goto end;
+    }
+
+    int64_t fid = tagfs_create_file(filename);
+    if (fid < 0) {
         res = -EIO;
         goto end;
     }
 
     rc = tagfs_add_tags_to_file(filename, parts, nparts - 1);
     if (rc < 0) {
+        /* listed in the root at least */
+        tagfs_listing_clear();
         res = -EIO;
         goto end;
     }
+    if (existed)
+        tagfs_listing_remove_file(filename);
+    tagfs_listing_add_file(filename, parts, nparts - 1);
 
-    rc = openat(tagfs.datadirfd, filename, O_RDWR | O_CREAT | O_TRUNC, mode);
-    if (rc < 0) {
+    struct tagfs_file *f = tagfs_file_get(fid, filename.ptr, O_CREAT | O_TRUNC, mode);
+    if (!f) {
         log_err("openat: %s\n", strerror(errno));
         res = -EIO;
         goto end;
     }
 
-    fi->fh = rc;
+    /* the file may have existed in the datadir, and O_TRUNC changed it */
+    if (tagfs_file_sync_stat(f) < 0)
+        log_warn("cannot cache attributes of %s\n", filename.ptr);
+
+    fi->fh = (uintptr_t)f;
     fi->direct_io = 1;
     res = 0;
 
 end:
-    free(path);
+    pthread_rwlock_unlock(&namespace_lock);
+    tagfs_arena_reset();
     return res;    
 }
 
 static int tagfs_flush(const char *path, struct fuse_file_info *fi) {
     (void)path;
 
-    int fd = dup(fi->fh);
-    if (fd < 0) {
-        log_err("dup: %s\n", strerror(errno));
-        return -errno;
-    }
-
-    if (close(fd) < 0) {
-        log_err("close: %s\n", strerror(errno));
-        return -errno;
-    }
+    /* backing files outlive opens, only buffered writes can fail */
+    int res = tagfs_writeback_flush(TAGFS_FILE(fi));
+    if (res < 0)
+        return res;
+    if (tagfs_file_sync_stat(TAGFS_FILE(fi)) < 0)
+        return -EIO;
 
     return 0;
 }
 
 static int tagfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
     (void)path;
+    struct tagfs_file *f = TAGFS_FILE(fi);
 
-    if (datasync ? fdatasync(fi->fh) : fsync(fi->fh)) {
+    int res = tagfs_writeback_flush(f);
+    if (res < 0)
+        return res;
+    /* explicit, so honoured with any durability */
+    if (tagfs_file_fsync(f, datasync) < 0) {
         log_err("f(data)sync: %s\n", strerror(errno));
         return -errno;
     }
 
+    if (tagfs_file_sync_stat(f) < 0)
+        return -EIO;
+
     return 0;
 }
 
 static int tagfs_release(const char *path, struct fuse_file_info *fi) {
     (void)path;
-
-    if (close(fi->fh) < 0) {
-        log_err("close: %s\n", strerror(errno));
-        return -errno;
-    }
-
-    return 0;
+    int res = tagfs_writeback_flush(TAGFS_FILE(fi));
+    int rc = tagfs_file_put(TAGFS_FILE(fi));
+    return res < 0 ? res : rc;
 }
 
 static int tagfs_read(const char *path, char *buf, size_t size,
                       off_t offset, struct fuse_file_info *fi) {
     (void)path;
+    struct tagfs_file *f = TAGFS_FILE(fi);
 
-    ssize_t r = pread(fi->fh, buf, size, offset);
+    /* buffered writes past the range may extend the file over it */
+    int res = tagfs_writeback_flush_range(f, offset, SIZE_MAX);
+    if (res < 0)
+        return res;
+    if (f->compressed)
+        return tagfs_compress_read(f, buf, size, offset);
+
+    ssize_t r = pread(f->fd, buf, size, offset);
     if (r < 0) {
         log_err("pread: %s\n", strerror(errno));
         return -errno;
@@ -439,28 +705,208 @@ static int tagfs_read(const char *path, char *buf, size_t size,
 static int tagfs_write(const char *path, const char *buf, size_t size,
                        off_t offset, struct fuse_file_info *fi) {
     (void)path;
+    struct tagfs_file *f = TAGFS_FILE(fi);
+
+    /* O_SYNC implies O_DSYNC */
+    if (f->wb) {
+        if (!(fi->flags & O_DSYNC))
+            return tagfs_writeback_write(f, buf, size, offset);
+        int res = tagfs_writeback_flush_range(f, offset, size);
+        if (res < 0)
+            return res;
+    }
+
+    ssize_t w;
+    if (f->compressed) {
+        w = tagfs_compress_write(f, buf, size, offset);
+        if (w < 0)
+            return w;
+    } else {
+        w = pwrite(f->fd, buf, size, offset);
+        if (w < 0) {
+            log_err("pwrite: %s\n", strerror(errno));
+            return -errno;
+        }
+    }
 
-    ssize_t w = pwrite(fi->fh, buf, size, offset);
-    if (w < 0) {
-        log_err("pwrite: %s\n", strerror(errno));
+    /* the backing file is shared, so it was not opened with these */
+    if ((fi->flags & O_DSYNC) && tagfs_file_fsync(f, (fi->flags & O_SYNC) != O_SYNC) < 0) {
+        log_err("f(data)sync: %s\n", strerror(errno));
         return -errno;
     }
 
+    tagfs_file_touch(f);
+    tagfs_sync_add(f);
     return w;
 }
 
+/* lets the backing filesystem copy or reflink without the data going through us */
+static ssize_t tagfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
+                                     off_t offset_in, const char *path_out,
+                                     struct fuse_file_info *fi_out, off_t offset_out,
+                                     size_t size, int flags) {
+    (void)path_in;
+    (void)path_out;
+    struct tagfs_file *in = TAGFS_FILE(fi_in), *out = TAGFS_FILE(fi_out);
+
+    /* the kernel falls back to reads and writes */
+    if (in->compressed || out->compressed)
+        return -EOPNOTSUPP;
+
+    int res = tagfs_writeback_flush_range(in, offset_in, SIZE_MAX);
+    if (res == 0)
+        res = tagfs_writeback_flush_range(out, offset_out, size);
+    if (res < 0)
+        return res;
+
+    ssize_t c = copy_file_range(in->fd, &offset_in,
+                                out->fd, &offset_out, size, flags);
+    if (c < 0) {
+        log_err("copy_file_range: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    tagfs_file_touch(out);
+    tagfs_sync_add(out);
+    return c;
+}
+
+static int tagfs_fallocate(const char *path, int mode, off_t offset,
+                           off_t length, struct fuse_file_info *fi) {
+    (void)path;
+    struct tagfs_file *f = TAGFS_FILE(fi);
+
+    if (f->compressed)
+        return -EOPNOTSUPP;
+
+    int res = tagfs_writeback_flush_range(f, offset, length);
+    if (res < 0)
+        return res;
+    if (fallocate(f->fd, mode, offset, length) < 0) {
+        log_err("fallocate: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    tagfs_file_touch(f);
+    tagfs_sync_add(f);
+    return 0;
+}
+
+/* only called for SEEK_DATA and SEEK_HOLE, the file position is unused */
+static off_t tagfs_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi) {
+    (void)path;
+    struct tagfs_file *f = TAGFS_FILE(fi);
+
+    int rc = tagfs_writeback_flush_range(f, 0, SIZE_MAX);
+    if (rc < 0)
+        return rc;
+    if (f->compressed)
+        return tagfs_compress_lseek(f, off, whence);
+
+    off_t res = lseek(f->fd, off, whence);
+    if (res < 0) {
+        /* past the last data, not an error */
+        if (errno != ENXIO)
+            log_err("lseek: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    return res;
+}
+
+static int truncate_file(struct tagfs_file *f, off_t size) {
+    /* buffered past the new size, to be cut */
+    int res = tagfs_writeback_flush_range(f, size, SIZE_MAX);
+    if (res < 0)
+        return res;
+
+    if (f->compressed) {
+        res = tagfs_compress_truncate(f, size);
+        if (res < 0)
+            return res;
+    } else if (ftruncate(f->fd, size) < 0) {
+        log_err("ftruncate: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    f->dirty = 1;
+    tagfs_sync_add(f);
+    return 0;
+}
+
+static int tagfs_truncate(const char *_path, off_t size, struct fuse_file_info *fi) {
+    int res;
+
+    if (fi) {
+        struct tagfs_file *f = TAGFS_FILE(fi);
+        res = truncate_file(f, size);
+        if (res < 0)
+            return res;
+        return tagfs_file_sync_stat(f) < 0 ? -EIO : 0;
+    }
+
+    struct tagfs_path path;
+    if (tagfs_split_path(_path, &path) < 0)
+        return -ENOMEM;
+
+    struct tagfs_str *parts = path.parts;
+    size_t nparts = path.nparts;
+
+    if (nparts == 0) {
+        assert(strcmp(_path, "/") == 0);
+        res = -EISDIR;
+        goto end;
+    }
+
+    int64_t fid = tagfs_has_file_tags(parts[nparts - 1], parts, nparts - 1);
+    if (fid < 0) {
+        res = -EIO;
+        goto end;
+    }
+    if (!fid) {
+        /* either a tag or nothing */
+        int64_t tid = tagfs_get_tag(parts[nparts - 1]);
+        res = tid < 0 ? -EIO : tid ? -EISDIR : -ENOENT;
+        goto end;
+    }
+
+    struct tagfs_file *f = tagfs_file_get(fid, parts[nparts - 1].ptr, 0, 0);
+    if (!f) {
+        res = -errno;
+        log_err("openat: %s\n", strerror(errno));
+        goto end;
+    }
+
+    res = truncate_file(f, size);
+    if (res == 0)
+        res = tagfs_file_sync_stat(f) < 0 ? -EIO : 0;
+    tagfs_file_put(f);
+
+end:
+    tagfs_arena_reset();
+    return res;
+}
+
 static int tagfs_rmdir(const char *_path) {
     int res, rc;
+    sqlite3_stmt *stmt = NULL;
+
+    struct tagfs_path path;
+    if (tagfs_split_path(_path, &path) < 0)
+        return -ENOMEM;
 
-    char *path = strdup(_path);
-    assert(path != NULL);
+    struct tagfs_str *parts = path.parts;
+    size_t nparts = path.nparts;
+    pthread_rwlock_wrlock(&namespace_lock);
 
-    char **parts = tagfs_separate_path(path);
-    assert(parts != NULL);
+    if (nparts == 0) {
+        assert(strcmp(_path, "/") == 0);
+        res = -EBUSY;
+        goto end;
+    }
 
-    size_t nparts = 0;
-    for (nparts = 0; parts[nparts] != NULL; nparts++) {
-        int64_t tid = tagfs_get_tag(parts[nparts]);
+    for (size_t i = 0; i < nparts; i++) {
+        int64_t tid = tagfs_get_tag(parts[i]);
         if (tid < 0) {
             res = -EIO;
             goto end;
@@ -471,9 +917,8 @@ static int tagfs_rmdir(const char *_path) {
         }        
     }
 
-    char *tag = parts[nparts - 1];
+    struct tagfs_str tag = parts[nparts - 1];
 
-    sqlite3_stmt *stmt;
     rc = sqlite3_prepare_v2(tagfs.db, tagfs_sql_get_files_in_tag, -1, &stmt, NULL);
     if (rc != SQLITE_OK) {
         log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
@@ -482,7 +927,7 @@ static int tagfs_rmdir(const char *_path) {
     }
     assert(stmt != NULL);
 
-    rc = sqlite3_bind_text(stmt, 1, tag, -1, SQLITE_STATIC);
+    rc = sqlite3_bind_text(stmt, 1, tag.ptr, (int)tag.len, SQLITE_STATIC);
     if (rc != SQLITE_OK) {
         log_err("sqlite3_bind_int64: %s\n", sqlite3_errmsg(tagfs.db));
         res = -EIO;
@@ -515,7 +960,7 @@ static int tagfs_rmdir(const char *_path) {
     }
     assert(stmt != NULL);
 
-    rc = sqlite3_bind_text(stmt, 1, tag, -1, SQLITE_STATIC);
+    rc = sqlite3_bind_text(stmt, 1, tag.ptr, (int)tag.len, SQLITE_STATIC);
     if (rc != SQLITE_OK) {
         log_err("sqlite3_bind_int64: %s\n", sqlite3_errmsg(tagfs.db));
         res = -EIO;
@@ -528,6 +973,7 @@ static int tagfs_rmdir(const char *_path) {
         res = -EIO;
         goto end;
     }
+    tagfs_listing_remove_tag(tag);
 
     res = 0;
 
@@ -537,20 +983,277 @@ end:
         log_err("sqlite3_finalize: %s\n", sqlite3_errmsg(tagfs.db));
         /* it should be fine to still return `res` */
     }
-    free(path);
+    if (res == 0)
+        tagfs_index_invalidate();
+    pthread_rwlock_unlock(&namespace_lock);
+    tagfs_arena_reset();
+    return res;
+}
+
+static void *tagfs_fuse_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    (void)conn;
+    (void)cfg;
+
+    /* here we are past daemonizing, threads started now survive */
+    if (log_start() < 0)
+        log_warn("cannot start logging thread, logging synchronously\n");
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    log_info("mounted %.3f s after starting\n",
+             ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec - tagfs.init_ns) / 1e9);
+
+    /* the writer maintains the index and backs up */
+    if (tagfs.ro) {
+        /* which would not notice the snapshot going stale */
+        if (tagfs_replica_start() < 0) {
+            log_warn("cannot start replica thread, not using the index\n");
+            tagfs_index_close();
+        }
+    } else if (tagfs_index_start() < 0) {
+        log_warn("cannot start index thread, the index will not be rebuilt\n");
+    }
+    if (tagfs_prewarm_start() < 0)
+        log_warn("cannot start prewarm thread, the cache will warm up with use\n");
+    if (!tagfs.ro && tagfs_backup_start() < 0)
+        log_warn("cannot start backup thread, backups are disabled\n");
+    if (tagfs_sync_start() < 0)
+        log_warn("cannot start sync thread, commits are synced by checkpoints only\n");
+    if (tagfs_writeback_start() < 0)
+        log_warn("cannot start write-behind thread, writes are not buffered\n");
+
+    return NULL;
+}
+
+static void tagfs_destroy(void *private_data) {
+    (void)private_data;
+    /* before the sync thread, which syncs what they write */
+    tagfs_writeback_stop();
+    tagfs_sync_stop();
+    tagfs_backup_stop();
+    tagfs_prewarm_stop();
+    tagfs_replica_stop();
+    tagfs_index_stop();
+    log_stop();
+}
+
+/*
+ * Lanes cap how many metadata ops (those looking paths up in the
+ * database) and data ops (those on open files) run at once, so that a
+ * burst of slow listings does not take the CPU and the connection from
+ * reads and writes. Ops over the cap wait for their turn in their lane,
+ * on the worker of the FUSE loop that took them. Replicas reject changes
+ * before entering one.
+ */
+struct lane {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int busy;
+};
+
+static struct lane meta_lane = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+static struct lane data_lane = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+
+/*
+ * Leaves a CPU to data ops by default, and when workers are capped, a
+ * quarter of them: running metadata ops never take the workers of reads
+ * and writes, waiting ones still hold theirs.
+ */
+static int meta_max(void) {
+    static atomic_int def;
+    int max = tagfs.meta_threads;
+    if (!max) {
+        if (!def) {
+            long n = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+            def = n > 1 ? (int)n : 1;
+        }
+        max = def;
+    }
+    if (max > 0 && tagfs.max_workers > 0) {
+        int reserved = tagfs.max_workers / 4 > 1 ? tagfs.max_workers / 4 : 1;
+        if (max > tagfs.max_workers - reserved)
+            max = tagfs.max_workers > reserved ? tagfs.max_workers - reserved : 1;
+    }
+    return max;
+}
+
+static int data_max(void) {
+    return tagfs.data_threads;
+}
+
+static void lane_enter(struct lane *l, int max) {
+    if (max <= 0)
+        return;
+    pthread_mutex_lock(&l->lock);
+    while (l->busy >= max)
+        pthread_cond_wait(&l->cond, &l->lock);
+    l->busy++;
+    pthread_mutex_unlock(&l->lock);
+}
+
+static void lane_leave(struct lane *l, int max) {
+    if (max <= 0)
+        return;
+    pthread_mutex_lock(&l->lock);
+    l->busy--;
+    pthread_cond_signal(&l->cond);
+    pthread_mutex_unlock(&l->lock);
+}
+
+#define META(call) do {                         \
+        int max = meta_max();                   \
+        lane_enter(&meta_lane, max);            \
+        res = call;                             \
+        lane_leave(&meta_lane, max);            \
+    } while (0)
+
+#define DATA(call) do {                         \
+        int max = data_max();                   \
+        lane_enter(&data_lane, max);            \
+        res = call;                             \
+        lane_leave(&data_lane, max);            \
+    } while (0)
+
+static int lane_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+    int res;
+    if (fi)
+        DATA(tagfs_getattr(path, stbuf, fi));
+    else
+        META(tagfs_getattr(path, stbuf, fi));
+    return res;
+}
+
+static int lane_mkdir(const char *path, mode_t mode) {
+    int res;
+    if (tagfs.ro)
+        return -EROFS;
+    META(tagfs_mkdir(path, mode));
+    return res;
+}
+
+static int lane_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                        off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    int res;
+    META(tagfs_readdir(path, buf, filler, offset, fi, flags));
+    return res;
+}
+
+static int lane_open(const char *path, struct fuse_file_info *fi) {
+    int res;
+    if (tagfs.ro && ((fi->flags & O_ACCMODE) != O_RDONLY || fi->flags & O_TRUNC))
+        return -EROFS;
+    META(tagfs_open(path, fi));
+    return res;
+}
+
+static int lane_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    int res;
+    if (tagfs.ro)
+        return -EROFS;
+    META(tagfs_create(path, mode, fi));
+    return res;
+}
+
+static int lane_rmdir(const char *path) {
+    int res;
+    if (tagfs.ro)
+        return -EROFS;
+    META(tagfs_rmdir(path));
+    return res;
+}
+
+static int lane_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    int res;
+    if (tagfs.ro)
+        return -EROFS;
+    if (fi)
+        DATA(tagfs_truncate(path, size, fi));
+    else
+        META(tagfs_truncate(path, size, fi));
     return res;
 }
 
+static int lane_read(const char *path, char *buf, size_t size,
+                     off_t offset, struct fuse_file_info *fi) {
+    int res;
+    DATA(tagfs_read(path, buf, size, offset, fi));
+    return res;
+}
+
+static int lane_write(const char *path, const char *buf, size_t size,
+                      off_t offset, struct fuse_file_info *fi) {
+    int res;
+    if (tagfs.ro)
+        return -EROFS;
+    DATA(tagfs_write(path, buf, size, offset, fi));
+    return res;
+}
+
+static ssize_t lane_copy_file_range(const char *path_in, struct fuse_file_info *fi_in,
+                                    off_t offset_in, const char *path_out,
+                                    struct fuse_file_info *fi_out, off_t offset_out,
+                                    size_t size, int flags) {
+    ssize_t res;
+    if (tagfs.ro)
+        return -EROFS;
+    DATA(tagfs_copy_file_range(path_in, fi_in, offset_in, path_out, fi_out,
+                               offset_out, size, flags));
+    return res;
+}
+
+static int lane_fallocate(const char *path, int mode, off_t offset,
+                          off_t length, struct fuse_file_info *fi) {
+    int res;
+    if (tagfs.ro)
+        return -EROFS;
+    DATA(tagfs_fallocate(path, mode, offset, length, fi));
+    return res;
+}
+
+static int lane_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    int res;
+    DATA(tagfs_fsync(path, datasync, fi));
+    return res;
+}
+
+/* both write buffered data and attributes, closing may compress and sync blocks */
+static int lane_flush(const char *path, struct fuse_file_info *fi) {
+    int res;
+    DATA(tagfs_flush(path, fi));
+    return res;
+}
+
+static int lane_release(const char *path, struct fuse_file_info *fi) {
+    int res;
+    DATA(tagfs_release(path, fi));
+    return res;
+}
+
+/* SEEK_DATA and SEEK_HOLE write buffered data first */
+static off_t lane_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi) {
+    off_t res;
+    DATA(tagfs_lseek(path, off, whence, fi));
+    return res;
+}
+
+#undef META
+#undef DATA
+
 const struct fuse_operations tagfs_ops = {
-    .create = tagfs_create,
-    .flush = tagfs_flush,
-    .fsync = tagfs_fsync,
-    .getattr = tagfs_getattr,
-    .mkdir = tagfs_mkdir,
-    .open = tagfs_open,
-    .read = tagfs_read,
-    .readdir = tagfs_readdir,
-    .release = tagfs_release,
-    .rmdir = tagfs_rmdir,
-    .write = tagfs_write,
+    .copy_file_range = lane_copy_file_range,
+    .create = lane_create,
+    .destroy = tagfs_destroy,
+    .fallocate = lane_fallocate,
+    .flush = lane_flush,
+    .fsync = lane_fsync,
+    .getattr = lane_getattr,
+    .init = tagfs_fuse_init,
+    .lseek = lane_lseek,
+    .mkdir = lane_mkdir,
+    .open = lane_open,
+    .read = lane_read,
+    .readdir = lane_readdir,
+    .release = lane_release,
+    .rmdir = lane_rmdir,
+    .truncate = lane_truncate,
+    .write = lane_write,
 };
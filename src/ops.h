@@ -1,6 +1,8 @@
 #pragma once
 
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 35
+#endif
 #include <fuse.h>
 
 extern const struct fuse_operations tagfs_ops;
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sqlite3.h>
+
+#include "index.h"
+#include "log.h"
+#include "prewarm.h"
+#include "sql_queries.h"
+#include "tagfs.h"
+
+/* tags whose files are read */
+#define HOT_TAGS 32
+/* rows read by each statement, so that none keeps writers waiting for long */
+#define PAGE 1024
+
+static atomic_bool running;
+static atomic_bool stopping;
+static pthread_t thread;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* reads a page of tags after `last`, which it updates, returns how many or -1 */
+static int64_t read_tags(char **last) {
+    sqlite3_stmt *stmt;
+    int64_t n = 0;
+    int rc;
+
+    if (sqlite3_prepare_v2(tagfs.db, tagfs_sql_get_index_tags, -1, &stmt, NULL) != SQLITE_OK) {
+        log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
+        return -1;
+    }
+    sqlite3_bind_text(stmt, 1, *last ? *last : "", -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 2, PAGE);
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (++n < PAGE)
+            continue;
+        /* the next page starts after the last row of this one */
+        free(*last);
+        *last = strdup((const char *)sqlite3_column_text(stmt, 1));
+        if (!*last)
+            n = -1;
+        break;
+    }
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        log_err("sqlite3_step: %s\n", sqlite3_errmsg(tagfs.db));
+        n = -1;
+    }
+
+    sqlite3_finalize(stmt);
+    return n;
+}
+
+/* reads the first page of the files of `tag`, returns how many or -1 */
+static int64_t read_files(const char *tag) {
+    sqlite3_stmt *stmt;
+    int64_t n = 0;
+    int rc;
+
+    if (sqlite3_prepare_v2(tagfs.db, tagfs_sql_get_files_in_tag, -1, &stmt, NULL) != SQLITE_OK) {
+        log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
+        return -1;
+    }
+    sqlite3_bind_text(stmt, 1, tag, -1, SQLITE_STATIC);
+
+    while (n < PAGE && (rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        n++;
+    if (n < PAGE && rc != SQLITE_DONE) {
+        log_err("sqlite3_step: %s\n", sqlite3_errmsg(tagfs.db));
+        n = -1;
+    }
+
+    sqlite3_finalize(stmt);
+    return n;
+}
+
+static void *prewarm_main(void *arg) {
+    (void)arg;
+    uint64_t start = now_ns();
+    char *last = NULL, *hot[HOT_TAGS];
+    int64_t tags = 0, files = 0, nhot = 0;
+
+    /* by pages, each its own read transaction */
+    for (int64_t n = PAGE; n == PAGE && !stopping; tags += n) {
+        n = read_tags(&last);
+        if (n < 0)
+            goto end;
+    }
+    if (stopping)
+        goto end;
+
+    /* picked from the snapshot, counting them is a scan of files_tags */
+    nhot = tagfs_index_largest_tags(HOT_TAGS, hot);
+    tagfs_arena_reset();
+    for (int64_t i = 0; i < nhot && !stopping; i++) {
+        int64_t n = read_files(hot[i]);
+        if (n < 0)
+            goto end;
+        files += n;
+    }
+    if (stopping)
+        goto end;
+
+    uint64_t done = now_ns();
+    if (nhot == TAGFS_INDEX_MISS)
+        log_info("prewarmed %" PRId64 " tags in %.3f s, no index to find the largest ones, "
+                 "ready %.3f s after starting\n", tags,
+                 (done - start) / 1e9, (done - tagfs.init_ns) / 1e9);
+    else
+        log_info("prewarmed %" PRId64 " tags and %" PRId64 " files of the %" PRId64 " largest "
+                 "in %.3f s, ready %.3f s after starting\n", tags, files, nhot,
+                 (done - start) / 1e9, (done - tagfs.init_ns) / 1e9);
+
+end:
+    for (int64_t i = 0; i < nhot; i++)
+        free(hot[i]);
+    free(last);
+    return NULL;
+}
+
+int tagfs_prewarm_start(void) {
+    if (tagfs.noprewarm || running)
+        return 0;
+
+    stopping = 0;
+    running = 1;
+    if (pthread_create(&thread, NULL, prewarm_main, NULL) != 0) {
+        running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void tagfs_prewarm_stop(void) {
+    if (!atomic_exchange(&running, 0))
+        return;
+
+    stopping = 1;
+    pthread_join(thread, NULL);
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+/*
+ * Reads the parts of the database that ops hit first after mounting, so
+ * that they find them in the cache of the connection: the tags ordered
+ * by name, then the first files of the tags the index snapshot has the
+ * most files for. It runs once, through tagfs.db by short statements,
+ * and logs how long after tagfs_init() the mount was ready.
+ */
+int tagfs_prewarm_start(void);
+void tagfs_prewarm_stop(void);
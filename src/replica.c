@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sqlite3.h>
+
+#include "file.h"
+#include "index.h"
+#include "listing.h"
+#include "log.h"
+#include "replica.h"
+#include "sql_queries.h"
+#include "tagfs.h"
+
+#define REFRESH_MS_DEFAULT 100
+
+static atomic_bool running;
+static atomic_bool stopping;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+/* the first column of the first row of `sql`, -1 on errors */
+static int64_t query_int(sqlite3 *db, const char *sql) {
+    sqlite3_stmt *stmt;
+    int64_t value = -1;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        value = sqlite3_column_int64(stmt, 0);
+    else
+        log_warn("sqlite3_step: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+/* returns non-zero if stopping */
+static int wait_refresh(void) {
+    int ms = tagfs.refresh_ms > 0 ? tagfs.refresh_ms : REFRESH_MS_DEFAULT;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&lock);
+    while (!stopping && pthread_cond_timedwait(&cond, &lock, &ts) != ETIMEDOUT)
+        ;
+    pthread_mutex_unlock(&lock);
+    return stopping;
+}
+
+static void *replica_main(void *arg) {
+    (void)arg;
+    sqlite3 *db = NULL;
+
+    /* the data version only changes for commits of other connections than ours */
+    int rc = sqlite3_open_v2(tagfs.dbpath, &db, SQLITE_OPEN_READONLY, NULL);
+    if (rc != SQLITE_OK) {
+        log_err("cannot open SQLite database: %s\n", db ? sqlite3_errmsg(db) : sqlite3_errstr(rc));
+        /* nothing would tell when the snapshot goes stale */
+        tagfs_index_close();
+        goto end;
+    }
+    sqlite3_busy_timeout(db, 5000);
+
+    int64_t seen = query_int(db, tagfs_sql_get_data_version);
+    int64_t generation = query_int(db, tagfs_sql_get_generation);
+    /* verifies the snapshot tagfs_init() mapped */
+    tagfs_index_reload(1);
+
+    while (!wait_refresh()) {
+        int64_t version = query_int(db, tagfs_sql_get_data_version);
+        int changed = version >= 0 && version != seen;
+        if (changed) {
+            seen = version;
+            /* compressed ones cache their size and blocks */
+            tagfs_file_clear();
+            int64_t g = query_int(db, tagfs_sql_get_generation);
+            if (g != generation) {
+                generation = g;
+                tagfs_listing_clear();
+            }
+            log_debug("database changed, data version %" PRId64 "\n", version);
+        }
+        tagfs_index_reload(changed);
+    }
+
+end:
+    sqlite3_close(db);
+    return NULL;
+}
+
+int tagfs_replica_start(void) {
+    if (!tagfs.ro || running)
+        return 0;
+
+    stopping = 0;
+    running = 1;
+    if (pthread_create(&thread, NULL, replica_main, NULL) != 0) {
+        running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void tagfs_replica_stop(void) {
+    if (!atomic_exchange(&running, 0))
+        return;
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+}
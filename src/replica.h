@@ -0,0 +1,14 @@
+#pragma once
+
+/*
+ * Read-only mounts (tagfs.ro) of a datadir that another mount may be
+ * writing to. Queries always see the last commit of the writer, but the
+ * index snapshot and the cached backing files do not, so a thread polls
+ * the data version of the database every tagfs.refresh_ms milliseconds.
+ * Once it changes, idle backing files are closed and, if files or tags
+ * changed, cached listings are dropped and the snapshot stops being used
+ * until the writer rebuilt it.
+ * Lookups may thus use a snapshot that old.
+ */
+int tagfs_replica_start(void);
+void tagfs_replica_stop(void);
@@ -1,3 +1,4 @@
 INSERT OR REPLACE
 INTO files (path)
 VALUES (?)
+RETURNING id
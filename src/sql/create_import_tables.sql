@@ -0,0 +1,10 @@
+CREATE TABLE IF NOT EXISTS imports
+    ( source TEXT PRIMARY KEY NOT NULL
+    , file_id INTEGER NOT NULL
+    -- identity of the source when it was imported
+    , dev INTEGER NOT NULL
+    , ino INTEGER NOT NULL
+    , size INTEGER NOT NULL
+    , mtime INTEGER NOT NULL
+    , FOREIGN KEY (file_id) REFERENCES files (id) ON DELETE CASCADE
+    );
@@ -0,0 +1,3 @@
+DELETE FROM files_tags
+WHERE file_id NOT IN (SELECT id FROM files)
+    OR tag_id NOT IN (SELECT id FROM tags)
@@ -0,0 +1,2 @@
+DELETE FROM files
+WHERE id = ?
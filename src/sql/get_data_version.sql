@@ -0,0 +1 @@
+PRAGMA data_version;
@@ -0,0 +1,3 @@
+SELECT id, size, mtime, ctime, mode, checked
+FROM files
+WHERE path = ?
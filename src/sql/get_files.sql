@@ -1,2 +1,2 @@
-SELECT id, path
+SELECT id, path, size, mtime, ctime, mode
 FROM files
@@ -1,4 +1,4 @@
-SELECT f.id, f.path
+SELECT f.id, f.path, f.size, f.mtime, f.ctime, f.mode
 FROM files AS f
 JOIN tags AS t ON t.id = ft.tag_id
 JOIN files_tags AS ft ON ft.file_id = f.id
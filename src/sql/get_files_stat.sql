@@ -0,0 +1,3 @@
+SELECT f.id, c.value, f.size, f.mtime, f.ctime, f.mode
+FROM carray(?) AS c
+LEFT JOIN files AS f ON f.path = c.value
@@ -0,0 +1,6 @@
+SELECT f.id, f.path, f.size, f.mtime,
+    EXISTS (SELECT 1 FROM files_tags AS ft WHERE ft.file_id = f.id)
+FROM files AS f
+WHERE f.path > ?
+ORDER BY f.path
+LIMIT ?
@@ -0,0 +1,2 @@
+SELECT value
+FROM generation
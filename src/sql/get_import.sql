@@ -0,0 +1,3 @@
+SELECT file_id, dev, ino, size, mtime
+FROM imports
+WHERE source = ?
@@ -0,0 +1,5 @@
+SELECT id, path
+FROM files
+WHERE path > ?
+ORDER BY path
+LIMIT ?
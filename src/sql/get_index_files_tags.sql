@@ -0,0 +1,5 @@
+SELECT ft.file_id, ft.tag_id
+FROM files AS f
+JOIN files_tags AS ft ON ft.file_id = f.id
+WHERE f.path > ? AND f.path <= ?
+ORDER BY f.path
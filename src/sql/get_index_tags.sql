@@ -0,0 +1,5 @@
+SELECT id, name
+FROM tags
+WHERE name > ?
+ORDER BY name
+LIMIT ?
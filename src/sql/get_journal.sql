@@ -0,0 +1,5 @@
+SELECT seq, time, op, file_id, file, tag_id, tag
+FROM journal
+WHERE seq > ?
+ORDER BY seq
+LIMIT ?
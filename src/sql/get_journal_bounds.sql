@@ -0,0 +1,3 @@
+SELECT
+    (SELECT MIN(seq) FROM journal),
+    (SELECT seq FROM sqlite_sequence WHERE name = 'journal')
@@ -0,0 +1,3 @@
+INSERT OR REPLACE
+INTO imports (source, file_id, dev, ino, size, mtime)
+VALUES (?, ?, ?, ?, ?, ?)
@@ -0,0 +1,4 @@
+INSERT OR IGNORE
+INTO tags (name)
+SELECT value
+FROM carray(?)
@@ -0,0 +1,5 @@
+ALTER TABLE files ADD COLUMN size INTEGER;
+ALTER TABLE files ADD COLUMN mtime INTEGER;
+ALTER TABLE files ADD COLUMN ctime INTEGER;
+ALTER TABLE files ADD COLUMN mode INTEGER;
+ALTER TABLE files ADD COLUMN checked INTEGER;
@@ -0,0 +1,22 @@
+CREATE TABLE generation
+    ( id INTEGER PRIMARY KEY NOT NULL CHECK (id = 0)
+    , value INTEGER NOT NULL
+    );
+INSERT INTO generation (id, value) VALUES (0, 1);
+
+CREATE TRIGGER generation_files_insert AFTER INSERT ON files
+BEGIN UPDATE generation SET value = value + 1; END;
+CREATE TRIGGER generation_files_delete AFTER DELETE ON files
+BEGIN UPDATE generation SET value = value + 1; END;
+CREATE TRIGGER generation_files_update AFTER UPDATE OF path ON files
+BEGIN UPDATE generation SET value = value + 1; END;
+CREATE TRIGGER generation_tags_insert AFTER INSERT ON tags
+BEGIN UPDATE generation SET value = value + 1; END;
+CREATE TRIGGER generation_tags_delete AFTER DELETE ON tags
+BEGIN UPDATE generation SET value = value + 1; END;
+CREATE TRIGGER generation_tags_update AFTER UPDATE OF name ON tags
+BEGIN UPDATE generation SET value = value + 1; END;
+CREATE TRIGGER generation_files_tags_insert AFTER INSERT ON files_tags
+BEGIN UPDATE generation SET value = value + 1; END;
+CREATE TRIGGER generation_files_tags_delete AFTER DELETE ON files_tags
+BEGIN UPDATE generation SET value = value + 1; END;
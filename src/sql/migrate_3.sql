@@ -0,0 +1,67 @@
+CREATE TABLE settings
+    ( key TEXT PRIMARY KEY NOT NULL
+    , value
+    );
+INSERT INTO settings (key, value) VALUES ('journal_max', 1000000);
+
+CREATE TABLE journal
+    ( seq INTEGER PRIMARY KEY AUTOINCREMENT
+    , time INTEGER NOT NULL
+    , op TEXT NOT NULL
+    , file_id INTEGER
+    , file TEXT
+    , tag_id INTEGER
+    , tag TEXT
+    );
+
+CREATE TRIGGER journal_files_insert AFTER INSERT ON files
+BEGIN
+    INSERT INTO journal (time, op, file_id, file)
+    VALUES (CAST(strftime('%s', 'now') AS INTEGER), 'create', new.id, new.path);
+END;
+CREATE TRIGGER journal_files_delete AFTER DELETE ON files
+BEGIN
+    INSERT INTO journal (time, op, file_id, file)
+    VALUES (CAST(strftime('%s', 'now') AS INTEGER), 'delete', old.id, old.path);
+END;
+CREATE TRIGGER journal_files_write AFTER UPDATE OF size, mtime ON files
+WHEN old.mtime IS NOT NULL
+    AND (new.size IS NOT old.size OR new.mtime IS NOT old.mtime)
+BEGIN
+    INSERT INTO journal (time, op, file_id, file)
+    VALUES (CAST(strftime('%s', 'now') AS INTEGER), 'write', new.id, new.path);
+END;
+CREATE TRIGGER journal_tags_insert AFTER INSERT ON tags
+BEGIN
+    INSERT INTO journal (time, op, tag_id, tag)
+    VALUES (CAST(strftime('%s', 'now') AS INTEGER), 'mkdir', new.id, new.name);
+END;
+CREATE TRIGGER journal_tags_delete AFTER DELETE ON tags
+BEGIN
+    INSERT INTO journal (time, op, tag_id, tag)
+    VALUES (CAST(strftime('%s', 'now') AS INTEGER), 'rmdir', old.id, old.name);
+END;
+CREATE TRIGGER journal_files_tags_insert AFTER INSERT ON files_tags
+BEGIN
+    INSERT INTO journal (time, op, file_id, file, tag_id, tag)
+    SELECT CAST(strftime('%s', 'now') AS INTEGER), 'tag', new.file_id,
+        (SELECT path FROM files WHERE id = new.file_id),
+        new.tag_id,
+        (SELECT name FROM tags WHERE id = new.tag_id);
+END;
+CREATE TRIGGER journal_files_tags_delete AFTER DELETE ON files_tags
+BEGIN
+    INSERT INTO journal (time, op, file_id, file, tag_id, tag)
+    SELECT CAST(strftime('%s', 'now') AS INTEGER), 'untag', old.file_id,
+        (SELECT path FROM files WHERE id = old.file_id),
+        old.tag_id,
+        (SELECT name FROM tags WHERE id = old.tag_id);
+END;
+
+-- amortized retention, every 1024 entries
+CREATE TRIGGER journal_retention AFTER INSERT ON journal
+WHEN new.seq % 1024 = 0
+BEGIN
+    DELETE FROM journal
+    WHERE seq <= new.seq - (SELECT value FROM settings WHERE key = 'journal_max');
+END;
@@ -0,0 +1,3 @@
+UPDATE files
+SET size = ?, mtime = ?, ctime = ?, mode = ?, checked = ?
+WHERE id = ?
@@ -0,0 +1,3 @@
+INSERT OR REPLACE
+INTO settings (key, value)
+VALUES (?, ?)
@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "log.h"
+#include "sql_queries.h"
+#include "sync.h"
+#include "tagfs.h"
+
+#define SYNC_MS_DEFAULT 50
+#define SYNC_OPS_DEFAULT 1000
+/* as SQLite does by default */
+#define CHECKPOINT_PAGES 1000
+
+static atomic_bool running;
+static atomic_bool stopping;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+/* commits since the last round, and size of the WAL */
+static atomic_int pending;
+static atomic_int wal_pages;
+/* written since the last round, each holding a reference */
+static struct tagfs_file **files;
+static size_t nfiles, capfiles;
+
+static int sync_ops(void) {
+    return tagfs.sync_ops > 0 ? tagfs.sync_ops : SYNC_OPS_DEFAULT;
+}
+
+/* replaces automatic checkpoints, which would sync on the committing thread */
+static int wal_hook(void *arg, sqlite3 *db, const char *name, int pages) {
+    (void)arg;
+    (void)db;
+    (void)name;
+
+    atomic_store_explicit(&wal_pages, pages, memory_order_relaxed);
+    if (atomic_fetch_add(&pending, 1) + 1 == sync_ops()) {
+        pthread_mutex_lock(&lock);
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+    }
+    return SQLITE_OK;
+}
+
+void tagfs_sync_add(struct tagfs_file *f) {
+    if (!running)
+        return;
+    /* avoid bouncing the cache line when it is already set */
+    if (atomic_load_explicit(&f->unsynced, memory_order_relaxed)
+        || atomic_exchange(&f->unsynced, 1))
+        return;
+
+    tagfs_file_ref(f);
+    pthread_mutex_lock(&lock);
+    if (nfiles == capfiles) {
+        size_t cap = capfiles ? capfiles * 2 : 64;
+        struct tagfs_file **p = realloc(files, cap * sizeof *files);
+        if (!p) {
+            pthread_mutex_unlock(&lock);
+            /* synced right away then */
+            f->unsynced = 0;
+            if (tagfs_file_fsync(f, 1) < 0)
+                log_err("fdatasync: %s\n", strerror(errno));
+            tagfs_file_put(f);
+            return;
+        }
+        files = p;
+        capfiles = cap;
+    }
+    files[nfiles++] = f;
+    pthread_mutex_unlock(&lock);
+}
+
+/* waits for the end of the interval or enough commits, returns non-zero if stopping */
+static int wait_round(void) {
+    int ms = tagfs.sync_ms > 0 ? tagfs.sync_ms : SYNC_MS_DEFAULT;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&lock);
+    while (!stopping && pending < sync_ops()
+           && pthread_cond_timedwait(&cond, &lock, &ts) != ETIMEDOUT)
+        ;
+    pthread_mutex_unlock(&lock);
+    return stopping;
+}
+
+/* syncs the files written since the previous call, returns how many */
+static size_t sync_files(void) {
+    struct tagfs_file **batch;
+    size_t n;
+
+    pthread_mutex_lock(&lock);
+    batch = files;
+    n = nfiles;
+    files = NULL;
+    nfiles = capfiles = 0;
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < n; i++) {
+        batch[i]->unsynced = 0;
+        if (tagfs_file_fsync(batch[i], 1) < 0)
+            log_err("fdatasync: %s\n", strerror(errno));
+        tagfs_file_put(batch[i]);
+    }
+    free(batch);
+    return n;
+}
+
+static void sync_round(sqlite3 *db, const char *walpath, int *walfd) {
+    /*
+     * Commits are counted before taking the files, so that these hold the
+     * data of every commit counted, and are synced before the WAL, so that
+     * committed attributes do not describe unsynced data.
+     */
+    int commits = atomic_exchange(&pending, 0);
+    size_t n = sync_files();
+    if (!n && !commits)
+        return;
+
+    if (commits && walpath) {
+        /* the WAL is synced whole, with later commits, whose data is written by now too */
+        sync_files();
+
+        /* only created with the first commit */
+        if (*walfd < 0)
+            *walfd = open(walpath, O_RDONLY | O_CLOEXEC);
+        if (*walfd < 0)
+            log_err("open %s: %s\n", walpath, strerror(errno));
+        else if (fdatasync(*walfd) < 0)
+            log_err("fdatasync: %s\n", strerror(errno));
+    }
+
+    /*
+     * Our connection copies most pages without holding up ops. The WAL is
+     * only reset by a writer starting once it is entirely copied, so the
+     * pages committed meanwhile are copied from the connection of ops.
+     */
+    if (wal_pages >= CHECKPOINT_PAGES) {
+        int rc = SQLITE_OK;
+        if (db)
+            rc = sqlite3_wal_checkpoint_v2(db, "main", SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+        if (rc == SQLITE_OK)
+            rc = sqlite3_wal_checkpoint_v2(tagfs.db, "main", SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+        if (rc == SQLITE_OK)
+            wal_pages = 0;
+        /* or the next round, if statements of ops are still running */
+        else if (rc != SQLITE_BUSY && rc != SQLITE_LOCKED)
+            log_warn("sqlite3_wal_checkpoint_v2: %s\n", sqlite3_errstr(rc));
+    }
+}
+
+static void *sync_main(void *arg) {
+    (void)arg;
+    sqlite3 *db = NULL;
+    char *walpath = NULL;
+    int walfd = -1;
+
+    /* checkpoints from our own connection, so that ops do not wait for them */
+    int rc = sqlite3_open_v2(tagfs.dbpath, &db, SQLITE_OPEN_READWRITE, NULL);
+    if (rc == SQLITE_OK) {
+        /* which also reads the database, checkpoints do nothing until then */
+        rc = sqlite3_exec(db, tagfs_sql_set_durability_group, NULL, NULL, NULL);
+    }
+    if (rc != SQLITE_OK) {
+        log_err("cannot open SQLite database: %s\n",
+                db ? sqlite3_errmsg(db) : sqlite3_errstr(rc));
+        sqlite3_close(db);
+        db = NULL;
+    }
+    if (asprintf(&walpath, "%s-wal", tagfs.dbpath) < 0)
+        walpath = NULL;
+
+    int last;
+    do {
+        last = wait_round();
+        sync_round(db, walpath, &walfd);
+    } while (!last);
+
+    if (walfd >= 0)
+        close(walfd);
+    free(walpath);
+    sqlite3_close(db);
+    return NULL;
+}
+
+int tagfs_sync_start(void) {
+    if (tagfs.durability_level != TAGFS_DURABILITY_GROUP || running)
+        return 0;
+
+    stopping = 0;
+    pending = 0;
+    running = 1;
+    sqlite3_wal_hook(tagfs.db, wal_hook, NULL);
+    if (pthread_create(&thread, NULL, sync_main, NULL) != 0) {
+        running = 0;
+        sqlite3_wal_autocheckpoint(tagfs.db, CHECKPOINT_PAGES);
+        return -1;
+    }
+    return 0;
+}
+
+void tagfs_sync_stop(void) {
+    if (!atomic_exchange(&running, 0))
+        return;
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+
+    /* also removes our hook */
+    sqlite3_wal_autocheckpoint(tagfs.db, CHECKPOINT_PAGES);
+}
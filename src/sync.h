@@ -0,0 +1,25 @@
+#pragma once
+
+#include "file.h"
+
+/*
+ * Group durability. The database is in WAL mode and commits do not wait
+ * for the disk: a background thread syncs them by rounds, every
+ * tagfs.sync_ms milliseconds or as soon as tagfs.sync_ops commits are
+ * pending. A round counts the commits pending, syncs the data of the
+ * backing files written since the previous round, then the files written
+ * meanwhile and the WAL, and checkpoints it once it has grown.
+ *
+ * After a crash, the database holds every transaction committed before
+ * the start of the last completed round, and possibly some later ones,
+ * but always whole transactions in commit order. Data written before
+ * that start is on disk too, data written since may or may not be, and an
+ * fsync still waits for the disk. A later commit, synced along with the
+ * WAL or written back by the kernel, may describe data that is not.
+ */
+int tagfs_sync_start(void);
+/* after a last round */
+void tagfs_sync_stop(void);
+
+/* after writing to `f`, so that its data is synced by the next round */
+void tagfs_sync_add(struct tagfs_file *f);
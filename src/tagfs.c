@@ -1,26 +1,333 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 35
+#endif
 #include <fuse.h>
 
 #include <sqlite3.h>
 #include "carray.h"
 
+#include "file.h"
+#include "index.h"
+#include "listing.h"
 #include "log.h"
 #include "sql_queries.h"
 #include "tagfs.h"
 
+/* the cache holds the whole database plus some room to grow, within bounds */
+#define CACHE_MIN_KIB 2048
+#define CACHE_MAX_KIB (256 * 1024)
+#define MMAP_SLACK (64 << 20)
+#define MMAP_MAX ((int64_t)1 << 30)
+#define BUSY_TIMEOUT_MS 5000
+
 struct tagfs tagfs;
 
-int tagfs_has_file_tags(char *path, char **tags, size_t ntags) {
+/*
+ * Brings the schema from `PRAGMA user_version` to the latest version.
+ * Databases already there are left alone, so that mounting does not
+ * parse nor lock anything for DDL.
+ */
+static int tagfs_migrate(void) {
+    const char *migrations[] = {
+        tagfs_sql_migrate_1,
+        tagfs_sql_migrate_2,
+        tagfs_sql_migrate_3,
+    };
+    int rc, version;
+    sqlite3_stmt *stmt;
+    char *errormsg;
+
+    rc = sqlite3_prepare_v2(tagfs.db, "PRAGMA user_version", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
+        return -1;
+    }
+    rc = sqlite3_step(stmt);
+    version = rc == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : -1;
+    sqlite3_finalize(stmt);
+    if (version < 0) {
+        log_err("cannot read schema version: %s\n", sqlite3_errmsg(tagfs.db));
+        return -1;
+    }
+    if (version >= (int)(sizeof migrations / sizeof *migrations))
+        return 0;
+    if (tagfs.ro) {
+        log_err("schema is at version %d, mount read-write once to migrate it\n", version);
+        return -1;
+    }
+
+    rc = sqlite3_exec(tagfs.db, tagfs_sql_create_tables, NULL, NULL, &errormsg);
+    if (rc != SQLITE_OK) {
+        log_err("cannot create tables: %s\n", errormsg);
+        sqlite3_free(errormsg);
+        return -1;
+    }
+
+    for (int v = version; v < (int)(sizeof migrations / sizeof *migrations); v++) {
+        char *sql = sqlite3_mprintf("BEGIN; %s; PRAGMA user_version = %d; COMMIT;",
+                                    migrations[v], v + 1);
+        if (!sql)
+            return -1;
+        rc = sqlite3_exec(tagfs.db, sql, NULL, NULL, &errormsg);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) {
+            log_err("cannot migrate schema to version %d: %s\n", v + 1, errormsg);
+            sqlite3_free(errormsg);
+            sqlite3_exec(tagfs.db, "ROLLBACK", NULL, NULL, NULL);
+            return -1;
+        }
+        log_info("migrated schema to version %d\n", v + 1);
+    }
+
+    return 0;
+}
+
+/* persisted, so that the retention also applies to offline tools */
+static int tagfs_set_journal_max(int64_t n) {
     int res, rc;
     sqlite3_stmt *stmt;
+    rc = sqlite3_prepare_v2(tagfs.db, tagfs_sql_set_setting, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
+        return -1;
+    }
+
+    sqlite3_bind_text(stmt, 1, "journal_max", -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, n);
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        log_err("sqlite3_step: %s\n", sqlite3_errmsg(tagfs.db));
+        res = -1;
+        goto end;
+    }
+    res = 0;
+
+end:
+    rc = sqlite3_finalize(stmt);
+    if (rc != SQLITE_OK) {
+        log_err("sqlite3_finalize: %s\n", sqlite3_errmsg(tagfs.db));
+        /* it should be fine to still return `res` */
+    }
+
+    return res;
+}
+
+static int tagfs_set_durability(void) {
+    static const char *names[] = {
+        [TAGFS_DURABILITY_STRICT] = "strict",
+        [TAGFS_DURABILITY_GROUP] = "group",
+        [TAGFS_DURABILITY_RELAXED] = "relaxed",
+    };
+    int n = sizeof names / sizeof *names;
+    const char *sql = NULL;
+    char *errormsg;
+
+    tagfs.durability_level = TAGFS_DURABILITY_STRICT;
+    if (tagfs.durability) {
+        int i = 0;
+        while (i < n && strcmp(tagfs.durability, names[i]) != 0)
+            i++;
+        if (i == n) {
+            log_err("invalid durability: %s\n", tagfs.durability);
+            return -1;
+        }
+        tagfs.durability_level = i;
+    }
+
+    /* strict leaves the journal mode as is, both sync every commit */
+    switch (tagfs.durability_level) {
+    case TAGFS_DURABILITY_STRICT:
+        return 0;
+    case TAGFS_DURABILITY_GROUP:
+        sql = tagfs_sql_set_durability_group;
+        break;
+    case TAGFS_DURABILITY_RELAXED:
+        sql = tagfs_sql_set_durability_relaxed;
+        break;
+    }
+
+    if (sqlite3_exec(tagfs.db, sql, NULL, NULL, &errormsg) != SQLITE_OK) {
+        log_err("cannot set durability: %s\n", errormsg);
+        sqlite3_free(errormsg);
+        return -1;
+    }
+    return 0;
+}
+
+/* sized after the database, so that a mount can keep all of it in memory */
+static void tagfs_set_cache(void) {
+    struct stat st;
+    if (stat(tagfs.dbpath, &st) < 0) {
+        log_warn("stat %s: %s\n", tagfs.dbpath, strerror(errno));
+        return;
+    }
+
+    int64_t kib = st.st_size / 1024 + st.st_size / 4096;
+    if (kib < CACHE_MIN_KIB)
+        kib = CACHE_MIN_KIB;
+    if (kib > CACHE_MAX_KIB)
+        kib = CACHE_MAX_KIB;
+    /* replicas map as much as they may ever need, the writer may grow it */
+    int64_t mmap = tagfs.ro ? MMAP_MAX : st.st_size + MMAP_SLACK;
+    if (mmap > MMAP_MAX)
+        mmap = MMAP_MAX;
+
+    char *sql = sqlite3_mprintf("PRAGMA cache_size = -%lld; PRAGMA mmap_size = %lld;",
+                                (long long)kib, (long long)mmap);
+    char *errormsg;
+    if (!sql)
+        return;
+    if (sqlite3_exec(tagfs.db, sql, NULL, NULL, &errormsg) != SQLITE_OK) {
+        log_warn("cannot size the database cache: %s\n", errormsg);
+        sqlite3_free(errormsg);
+    }
+    sqlite3_free(sql);
+}
+
+int tagfs_init(void) {
+    int rc;
+    struct stat stbuf;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    tagfs.init_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+    rc = stat(tagfs.datadir, &stbuf);
+    if (rc < 0) {
+        if (errno != ENOENT || tagfs.ro || tagfs.nocreate) {
+            log_err("stat: %s\n", strerror(errno));
+            return -1;
+        }
+        rc = mkdir(tagfs.datadir, 0755);
+        if (rc < 0) {
+            log_err("mkdir: %s\n", strerror(errno));
+            return -1;
+        }
+    } else if ((stbuf.st_mode & S_IFMT) != S_IFDIR) {
+        log_err("%s is not a directory\n", tagfs.datadir);
+        return -1;
+    }
+
+    rc = open(tagfs.datadir, O_DIRECTORY);
+    if (rc < 0) {
+        log_err("open: %s\n", strerror(errno));
+        return -1;
+    }
+    tagfs.datadirfd = rc;
+
+    char *path = realpath(tagfs.datadir, NULL);
+    if (!path) {
+        log_err("realpath: %s\n", strerror(errno));
+        return -1;
+    }
+    size_t dirpathlen = strlen(path);
+    char filename[] = "/.yatagfs.db";
+    size_t filenamelen = sizeof filename;
+    path = realloc(path, dirpathlen + filenamelen);
+    assert(path != NULL);
+    memcpy(path + dirpathlen, filename, filenamelen);
+
+    /* rather than checking an empty database made on the spot */
+    if (tagfs.nocreate && faccessat(tagfs.datadirfd, filename + 1, F_OK, 0) < 0) {
+        log_err("%s is not a yatagfs datadir: %s\n", tagfs.datadir, strerror(errno));
+        free(path);
+        return -1;
+    }
+
+    rc = sqlite3_config(SQLITE_CONFIG_LOG, log_sqlite, NULL);
+    if (rc != SQLITE_OK) {
+        log_err("cannot set SQLite error callback: %s\n", sqlite3_errstr(rc));
+        free(path);
+        return -1;
+    }
+
+    tagfs.dbpath = path;
+    rc = sqlite3_open_v2(path, &tagfs.db,
+                         tagfs.ro ? SQLITE_OPEN_READONLY
+                         : SQLITE_OPEN_READWRITE | (tagfs.nocreate ? 0 : SQLITE_OPEN_CREATE), NULL);
+    if (rc != SQLITE_OK) {
+        log_err("cannot open SQLite database: %s\n",
+                tagfs.db ? sqlite3_errmsg(tagfs.db) : sqlite3_errstr(rc));
+        return -1;
+    }
+    /* waits for other mounts sharing the database instead of failing ops */
+    sqlite3_busy_timeout(tagfs.db, BUSY_TIMEOUT_MS);
+
+    char *errormsg;
+    rc = sqlite3_carray_init(tagfs.db, &errormsg, NULL);
+    if (rc != SQLITE_OK) {
+        log_err("cannot load SQLite carray extension: %s\n", errormsg);
+        sqlite3_free(errormsg);
+        return -1;
+    }
+
+    rc = sqlite3_exec(tagfs.db, tagfs_sql_set_recursive_triggers, NULL, NULL, &errormsg);
+    if (rc != SQLITE_OK) {
+        log_err("cannot set recursive_triggers pragma: %s\n", errormsg);
+        sqlite3_free(errormsg);
+        return -1;
+    }
+
+    if (tagfs.ro) {
+        if (tagfs.durability)
+            log_warn("durability is up to the read-write mount, ignoring it\n");
+    } else if (tagfs_set_durability() < 0) {
+        return -1;
+    }
+
+    if (tagfs_migrate() < 0)
+        return -1;
+    tagfs_set_cache();
+
+    if (!tagfs.ro && tagfs.journal_max > 0 && tagfs_set_journal_max(tagfs.journal_max) < 0)
+        return -1;
+
+    tagfs_index_open();
+    return 0;
+}
+
+void tagfs_fini(void) {
+    /* stores the attributes of dirty files */
+    tagfs_file_clear();
+    tagfs_index_close();
+    tagfs_listing_fini();
+    sqlite3_close(tagfs.db);
+    tagfs.db = NULL;
+    free(tagfs.dbpath);
+    tagfs.dbpath = NULL;
+    if (tagfs.datadirfd > 0)
+        close(tagfs.datadirfd);
+    tagfs.datadirfd = -1;
+}
+
+int64_t tagfs_has_file_tags(struct tagfs_str path, const struct tagfs_str *tags, size_t ntags) {
+    int64_t res;
+    int rc;
+    sqlite3_stmt *stmt;
 
     if (ntags == 0) {
-        return (int)tagfs_get_file(path);
+        return tagfs_get_file(path);
     }
 
+    res = tagfs_index_has_file_tags(path, tags, ntags);
+    if (res != TAGFS_INDEX_MISS)
+        return res;
+
+    /* /a/a is /a, as for the snapshot and readdir */
+    struct tagfs_str key;
+    int64_t distinct = tagfs_listing_key(tags, ntags, &key);
+    if (distinct < 0)
+        return -1;
+
     rc = sqlite3_prepare_v2(tagfs.db, tagfs_sql_has_file_tags, -1, &stmt, NULL);
     if (rc != SQLITE_OK) {
         log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
@@ -28,21 +335,21 @@ int tagfs_has_file_tags(char *path, char **tags, size_t ntags) {
     }
     assert(stmt != NULL);
 
-    rc = sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    rc = sqlite3_bind_text(stmt, 1, path.ptr, (int)path.len, SQLITE_STATIC);
     if (rc != SQLITE_OK) {
         log_err("sqlite3_bind_text: %s\n", sqlite3_errmsg(tagfs.db));
         res = -1;
         goto end;
     }
 
-    rc = sqlite3_carray_bind(stmt, 2, tags, ntags, CARRAY_TEXT, SQLITE_STATIC);
+    rc = sqlite3_carray_bind(stmt, 2, (void *)tags, ntags, CARRAY_TEXTV, SQLITE_STATIC);
     if (rc != SQLITE_OK) {
         log_err("sqlite3_carray_bind: %s\n", sqlite3_errmsg(tagfs.db));
         res = -1;
         goto end;
     }
 
-    rc = sqlite3_bind_int64(stmt, 3, (int64_t)ntags);
+    rc = sqlite3_bind_int64(stmt, 3, distinct);
     if (rc != SQLITE_OK) {
         log_err("sqlite3_bind_int64: %s\n", sqlite3_errmsg(tagfs.db));
         res = -1;
@@ -55,7 +362,7 @@ int tagfs_has_file_tags(char *path, char **tags, size_t ntags) {
         res = 0;
         break;
     case SQLITE_ROW:
-        res = 1;
+        res = sqlite3_column_int64(stmt, 0);
         break;
     default:
         log_err("sqlite3_step: %s\n", sqlite3_errmsg(tagfs.db));
@@ -73,7 +380,7 @@ end:
     return res;
 }
 
-static int64_t tagfs_get_id(const char *sql_query, const char *name) {
+static int64_t tagfs_get_id(const char *sql_query, struct tagfs_str name) {
     int64_t id;
     sqlite3_stmt *stmt;
     int rc = sqlite3_prepare_v2(tagfs.db, sql_query, -1, &stmt, NULL);
@@ -83,7 +390,7 @@ static int64_t tagfs_get_id(const char *sql_query, const char *name) {
     }
     assert(stmt != NULL);
 
-    rc = sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    rc = sqlite3_bind_text(stmt, 1, name.ptr, (int)name.len, SQLITE_STATIC);
     if (rc != SQLITE_OK) {
         log_err("sqlite3_bind_text: %s\n", sqlite3_errmsg(tagfs.db));
         id = -1;
@@ -114,17 +421,24 @@ end:
     return id;
 }
 
-int64_t tagfs_get_tag(const char *name) {
+int64_t tagfs_get_tag(struct tagfs_str name) {
+    int64_t id = tagfs_index_get_tag(name);
+    if (id != TAGFS_INDEX_MISS)
+        return id;
     return tagfs_get_id(tagfs_sql_get_tag, name);
 }
 
-int64_t tagfs_get_file(const char *name) {
+int64_t tagfs_get_file(struct tagfs_str name) {
+    int64_t id = tagfs_index_get_file(name);
+    if (id != TAGFS_INDEX_MISS)
+        return id;
     return tagfs_get_id(tagfs_sql_get_file, name);
 }
 
-int tagfs_add_tags_to_file(const char *path, char **tags, size_t ntags) {
+int tagfs_add_tags_to_file(struct tagfs_str path, const struct tagfs_str *tags, size_t ntags) {
     int res, rc;
     sqlite3_stmt *stmt;
+
     rc = sqlite3_prepare_v2(tagfs.db, tagfs_sql_add_tags_to_file, -1, &stmt, NULL);
     if (rc != SQLITE_OK) {
         log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
@@ -132,14 +446,14 @@ int tagfs_add_tags_to_file(const char *path, char **tags, size_t ntags) {
     }
     assert(stmt != NULL);
 
-    rc = sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    rc = sqlite3_bind_text(stmt, 1, path.ptr, (int)path.len, SQLITE_STATIC);
     if (rc != SQLITE_OK) {
         log_err("sqlite3_bind_text: %s\n", sqlite3_errmsg(tagfs.db));
         res = -1;
         goto end;
     }
 
-    rc = sqlite3_carray_bind(stmt, 2, tags, ntags, CARRAY_TEXT, SQLITE_STATIC);
+    rc = sqlite3_carray_bind(stmt, 2, (void *)tags, ntags, CARRAY_TEXTV, SQLITE_STATIC);
     if (rc != SQLITE_OK) {
         log_err("sqlite3_carray_bind: %s\n", sqlite3_errmsg(tagfs.db));
         res = -1;
@@ -160,13 +474,17 @@ end:
         log_err("sqlite3_finalize: %s\n", sqlite3_errmsg(tagfs.db));
         /* it should be fine to still return `res` */
     }
+    if (res == 0)
+        tagfs_index_invalidate();
 
     return res;
 }
 
-int tagfs_create_file(const char *path) {
-    int res, rc;
+int64_t tagfs_create_file(struct tagfs_str path) {
+    int64_t res;
+    int rc;
     sqlite3_stmt *stmt;
+
     rc = sqlite3_prepare_v2(tagfs.db, tagfs_sql_create_file, -1, &stmt, NULL);
     if (rc != SQLITE_OK) {
         log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
@@ -174,7 +492,7 @@ int tagfs_create_file(const char *path) {
     }
     assert(stmt != NULL);
 
-    rc = sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    rc = sqlite3_bind_text(stmt, 1, path.ptr, (int)path.len, SQLITE_STATIC);
     if (rc != SQLITE_OK) {
         log_err("sqlite3_bind_text: %s\n", sqlite3_errmsg(tagfs.db));
         res = -1;
@@ -182,12 +500,12 @@ int tagfs_create_file(const char *path) {
     }
 
     rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
+    if (rc != SQLITE_ROW) {
         log_err("sqlite3_step: %s\n", sqlite3_errmsg(tagfs.db));
         res = -1;
         goto end;
     }
-    res = 0;
+    res = sqlite3_column_int64(stmt, 0);
 
 end:
     rc = sqlite3_finalize(stmt);
@@ -195,13 +513,16 @@ end:
         log_err("sqlite3_finalize: %s\n", sqlite3_errmsg(tagfs.db));
         /* it should be fine to still return `res` */
     }
+    if (res > 0)
+        tagfs_index_invalidate();
 
     return res;
 }
 
-int tagfs_create_tag(char *name) {
+int tagfs_create_tag(struct tagfs_str name) {
     int res, rc;
     sqlite3_stmt *stmt;
+
     rc = sqlite3_prepare_v2(tagfs.db, tagfs_sql_insert_tag, -1, &stmt, NULL);
     if (rc != SQLITE_OK) {
         log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
@@ -209,7 +530,7 @@ int tagfs_create_tag(char *name) {
     }
     assert(stmt != NULL);
 
-    rc = sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    rc = sqlite3_bind_text(stmt, 1, name.ptr, (int)name.len, SQLITE_STATIC);
     if (rc != SQLITE_OK) {
         log_err("sqlite3_bind_text: %s\n", sqlite3_errmsg(tagfs.db));
         res = -1;
@@ -230,6 +551,114 @@ int tagfs_create_tag(char *name) {
         goto end;
     }
 
+end:
+    rc = sqlite3_finalize(stmt);
+    if (rc != SQLITE_OK) {
+        log_err("sqlite3_finalize: %s\n", sqlite3_errmsg(tagfs.db));
+        /* it should be fine to still return `res` */
+    }
+    if (res == 1)
+        tagfs_index_invalidate();
+
+    return res;
+}
+
+void tagfs_fill_stat(struct stat *st, int64_t size, int64_t mtime, int64_t ctime, int64_t mode) {
+    st->st_mode = S_IFREG | (mode & 07777);
+    st->st_nlink = 1;
+    st->st_size = size;
+    st->st_blksize = 4096;
+    st->st_blocks = (size + 511) / 512;
+    st->st_mtim.tv_sec = mtime / 1000000000;
+    st->st_mtim.tv_nsec = mtime % 1000000000;
+    st->st_ctim.tv_sec = ctime / 1000000000;
+    st->st_ctim.tv_nsec = ctime % 1000000000;
+    st->st_atim = st->st_mtim;
+}
+
+int64_t tagfs_get_file_stat(struct tagfs_str name, struct stat *st, int64_t *checked) {
+    int64_t id;
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(tagfs.db, tagfs_sql_get_file_stat, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
+        return -1;
+    }
+    assert(stmt != NULL);
+
+    rc = sqlite3_bind_text(stmt, 1, name.ptr, (int)name.len, SQLITE_STATIC);
+    if (rc != SQLITE_OK) {
+        log_err("sqlite3_bind_text: %s\n", sqlite3_errmsg(tagfs.db));
+        id = -1;
+        goto end;
+    }
+
+    rc = sqlite3_step(stmt);
+    switch (rc) {
+    case SQLITE_DONE:
+        id = 0;
+        break;
+    case SQLITE_ROW:
+        id = sqlite3_column_int64(stmt, 0);
+        if (sqlite3_column_type(stmt, 4) == SQLITE_NULL) {
+            *checked = -1;
+            break;
+        }
+        tagfs_fill_stat(st, sqlite3_column_int64(stmt, 1), sqlite3_column_int64(stmt, 2),
+                        sqlite3_column_int64(stmt, 3), sqlite3_column_int64(stmt, 4));
+        *checked = sqlite3_column_int64(stmt, 5);
+        break;
+    default:
+        log_err("sqlite3_step: %s\n", sqlite3_errmsg(tagfs.db));
+        id = -1;
+        goto end;
+    }
+
+end:
+    rc = sqlite3_finalize(stmt);
+    if (rc != SQLITE_OK) {
+        log_err("sqlite3_finalize: %s\n", sqlite3_errmsg(tagfs.db));
+        /* it should be fine to still return `id` */
+    }
+
+    return id;
+}
+
+int tagfs_set_file_stat(int64_t id, const struct stat *st) {
+    int res, rc;
+    sqlite3_stmt *stmt;
+    rc = sqlite3_prepare_v2(tagfs.db, tagfs_sql_set_file_stat, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
+        return -1;
+    }
+    assert(stmt != NULL);
+
+    int64_t values[] = {
+        st->st_size,
+        st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec,
+        st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec,
+        st->st_mode & 07777,
+        time(NULL),
+        id,
+    };
+    for (int i = 0; i < (int)(sizeof values / sizeof *values); i++) {
+        rc = sqlite3_bind_int64(stmt, i + 1, values[i]);
+        if (rc != SQLITE_OK) {
+            log_err("sqlite3_bind_int64: %s\n", sqlite3_errmsg(tagfs.db));
+            res = -1;
+            goto end;
+        }
+    }
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        log_err("sqlite3_step: %s\n", sqlite3_errmsg(tagfs.db));
+        res = -1;
+        goto end;
+    }
+    res = 0;
+
 end:
     rc = sqlite3_finalize(stmt);
     if (rc != SQLITE_OK) {
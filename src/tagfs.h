@@ -1,20 +1,95 @@
 #pragma once
 
 #include <inttypes.h>
+#include <sys/stat.h>
 #include <sqlite3.h>
 
+#include "utils.h"
+
+enum tagfs_durability {
+    /* every commit and fsync reaches the disk before returning */
+    TAGFS_DURABILITY_STRICT,
+    /* commits and written data reach the disk by batches, see sync.h */
+    TAGFS_DURABILITY_GROUP,
+    /* nothing is synced, for scratch mounts */
+    TAGFS_DURABILITY_RELAXED,
+};
+
 extern struct tagfs {
     char *datadir;
     int datadirfd;
+    char *dbpath;
     sqlite3 *db;
+    /* parsed from the durability option */
+    enum tagfs_durability durability_level;
+    /* CLOCK_MONOTONIC at the start of tagfs_init(), in nanoseconds */
+    uint64_t init_ns;
+    /* for tools, fail instead of creating a missing datadir or database */
+    int nocreate;
+
+    /* options */
+    char *log_level;
+    /* seconds after which cached file attributes are checked again, 0 for never */
+    int stat_timeout;
+    /* unused backing files kept open, 0 for the default, negative for none */
+    int fd_cache;
+    /* do not use nor maintain the tag index snapshot */
+    int noindex;
+    /* entries kept in the change journal, 0 to leave the setting as is */
+    int journal_max;
+    /* where to back up the database, relative to the datadir */
+    char *backup;
+    /* seconds between backups, 0 for none */
+    int backup_interval;
+    /* store new files compressed, see compress.h */
+    int compress;
+    /* decompressed blocks cached, 0 for the default, negative for none */
+    int block_cache;
+    /* strict, group or relaxed, strict if unset */
+    char *durability;
+    /* with group durability, milliseconds and commits between syncs, 0 for the defaults */
+    int sync_ms;
+    int sync_ops;
+    /* do not load the hottest tags in the background after mounting */
+    int noprewarm;
+    /* metadata ops running at once, 0 for the default, negative for no limit */
+    int meta_threads;
+    /* data ops running at once, 0 for no limit */
+    int data_threads;
+    /* workers of the FUSE loop, 0 when nothing caps them */
+    int max_workers;
+    /* a read-only replica of a database written by another mount, see replica.h */
+    int ro;
+    /* milliseconds between checks for changes of replicas, 0 for the default */
+    int refresh_ms;
+    /* KiB of cached listings, 0 for the default, negative for none */
+    int listing_cache;
+    /* KiB buffered per file to gather small writes, see writeback.h, 0 for none */
+    int write_behind;
+    /* milliseconds after which buffered writes are written, 0 for the default */
+    int write_behind_ms;
 } tagfs;
 
 /* missing in carray.h */
 SQLITE_API int sqlite3_carray_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi);
 
-int tagfs_has_file_tags(char *path, char **tags, size_t ntags);
-int64_t tagfs_get_tag(const char *name);
-int64_t tagfs_get_file(const char *name);
-int tagfs_create_file(const char *path);
-int tagfs_add_tags_to_file(const char *path, char **tags, size_t ntags);
-int tagfs_create_tag(char *name);
+/* opens (creating if needed, unless tagfs.nocreate) tagfs.datadir and its database */
+int tagfs_init(void);
+void tagfs_fini(void);
+
+/* returns the id of the file if it has all `tags`, 0 if not, -1 on errors */
+int64_t tagfs_has_file_tags(struct tagfs_str path, const struct tagfs_str *tags, size_t ntags);
+int64_t tagfs_get_tag(struct tagfs_str name);
+int64_t tagfs_get_file(struct tagfs_str name);
+int64_t tagfs_create_file(struct tagfs_str path);
+int tagfs_add_tags_to_file(struct tagfs_str path, const struct tagfs_str *tags, size_t ntags);
+int tagfs_create_tag(struct tagfs_str name);
+
+/*
+ * Attributes of regular files are cached in the files table. `checked`
+ * is set to when they were last read from the backing file, or to -1
+ * if they never were and `st` was left untouched.
+ */
+void tagfs_fill_stat(struct stat *st, int64_t size, int64_t mtime, int64_t ctime, int64_t mode);
+int64_t tagfs_get_file_stat(struct tagfs_str name, struct stat *st, int64_t *checked);
+int tagfs_set_file_stat(int64_t id, const struct stat *st);
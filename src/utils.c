@@ -1,36 +1,96 @@
 #include <assert.h>
+#include <stdalign.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 
 #include "utils.h"
 
-char **tagfs_separate_path(char *path) {
-    size_t slash_count = 0;
-    for (char *s = path; *s != '\0'; s++)
-        if (*s == '/')
-            slash_count++;
+static_assert(sizeof(struct tagfs_str) == sizeof(struct iovec)
+              && offsetof(struct tagfs_str, ptr) == offsetof(struct iovec, iov_base)
+              && offsetof(struct tagfs_str, len) == offsetof(struct iovec, iov_len));
+
+#define ARENA_INLINE 4096
+#define ARENA_CHUNK 65536
+#define ARENA_ALIGN alignof(max_align_t)
+
+struct chunk {
+    struct chunk *next;
+    size_t size;
+    size_t used;
+    alignas(ARENA_ALIGN) unsigned char data[];
+};
+
+/* the inline buffer serves most requests, chunks are only for long paths */
+static _Thread_local struct {
+    alignas(ARENA_ALIGN) unsigned char buf[ARENA_INLINE];
+    size_t used;
+    struct chunk *chunks;
+} arena;
+
+void *tagfs_arena_alloc(size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (ARENA_INLINE - arena.used >= size) {
+        void *p = arena.buf + arena.used;
+        arena.used += size;
+        return p;
+    }
 
-    char **parts = malloc(sizeof *parts * (slash_count + 1));
-    assert(parts != NULL);
+    struct chunk *c = arena.chunks;
+    if (!c || c->size - c->used < size) {
+        size_t csize = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        c = malloc(sizeof *c + csize);
+        if (!c)
+            return NULL;
+        c->size = csize;
+        c->used = 0;
+        c->next = arena.chunks;
+        arena.chunks = c;
+    }
+
+    void *p = c->data + c->used;
+    c->used += size;
+    return p;
+}
 
+void tagfs_arena_reset(void) {
+    arena.used = 0;
+    while (arena.chunks) {
+        struct chunk *next = arena.chunks->next;
+        free(arena.chunks);
+        arena.chunks = next;
+    }
+}
+
+int tagfs_split_path(const char *path, struct tagfs_path *out) {
     assert(path[0] == '/');
-    path[0] = '\0';
-    path++;
+    size_t len = strlen(path);
+    const char *end = path + len;
 
-    int i = 0;
-    for (;;) {
-        if (*path == '\0')
-            break;
+    /* memchr is vectorized by the libc, no need for our own SIMD */
+    size_t slash_count = 0;
+    for (const char *s = path; (s = memchr(s, '/', end - s)) != NULL; s++)
+        slash_count++;
 
-        char *next = strchr(path, '/');
-        parts[i++] = path;
-        if (next == NULL)
-            break;
+    out->parts = tagfs_arena_alloc(sizeof *out->parts * slash_count);
+    if (!out->parts)
+        return -1;
+    out->nparts = 0;
 
-        *next = '\0';
-        path = next + 1;
+    const char *s = path + 1;
+    while (s < end) {
+        const char *next = memchr(s, '/', end - s);
+        if (!next)
+            next = end;
+        if (next > s) {
+            out->parts[out->nparts].ptr = s;
+            out->parts[out->nparts].len = next - s;
+            out->nparts++;
+        }
+        s = next + 1;
     }
-    parts[i] = NULL;
 
-    return parts;
+    return 0;
 }
@@ -1,3 +1,31 @@
 #pragma once
 
-char **tagfs_separate_path(char *path);
+#include <stddef.h>
+
+/*
+ * A slice of a string, not NUL-terminated. Layout-compatible with
+ * struct iovec, so that arrays of it can be bound with CARRAY_TEXTV.
+ */
+struct tagfs_str {
+    const char *ptr;
+    size_t len;
+};
+
+struct tagfs_path {
+    struct tagfs_str *parts;
+    size_t nparts;
+};
+
+/*
+ * Per-thread bump allocator for memory that lives as long as the
+ * current request. Every op resets it before returning.
+ */
+void *tagfs_arena_alloc(size_t size);
+void tagfs_arena_reset(void);
+
+/*
+ * Splits `path` into views of its components, without copying it. The
+ * parts array is allocated in the arena. As it ends the path, the last
+ * part is NUL-terminated.
+ */
+int tagfs_split_path(const char *path, struct tagfs_path *out);
@@ -0,0 +1,393 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "compress.h"
+#include "log.h"
+#include "sync.h"
+#include "tagfs.h"
+#include "writeback.h"
+
+#define WRITE_BEHIND_MS_DEFAULT 50
+
+struct tagfs_writeback {
+    pthread_mutex_t lock;
+    /* allocated on first use, freed once idle */
+    char *buf;
+    off_t off;
+    size_t len;
+    /* CLOCK_MONOTONIC time the buffer got its first byte */
+    uint64_t since;
+    /* of a write in the background, returned by the next flush */
+    int err;
+    /* in the queue of the thread, which holds a reference */
+    int queued;
+};
+
+static atomic_bool running;
+static atomic_bool stopping;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+/* files with something buffered */
+static struct tagfs_file **files;
+static size_t nfiles, capfiles;
+
+static size_t capacity(void) {
+    return (size_t)tagfs.write_behind * 1024;
+}
+
+static int write_behind_ms(void) {
+    return tagfs.write_behind_ms > 0 ? tagfs.write_behind_ms : WRITE_BEHIND_MS_DEFAULT;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* pwritev until everything is written, returns 0 or -errno */
+static int write_all(int fd, struct iovec *iov, int n, off_t off) {
+    while (n > 0) {
+        ssize_t w = pwritev(fd, iov, n, off);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0) {
+            int e = w < 0 ? errno : EIO;
+            log_err("pwritev: %s\n", strerror(e));
+            return -e;
+        }
+
+        off += w;
+        for (; n > 0 && (size_t)w >= iov->iov_len; iov++, n--)
+            w -= iov->iov_len;
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Writes the buffer then `size` bytes of `data` following it, in one
+ * pwritev for plain files, and empties the buffer. Returns 0 or -errno.
+ */
+static int write_out(struct tagfs_file *f, struct tagfs_writeback *wb,
+                     const char *data, size_t size) {
+    int res = 0;
+
+    if (f->compressed) {
+        ssize_t w = 0;
+        if (wb->len)
+            w = tagfs_compress_write(f, wb->buf, wb->len, wb->off);
+        if (w >= 0 && size)
+            w = tagfs_compress_write(f, data, size, wb->off + (off_t)wb->len);
+        if (w < 0)
+            res = w;
+    } else {
+        struct iovec iov[2];
+        int n = 0;
+        if (wb->len)
+            iov[n++] = (struct iovec){ wb->buf, wb->len };
+        if (size)
+            iov[n++] = (struct iovec){ (void *)data, size };
+        res = write_all(f->fd, iov, n, wb->off);
+    }
+
+    /* dropped on errors too, like the page cache does */
+    wb->len = 0;
+    return res;
+}
+
+static int flush_locked(struct tagfs_file *f, struct tagfs_writeback *wb,
+                        const char *data, size_t size) {
+    if (!wb->len && !size)
+        return 0;
+
+    int res = write_out(f, wb, data, size);
+    if (res == 0) {
+        tagfs_file_touch(f);
+        tagfs_sync_add(f);
+    }
+    return res;
+}
+
+/* has the thread flush the buffer if it is not written before, returns -1 if it cannot */
+static int enqueue(struct tagfs_file *f, struct tagfs_writeback *wb) {
+    if (wb->queued)
+        return 0;
+    if (!running)
+        return -1;
+
+    pthread_mutex_lock(&lock);
+    if (nfiles == capfiles) {
+        size_t cap = capfiles ? capfiles * 2 : 64;
+        struct tagfs_file **p = realloc(files, cap * sizeof *files);
+        if (!p) {
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+        files = p;
+        capfiles = cap;
+    }
+    tagfs_file_ref(f);
+    files[nfiles++] = f;
+    pthread_mutex_unlock(&lock);
+    wb->queued = 1;
+    return 0;
+}
+
+/* appends to the buffer, which must be empty or overlap or touch [offset, offset + size) */
+static int buffer(struct tagfs_file *f, struct tagfs_writeback *wb,
+                  const char *data, size_t size, off_t offset) {
+    size_t cap = capacity();
+
+    if (!wb->len) {
+        wb->off = offset;
+        wb->since = now_ns();
+    }
+    /* buffers end at multiples of their size, so the following ones are aligned */
+    off_t limit = (wb->off / (off_t)cap + 1) * (off_t)cap;
+
+    size_t n = offset + (off_t)size <= limit ? size : (size_t)(limit - offset);
+    memcpy(wb->buf + (offset - wb->off), data, n);
+    if ((size_t)(offset - wb->off) + n > wb->len)
+        wb->len = (offset - wb->off) + n;
+
+    if (wb->off + (off_t)wb->len == limit) {
+        int res = flush_locked(f, wb, NULL, 0);
+        if (res < 0)
+            return res;
+    }
+    if (n < size) {
+        /* the rest, shorter than a buffer, starts the next one */
+        wb->off = limit;
+        wb->since = now_ns();
+        memcpy(wb->buf, data + n, size - n);
+        wb->len = size - n;
+    }
+
+    if (wb->len && enqueue(f, wb) < 0)
+        return flush_locked(f, wb, NULL, 0);
+    return 0;
+}
+
+ssize_t tagfs_writeback_write(struct tagfs_file *f, const char *data, size_t size, off_t offset) {
+    struct tagfs_writeback *wb = f->wb;
+    size_t cap = capacity();
+    int res;
+
+    pthread_mutex_lock(&wb->lock);
+    if (wb->err) {
+        res = wb->err;
+        wb->err = 0;
+        goto end;
+    }
+
+    off_t end = wb->off + (off_t)wb->len;
+    int touches = !wb->len || (offset >= wb->off && offset <= end);
+
+    if (size >= cap) {
+        /* large enough already, gathered with the buffer when it follows it */
+        if (wb->len && offset == end && !f->compressed) {
+            res = flush_locked(f, wb, data, size);
+        } else {
+            res = flush_locked(f, wb, NULL, 0);
+            if (res == 0)
+                res = flush_locked(f, &(struct tagfs_writeback){ .off = offset }, data, size);
+        }
+        goto end;
+    }
+
+    if (!wb->buf) {
+        wb->buf = malloc(cap);
+        if (!wb->buf) {
+            res = flush_locked(f, &(struct tagfs_writeback){ .off = offset }, data, size);
+            goto end;
+        }
+    }
+
+    if (!touches) {
+        res = flush_locked(f, wb, NULL, 0);
+        if (res < 0)
+            goto end;
+    }
+    res = buffer(f, wb, data, size, offset);
+
+end:
+    pthread_mutex_unlock(&wb->lock);
+    return res < 0 ? res : (ssize_t)size;
+}
+
+int tagfs_writeback_flush(struct tagfs_file *f) {
+    struct tagfs_writeback *wb = f->wb;
+    if (!wb)
+        return 0;
+
+    pthread_mutex_lock(&wb->lock);
+    int res = flush_locked(f, wb, NULL, 0);
+    if (res == 0 && wb->err)
+        res = wb->err;
+    wb->err = 0;
+    pthread_mutex_unlock(&wb->lock);
+    return res;
+}
+
+int tagfs_writeback_flush_range(struct tagfs_file *f, off_t offset, size_t size) {
+    struct tagfs_writeback *wb = f->wb;
+    int res = 0;
+    if (!wb)
+        return 0;
+
+    pthread_mutex_lock(&wb->lock);
+    if (wb->len && offset < wb->off + (off_t)wb->len
+        && (offset >= wb->off || (uint64_t)(wb->off - offset) < size)) {
+        res = flush_locked(f, wb, NULL, 0);
+        /* for the next flush or fsync too */
+        if (res < 0)
+            wb->err = res;
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return res;
+}
+
+int tagfs_writeback_init(struct tagfs_file *f) {
+    if (tagfs.ro || tagfs.write_behind <= 0)
+        return 0;
+
+    f->wb = calloc(1, sizeof *f->wb);
+    if (!f->wb) {
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_mutex_init(&f->wb->lock, NULL);
+    return 0;
+}
+
+void tagfs_writeback_free(struct tagfs_file *f) {
+    struct tagfs_writeback *wb = f->wb;
+    if (!wb)
+        return;
+
+    /* buffers hold a reference, so there should be none left by now */
+    int res = wb->len ? write_out(f, wb, NULL, 0) : 0;
+    if (res == 0)
+        tagfs_file_touch(f);
+    if (res == 0)
+        res = wb->err;
+    if (res < 0)
+        log_err("data written to file %" PRId64 " lost: %s\n", f->id, strerror(-res));
+
+    pthread_mutex_destroy(&wb->lock);
+    free(wb->buf);
+    free(wb);
+    f->wb = NULL;
+}
+
+/* returns non-zero if stopping */
+static int wait_tick(void) {
+    int ms = write_behind_ms();
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&lock);
+    while (!stopping && pthread_cond_timedwait(&cond, &lock, &ts) != ETIMEDOUT)
+        ;
+    pthread_mutex_unlock(&lock);
+    return stopping;
+}
+
+/* flushes the buffers older than the interval, or all of them */
+static void tick(int all) {
+    struct tagfs_file **batch;
+    size_t n;
+
+    pthread_mutex_lock(&lock);
+    batch = files;
+    n = nfiles;
+    files = NULL;
+    nfiles = capfiles = 0;
+    pthread_mutex_unlock(&lock);
+
+    uint64_t old = now_ns() - (uint64_t)write_behind_ms() * 1000000;
+    for (size_t i = 0; i < n; i++) {
+        struct tagfs_file *f = batch[i];
+        struct tagfs_writeback *wb = f->wb;
+
+        pthread_mutex_lock(&wb->lock);
+        if (!all && wb->len && wb->since > old) {
+            /* still being written to, our reference moves to the new queue */
+            wb->queued = 0;
+            if (enqueue(f, wb) == 0) {
+                pthread_mutex_unlock(&wb->lock);
+                tagfs_file_put(f);
+                continue;
+            }
+        }
+        int res = flush_locked(f, wb, NULL, 0);
+        if (res < 0)
+            wb->err = res;
+        wb->queued = 0;
+        /* not written to for a while, give the memory back */
+        free(wb->buf);
+        wb->buf = NULL;
+        pthread_mutex_unlock(&wb->lock);
+        tagfs_file_put(f);
+    }
+    free(batch);
+}
+
+static void *writeback_main(void *arg) {
+    (void)arg;
+
+    int last;
+    do {
+        last = wait_tick();
+        tick(last);
+    } while (!last);
+
+    return NULL;
+}
+
+int tagfs_writeback_start(void) {
+    if (tagfs.ro || tagfs.write_behind <= 0 || running)
+        return 0;
+
+    stopping = 0;
+    running = 1;
+    if (pthread_create(&thread, NULL, writeback_main, NULL) != 0) {
+        running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void tagfs_writeback_stop(void) {
+    if (!atomic_exchange(&running, 0))
+        return;
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+
+    /* buffered while the thread was stopping */
+    tick(1);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include "file.h"
+
+/*
+ * Write-behind, when tagfs.write_behind is set. Files are opened with
+ * direct_io, so every write of an application reaches us on its own.
+ * Small writes following each other are gathered in a buffer of
+ * tagfs.write_behind KiB per backing file, written with a single pwritev
+ * once full or once a write does not follow them. A thread writes
+ * buffers older than tagfs.write_behind_ms.
+ *
+ * Buffers are written before anything reading or changing the backing
+ * file otherwise: reads of the ranges they cover or extend, flush,
+ * fsync, release, truncate and friends. An error writing a buffer in the background is
+ * returned by the next of these.
+ */
+int tagfs_writeback_start(void);
+void tagfs_writeback_stop(void);
+
+/* on opening and closing a backing file, init fails with ENOMEM */
+int tagfs_writeback_init(struct tagfs_file *f);
+void tagfs_writeback_free(struct tagfs_file *f);
+
+/* like pwrite, buffering small writes, returns the size or -errno */
+ssize_t tagfs_writeback_write(struct tagfs_file *f, const char *buf, size_t size, off_t offset);
+/* writes the buffer, returns 0 or -errno */
+int tagfs_writeback_flush(struct tagfs_file *f);
+/* writes the buffer if it overlaps [offset, offset + size), SIZE_MAX for up to the end */
+int tagfs_writeback_flush_range(struct tagfs_file *f, off_t offset, size_t size);
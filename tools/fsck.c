@@ -0,0 +1,634 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "compress.h"
+#include "log.h"
+#include "sql_queries.h"
+#include "tagfs.h"
+
+#define CHUNK 16384
+#define DB_CHUNK 65536
+#define DENTS_SIZE (1 << 20)
+#define LOST_FOUND "lost+found"
+
+/* exit statuses, as fsck(8) */
+#define FSCK_OK 0
+#define FSCK_CORRECTED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* of the stat, only what the checks look at */
+struct entry {
+    const char *name;
+    off_t size;
+    struct timespec mtim;
+    mode_t mode;
+    int err;
+};
+
+/* names of the datadir, read in order, then stat'ed and sorted by a worker */
+struct chunk {
+    struct chunk *next;
+    size_t n;
+    struct entry entries[CHUNK];
+    /* packed, NUL-terminated */
+    char *names;
+    size_t len, cap;
+};
+
+enum kind {
+    KIND_MISSING,
+    KIND_ORPHAN,
+    KIND_STALE,
+    KIND_IRREGULAR,
+    KIND_TEMPORARY,
+    KIND_UNTAGGED,
+    KIND_DANGLING,
+    KIND_COUNT,
+};
+
+static const char *kind_names[] = {
+    [KIND_MISSING] = "missing",
+    [KIND_ORPHAN] = "orphan",
+    [KIND_STALE] = "stale",
+    [KIND_IRREGULAR] = "irregular",
+    [KIND_TEMPORARY] = "temporary",
+    [KIND_UNTAGGED] = "untagged",
+    [KIND_DANGLING] = "dangling",
+};
+
+static struct {
+    int repair;
+    int verbose;
+    long nworkers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* waiting for a worker */
+    struct chunk *todo;
+    int reading;
+    /* all chunks, in no particular order */
+    struct chunk *chunks;
+    size_t nchunks;
+
+    uint64_t found[KIND_COUNT];
+    uint64_t repaired[KIND_COUNT];
+    int errors;
+} fsck;
+
+/* adopted once the merge is done, so as not to disturb it */
+static struct {
+    struct entry **entries;
+    size_t n, cap;
+} orphans;
+
+/* stat of a name in the datadir, with the size of compressed files */
+static int stat_entry(const char *name, struct stat *st) {
+    if (fstatat(tagfs.datadirfd, name, st, AT_SYMLINK_NOFOLLOW) < 0
+        || tagfs_compress_stat_at(tagfs.datadirfd, name, st) < 0)
+        return -1;
+    return 0;
+}
+
+/* for the attributes to cache, entries only keep some of them */
+static int set_file_stat(int64_t fid, const struct entry *e) {
+    struct stat st;
+    if (stat_entry(e->name, &st) < 0) {
+        log_err("stat %s: %s\n", e->name, strerror(errno));
+        return -1;
+    }
+    return tagfs_set_file_stat(fid, &st);
+}
+
+static int cmp_entry(const void *a, const void *b) {
+    return strcmp(((const struct entry *)a)->name, ((const struct entry *)b)->name);
+}
+
+static void *worker_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&fsck.lock);
+    for (;;) {
+        while (!fsck.todo && fsck.reading)
+            pthread_cond_wait(&fsck.cond, &fsck.lock);
+        struct chunk *c = fsck.todo;
+        if (!c)
+            break;
+        fsck.todo = c->next;
+        pthread_mutex_unlock(&fsck.lock);
+
+        for (size_t i = 0; i < c->n; i++) {
+            struct entry *e = &c->entries[i];
+            struct stat st;
+            if (stat_entry(e->name, &st) < 0) {
+                e->err = errno;
+                continue;
+            }
+            e->size = st.st_size;
+            e->mtim = st.st_mtim;
+            e->mode = st.st_mode;
+        }
+        qsort(c->entries, c->n, sizeof *c->entries, cmp_entry);
+
+        pthread_mutex_lock(&fsck.lock);
+        c->next = fsck.chunks;
+        fsck.chunks = c;
+        fsck.nchunks++;
+    }
+    pthread_mutex_unlock(&fsck.lock);
+
+    return NULL;
+}
+
+static void push_chunk(struct chunk *c) {
+    /* names were offsets while the buffer could move */
+    for (size_t i = 0; i < c->n; i++)
+        c->entries[i].name = c->names + (uintptr_t)c->entries[i].name;
+
+    pthread_mutex_lock(&fsck.lock);
+    c->next = fsck.todo;
+    fsck.todo = c;
+    pthread_cond_signal(&fsck.cond);
+    pthread_mutex_unlock(&fsck.lock);
+}
+
+/* internal files of yatagfs, which are never in the files table */
+static int is_internal(const char *name) {
+    return strncmp(name, ".yatagfs.", 9) == 0;
+}
+
+static int is_temporary(const char *name) {
+    return strncmp(name, ".yatagfs-import-", 16) == 0;
+}
+
+static int read_datadir(void) {
+    int fd = openat(tagfs.datadirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        log_err("open datadir: %s\n", strerror(errno));
+        return -1;
+    }
+
+    char *buf = malloc(DENTS_SIZE);
+    assert(buf != NULL);
+    struct chunk *c = NULL;
+    int res = 0;
+
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, buf, DENTS_SIZE);
+        if (n < 0) {
+            log_err("getdents64: %s\n", strerror(errno));
+            res = -1;
+            break;
+        }
+        if (n == 0)
+            break;
+
+        for (long off = 0; off < n;) {
+            struct linux_dirent64 *d = (void *)(buf + off);
+            off += d->d_reclen;
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0
+                || is_internal(d->d_name))
+                continue;
+
+            if (!c) {
+                c = calloc(1, sizeof *c);
+                assert(c != NULL);
+            }
+            size_t namelen = strlen(d->d_name) + 1;
+            if (c->len + namelen > c->cap) {
+                c->cap = c->cap ? c->cap * 2 : 1 << 16;
+                c->names = realloc(c->names, c->cap);
+                assert(c->names != NULL);
+            }
+            memcpy(c->names + c->len, d->d_name, namelen);
+            c->entries[c->n++] = (struct entry){ .name = (const char *)(uintptr_t)c->len };
+            c->len += namelen;
+            if (c->n == CHUNK) {
+                push_chunk(c);
+                c = NULL;
+            }
+        }
+    }
+    if (c)
+        push_chunk(c);
+
+    free(buf);
+    close(fd);
+    return res;
+}
+
+static void report(enum kind kind, const char *name) {
+    fsck.found[kind]++;
+    if (kind != KIND_UNTAGGED || fsck.verbose)
+        printf("%s\t%s\n", kind_names[kind], name);
+}
+
+static int step_done(sqlite3_stmt *stmt) {
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (rc != SQLITE_DONE) {
+        log_err("sqlite3_step: %s\n", sqlite3_errmsg(tagfs.db));
+        return -1;
+    }
+    return 0;
+}
+
+static void check_file(const struct entry *e, sqlite3_stmt *db) {
+    if (e->err) {
+        log_err("stat %s: %s\n", e->name, strerror(e->err));
+        fsck.errors++;
+        return;
+    }
+    if (!S_ISREG(e->mode)) {
+        report(KIND_IRREGULAR, e->name);
+        return;
+    }
+    if (!sqlite3_column_int(db, 4))
+        report(KIND_UNTAGGED, e->name);
+
+    /* cached attributes, see tagfs_set_file_stat() */
+    if (sqlite3_column_type(db, 3) == SQLITE_NULL)
+        return;
+    int64_t mtime = e->mtim.tv_sec * 1000000000 + e->mtim.tv_nsec;
+    if (sqlite3_column_int64(db, 2) == e->size && sqlite3_column_int64(db, 3) == mtime)
+        return;
+
+    report(KIND_STALE, e->name);
+    if (fsck.repair && set_file_stat(sqlite3_column_int64(db, 0), e) == 0)
+        fsck.repaired[KIND_STALE]++;
+}
+
+static void check_missing(sqlite3_stmt *db, sqlite3_stmt *delete) {
+    report(KIND_MISSING, (const char *)sqlite3_column_text(db, 1));
+    if (!fsck.repair)
+        return;
+
+    sqlite3_bind_int64(delete, 1, sqlite3_column_int64(db, 0));
+    if (step_done(delete) == 0)
+        fsck.repaired[KIND_MISSING]++;
+}
+
+static void check_orphan(struct entry *e) {
+    if (is_temporary(e->name)) {
+        report(KIND_TEMPORARY, e->name);
+        if (fsck.repair && unlinkat(tagfs.datadirfd, e->name, 0) == 0)
+            fsck.repaired[KIND_TEMPORARY]++;
+        return;
+    }
+
+    if (!e->err && !S_ISREG(e->mode)) {
+        report(KIND_IRREGULAR, e->name);
+        return;
+    }
+
+    report(KIND_ORPHAN, e->name);
+    if (!fsck.repair || e->err)
+        return;
+    if (orphans.n == orphans.cap) {
+        orphans.cap = orphans.cap ? orphans.cap * 2 : 1024;
+        orphans.entries = realloc(orphans.entries, orphans.cap * sizeof *orphans.entries);
+        assert(orphans.entries != NULL);
+    }
+    orphans.entries[orphans.n++] = e;
+}
+
+/* heap of chunk cursors, by their current name */
+struct cursor {
+    struct chunk *c;
+    size_t i;
+};
+
+static const char *cursor_name(const struct cursor *c) {
+    return c->c->entries[c->i].name;
+}
+
+static void sift_down(struct cursor *heap, size_t n, size_t i) {
+    for (;;) {
+        size_t m = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && strcmp(cursor_name(&heap[l]), cursor_name(&heap[m])) < 0)
+            m = l;
+        if (r < n && strcmp(cursor_name(&heap[r]), cursor_name(&heap[m])) < 0)
+            m = r;
+        if (m == i)
+            return;
+        struct cursor t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+/* merge-joins the sorted chunks with the files table, sorted the same way */
+static int merge(void) {
+    sqlite3_stmt *db = NULL, *delete = NULL;
+    struct cursor *heap = calloc(fsck.nchunks + 1, sizeof *heap);
+    size_t nheap = 0;
+    int res = -1, rc;
+    char *last = strdup("");
+    assert(heap != NULL && last != NULL);
+
+    for (struct chunk *c = fsck.chunks; c; c = c->next)
+        if (c->n > 0)
+            heap[nheap++] = (struct cursor){ c, 0 };
+    for (size_t i = nheap; i-- > 0;)
+        sift_down(heap, nheap, i);
+
+    if (sqlite3_prepare_v2(tagfs.db, tagfs_sql_get_fsck_files, -1, &db, NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(tagfs.db, tagfs_sql_delete_file, -1, &delete, NULL) != SQLITE_OK) {
+        log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
+        goto end;
+    }
+
+    /* the table is read in pages after the last path seen */
+    size_t page = 0;
+    sqlite3_bind_text(db, 1, last, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(db, 2, DB_CHUNK);
+    rc = sqlite3_step(db);
+    for (;;) {
+        if (rc == SQLITE_DONE && page == DB_CHUNK) {
+            sqlite3_reset(db);
+            sqlite3_bind_text(db, 1, last, -1, SQLITE_TRANSIENT);
+            page = 0;
+            rc = sqlite3_step(db);
+        }
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+            log_err("sqlite3_step: %s\n", sqlite3_errmsg(tagfs.db));
+            goto end;
+        }
+        if (rc == SQLITE_DONE && nheap == 0)
+            break;
+
+        int c;
+        if (rc == SQLITE_DONE)
+            c = 1;
+        else if (nheap == 0)
+            c = -1;
+        else
+            c = strcmp((const char *)sqlite3_column_text(db, 1), cursor_name(&heap[0]));
+
+        if (c <= 0) {
+            if (c == 0)
+                check_file(&heap[0].c->entries[heap[0].i], db);
+            else
+                check_missing(db, delete);
+            free(last);
+            last = strdup((const char *)sqlite3_column_text(db, 1));
+            assert(last != NULL);
+            page++;
+            rc = sqlite3_step(db);
+        } else {
+            check_orphan(&heap[0].c->entries[heap[0].i]);
+        }
+
+        if (c >= 0) {
+            if (++heap[0].i == heap[0].c->n)
+                heap[0] = heap[--nheap];
+            sift_down(heap, nheap, 0);
+        }
+    }
+    res = 0;
+
+end:
+    sqlite3_finalize(db);
+    sqlite3_finalize(delete);
+    free(heap);
+    free(last);
+    return res;
+}
+
+/*
+ * Renames `name`, the name of a tag, to the first free "<name>.<n>", in
+ * `buf`. Returns 0, 1 if none is free, or -1.
+ */
+static int rename_orphan(const char *name, char *buf) {
+    for (unsigned n = 1; n < 1000; n++) {
+        snprintf(buf, NAME_MAX + 1, "%.*s.%u", NAME_MAX - 4, name, n);
+        struct tagfs_str s = { buf, strlen(buf) };
+        int64_t id = tagfs_get_tag(s);
+        if (!id)
+            id = tagfs_get_file(s);
+        if (id < 0)
+            return -1;
+        if (id || faccessat(tagfs.datadirfd, buf, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
+            continue;
+        if (renameat(tagfs.datadirfd, name, tagfs.datadirfd, buf) < 0) {
+            log_err("rename %s: %s\n", name, strerror(errno));
+            return -1;
+        }
+        log_warn("%s: name of a tag, adopted as %s\n", name, buf);
+        return 0;
+    }
+    log_warn("%s: name of a tag, not adopted\n", name);
+    return 1;
+}
+
+static int adopt_orphans(void) {
+    struct tagfs_str lost = { LOST_FOUND, sizeof LOST_FOUND - 1 };
+
+    if (orphans.n == 0)
+        return 0;
+
+    int64_t tid = tagfs_get_tag(lost);
+    if (tid < 0)
+        return -1;
+    if (!tid && tagfs_create_tag(lost) < 0)
+        return -1;
+
+    for (size_t i = 0; i < orphans.n; i++) {
+        struct entry *e = orphans.entries[i];
+        struct tagfs_str name = { e->name, strlen(e->name) };
+
+        tid = tagfs_get_tag(name);
+        if (tid < 0)
+            return -1;
+        /* a crash lost its creation, and the removal of the tag before */
+        struct entry renamed = *e;
+        char buf[NAME_MAX + 1];
+        if (tid) {
+            renamed.name = buf;
+            int rc = rename_orphan(e->name, buf);
+            if (rc < 0)
+                return -1;
+            if (rc)
+                continue;
+            name = (struct tagfs_str){ buf, strlen(buf) };
+        }
+
+        int64_t fid = tagfs_create_file(name);
+        if (fid < 0 || tagfs_add_tags_to_file(name, &lost, 1) < 0
+            || set_file_stat(fid, &renamed) < 0)
+            return -1;
+        fsck.repaired[KIND_ORPHAN]++;
+    }
+    return 0;
+}
+
+/*
+ * Rows of files_tags left by deletions, foreign keys are not enforced.
+ * Called again once missing files are dropped, to clean up after them.
+ */
+static int check_dangling(int count) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(tagfs.db, tagfs_sql_delete_dangling_files_tags, -1, &stmt, NULL) != SQLITE_OK) {
+        log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
+        return -1;
+    }
+    int res = step_done(stmt);
+    sqlite3_finalize(stmt);
+    if (res < 0)
+        return -1;
+
+    int n = sqlite3_changes(tagfs.db);
+    if (!count)
+        return 0;
+    fsck.found[KIND_DANGLING] += n;
+    if (n) {
+        printf("%s\t%d rows of files_tags\n", kind_names[KIND_DANGLING], n);
+        if (fsck.repair)
+            fsck.repaired[KIND_DANGLING] += n;
+    }
+    return 0;
+}
+
+static void usage(const char *argv0) {
+    printf("usage: %s [options] datadir\n"
+           "\n"
+           "Checks that the files table of datadir and the files in it match, and\n"
+           "prints one line per problem. The datadir must not be mounted.\n"
+           "\n"
+           "    -r          repair: drop missing files from the database, adopt\n"
+           "                orphaned files under the " LOST_FOUND " tag, update stale\n"
+           "                cached attributes and remove leftovers of imports\n"
+           "    -j N        number of worker threads (number of CPUs)\n"
+           "    -v          also list untagged files\n"
+           "    -h          print help\n"
+           "\n"
+           "Exits with 0 if everything is fine, 1 if problems were repaired, 4 if\n"
+           "some were left and 8 on errors.\n",
+           argv0);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+
+    fuse_set_log_func(log_fuse);
+    fsck.nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "rj:vh")) != -1) {
+        switch (opt) {
+        case 'r': fsck.repair = 1; break;
+        case 'j': fsck.nworkers = strtol(optarg, NULL, 0); break;
+        case 'v': fsck.verbose = 1; break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return FSCK_ERROR;
+        }
+    }
+    if (argc - optind != 1 || fsck.nworkers < 1) {
+        usage(argv[0]);
+        return FSCK_ERROR;
+    }
+
+    tagfs.datadir = strdup(argv[optind]);
+    assert(tagfs.datadir != NULL);
+    tagfs.noindex = 1;
+    tagfs.nocreate = 1;
+    if (tagfs_init() < 0)
+        return FSCK_ERROR;
+
+    pthread_mutex_init(&fsck.lock, NULL);
+    pthread_cond_init(&fsck.cond, NULL);
+    fsck.reading = 1;
+
+    pthread_t *workers = calloc(fsck.nworkers, sizeof *workers);
+    assert(workers != NULL);
+    for (long i = 0; i < fsck.nworkers; i++) {
+        int rc = pthread_create(&workers[i], NULL, worker_main, NULL);
+        assert(rc == 0);
+    }
+
+    int rc = read_datadir();
+
+    pthread_mutex_lock(&fsck.lock);
+    fsck.reading = 0;
+    pthread_cond_broadcast(&fsck.cond);
+    pthread_mutex_unlock(&fsck.lock);
+    for (long i = 0; i < fsck.nworkers; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    if (rc < 0)
+        return FSCK_ERROR;
+
+    /* a single transaction, for consistency and speed */
+    if (sqlite3_exec(tagfs.db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+        log_err("BEGIN: %s\n", sqlite3_errmsg(tagfs.db));
+        return FSCK_ERROR;
+    }
+    rc = check_dangling(1);
+    if (rc == 0)
+        rc = merge();
+    if (rc == 0 && fsck.repair)
+        rc = adopt_orphans();
+    if (rc == 0 && fsck.repair)
+        rc = check_dangling(0);
+    if (rc < 0 || fsck.errors) {
+        sqlite3_exec(tagfs.db, "ROLLBACK", NULL, NULL, NULL);
+        return FSCK_ERROR;
+    }
+    if (sqlite3_exec(tagfs.db, fsck.repair ? "COMMIT" : "ROLLBACK", NULL, NULL, NULL) != SQLITE_OK) {
+        log_err("COMMIT: %s\n", sqlite3_errmsg(tagfs.db));
+        return FSCK_ERROR;
+    }
+
+    int status = FSCK_OK;
+    for (int k = 0; k < KIND_COUNT; k++) {
+        if (k == KIND_UNTAGGED)
+            continue;
+        if (fsck.repaired[k])
+            status |= FSCK_CORRECTED;
+        if (fsck.repaired[k] < fsck.found[k])
+            status |= FSCK_UNCORRECTED;
+    }
+    log_notice("%" PRIu64 " missing, %" PRIu64 " orphaned, %" PRIu64 " stale, %" PRIu64
+               " irregular, %" PRIu64 " temporary, %" PRIu64 " untagged, %" PRIu64 " dangling%s\n",
+               fsck.found[KIND_MISSING], fsck.found[KIND_ORPHAN], fsck.found[KIND_STALE],
+               fsck.found[KIND_IRREGULAR], fsck.found[KIND_TEMPORARY], fsck.found[KIND_UNTAGGED],
+               fsck.found[KIND_DANGLING], fsck.repair ? " (repaired what could be)" : "");
+
+    for (struct chunk *c = fsck.chunks, *next; c; c = next) {
+        next = c->next;
+        free(c->names);
+        free(c);
+    }
+    free(orphans.entries);
+    tagfs_fini();
+    return status;
+}
@@ -0,0 +1,798 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+#include "carray.h"
+
+#include "log.h"
+#include "sql_queries.h"
+#include "tagfs.h"
+
+enum place_mode {
+    PLACE_COPY,
+    PLACE_LINK,
+};
+
+/* a directory left to walk, relative to the source root */
+struct dir_job {
+    struct dir_job *next;
+    char *relpath;
+};
+
+/* a file whose data is in the datadir, waiting for its metadata */
+struct record {
+    struct record *next;
+    char *source;
+    char *name;
+    char **tags;
+    size_t ntags;
+    /* identity of the source, to tell its data from another's */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    /* the datadir entry was already there, maybe from a previous run */
+    int existed;
+    /* the name was claimed by another file of this run, nothing was placed */
+    int taken;
+};
+
+#define CLAIM_BUCKETS 4096
+
+/* a name placed by this run, until its record is written */
+struct claim {
+    struct claim *next;
+    char name[];
+};
+
+static struct {
+    int srcfd;
+    enum place_mode mode;
+    size_t batch;
+
+    pthread_mutex_t lock;
+    pthread_cond_t dirs_cond;
+    pthread_cond_t records_cond;
+    pthread_cond_t space_cond;
+
+    struct dir_job *dirs;
+    unsigned busy_walkers;
+    int walk_done;
+
+    struct record *records_head, **records_tail;
+    size_t nrecords;
+
+    pthread_t *walkers;
+    long nwalkers;
+
+    pthread_mutex_t claims_lock;
+    struct claim *claims[CLAIM_BUCKETS];
+
+    atomic_uint_fast64_t placed, bytes, skipped, conflicts, errors, imported;
+} imp;
+
+static void push_dir(char *relpath) {
+    struct dir_job *job = malloc(sizeof *job);
+    assert(job != NULL);
+    job->relpath = relpath;
+
+    pthread_mutex_lock(&imp.lock);
+    job->next = imp.dirs;
+    imp.dirs = job;
+    pthread_cond_signal(&imp.dirs_cond);
+    pthread_mutex_unlock(&imp.lock);
+}
+
+static struct dir_job *pop_dir(void) {
+    struct dir_job *job = NULL;
+
+    pthread_mutex_lock(&imp.lock);
+    imp.busy_walkers--;
+    while (!imp.dirs && imp.busy_walkers > 0)
+        pthread_cond_wait(&imp.dirs_cond, &imp.lock);
+    if (imp.dirs) {
+        job = imp.dirs;
+        imp.dirs = job->next;
+        imp.busy_walkers++;
+    } else {
+        /* nobody is walking and nothing is queued, we are done */
+        pthread_cond_broadcast(&imp.dirs_cond);
+    }
+    pthread_mutex_unlock(&imp.lock);
+
+    return job;
+}
+
+static void push_record(struct record *r) {
+    pthread_mutex_lock(&imp.lock);
+    /* backpressure, so that walkers don't outrun the database */
+    while (imp.nrecords >= imp.batch * 4)
+        pthread_cond_wait(&imp.space_cond, &imp.lock);
+    r->next = NULL;
+    *imp.records_tail = r;
+    imp.records_tail = &r->next;
+    imp.nrecords++;
+    pthread_cond_signal(&imp.records_cond);
+    pthread_mutex_unlock(&imp.lock);
+}
+
+static void free_record(struct record *r) {
+    for (size_t i = 0; i < r->ntags; i++)
+        free(r->tags[i]);
+    free(r->tags);
+    free(r->name);
+    free(r->source);
+    free(r);
+}
+
+static struct claim **claim_slot(const char *name) {
+    uint64_t h = 0xcbf29ce484222325u;
+    for (const char *s = name; *s; s++)
+        h = (h ^ (unsigned char)*s) * 0x100000001b3u;
+    struct claim **p = &imp.claims[(h >> 32) % CLAIM_BUCKETS];
+    while (*p && strcmp((*p)->name, name) != 0)
+        p = &(*p)->next;
+    return p;
+}
+
+/*
+ * Walkers claim a name before placing a file under it, so that of two
+ * sources with the same name in this run, only the first one is placed.
+ * Returns 0 if another walker has it.
+ */
+static int claim(const char *name) {
+    size_t len = strlen(name);
+    struct claim *c = malloc(sizeof *c + len + 1);
+    assert(c != NULL);
+    memcpy(c->name, name, len + 1);
+
+    pthread_mutex_lock(&imp.claims_lock);
+    struct claim **p = claim_slot(name);
+    int res = *p == NULL;
+    if (res) {
+        c->next = NULL;
+        *p = c;
+    }
+    pthread_mutex_unlock(&imp.claims_lock);
+
+    if (!res)
+        free(c);
+    return res;
+}
+
+/* once the record is written, the database tells who has the name */
+static void unclaim(const char *name) {
+    pthread_mutex_lock(&imp.claims_lock);
+    struct claim **p = claim_slot(name);
+    struct claim *c = *p;
+    if (c)
+        *p = c->next;
+    pthread_mutex_unlock(&imp.claims_lock);
+    free(c);
+}
+
+/* tags of a file are the distinct components of its directory */
+static void record_set_tags(struct record *r, const char *reldir) {
+    size_t n = 1;
+    for (const char *s = reldir; *s; s++)
+        if (*s == '/')
+            n++;
+    r->tags = calloc(n, sizeof *r->tags);
+    assert(r->tags != NULL);
+    r->ntags = 0;
+
+    const char *s = reldir;
+    while (*s) {
+        const char *e = strchrnul(s, '/');
+        size_t len = e - s;
+        size_t i;
+        for (i = 0; i < r->ntags; i++)
+            if (strlen(r->tags[i]) == len && memcmp(r->tags[i], s, len) == 0)
+                break;
+        if (i == r->ntags && len > 0) {
+            r->tags[r->ntags] = strndup(s, len);
+            assert(r->tags[r->ntags] != NULL);
+            r->ntags++;
+        }
+        s = *e ? e + 1 : e;
+    }
+}
+
+static int copy_data(int in, int out, off_t size) {
+    if (ioctl(out, FICLONE, in) == 0)
+        return 0;
+
+    off_t done = 0;
+    while (done < size) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, size - done, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)
+                break;
+            log_err("copy_file_range: %s\n", strerror(errno));
+            return -1;
+        }
+        if (n == 0)
+            return 0;
+        done += n;
+    }
+
+    /* fallback, continuing from where copy_file_range stopped */
+    char buf[1 << 16];
+    for (;;) {
+        ssize_t r = read(in, buf, sizeof buf);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            log_err("read: %s\n", strerror(errno));
+            return -1;
+        }
+        if (r == 0)
+            return 0;
+        for (ssize_t w = 0; w < r;) {
+            ssize_t n = write(out, buf + w, r - w);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                log_err("write: %s\n", strerror(errno));
+                return -1;
+            }
+            w += n;
+        }
+    }
+}
+
+/*
+ * Puts the data of `relpath` at `name` in the datadir. Returns 1 if it was
+ * placed, 0 if `name` already existed and -1 on error.
+ */
+static int place_file(const char *relpath, const char *name, const struct stat *st,
+                      const char *tmpname) {
+    struct stat existing;
+    /* don't copy again what a previous run already placed */
+    if (fstatat(tagfs.datadirfd, name, &existing, AT_SYMLINK_NOFOLLOW) == 0)
+        return 0;
+
+    if (imp.mode == PLACE_LINK) {
+        if (linkat(imp.srcfd, relpath, tagfs.datadirfd, name, 0) == 0)
+            return 1;
+        if (errno == EEXIST)
+            return 0;
+        if (errno != EXDEV && errno != EPERM && errno != EMLINK) {
+            log_err("linkat %s: %s\n", relpath, strerror(errno));
+            return -1;
+        }
+        /* different filesystem, fall back to copying */
+    }
+
+    int in = openat(imp.srcfd, relpath, O_RDONLY | O_NOFOLLOW);
+    if (in < 0) {
+        log_err("openat %s: %s\n", relpath, strerror(errno));
+        return -1;
+    }
+
+    int out = openat(tagfs.datadirfd, tmpname, O_WRONLY | O_CREAT | O_TRUNC, st->st_mode & 0777);
+    if (out < 0) {
+        log_err("openat %s: %s\n", tmpname, strerror(errno));
+        close(in);
+        return -1;
+    }
+
+    int rc = copy_data(in, out, st->st_size);
+    close(in);
+    if (rc == 0) {
+        struct timespec times[2] = { st->st_atim, st->st_mtim };
+        futimens(out, times);
+    }
+    if (close(out) < 0 && rc == 0) {
+        log_err("close: %s\n", strerror(errno));
+        rc = -1;
+    }
+    if (rc < 0)
+        goto err;
+
+    /* the final name only ever appears with complete data */
+    if (renameat2(tagfs.datadirfd, tmpname, tagfs.datadirfd, name, RENAME_NOREPLACE) == 0)
+        return 1;
+    if (errno == EEXIST) {
+        unlinkat(tagfs.datadirfd, tmpname, 0);
+        return 0;
+    }
+    log_err("renameat2 %s: %s\n", name, strerror(errno));
+
+err:
+    unlinkat(tagfs.datadirfd, tmpname, 0);
+    return -1;
+}
+
+static void walk_dir(const char *relpath, const char *tmpname) {
+    int fd = openat(imp.srcfd, relpath, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd < 0) {
+        log_err("openat %s: %s\n", relpath, strerror(errno));
+        imp.errors++;
+        return;
+    }
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        log_err("fdopendir %s: %s\n", relpath, strerror(errno));
+        close(fd);
+        imp.errors++;
+        return;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        char *child;
+        if (strcmp(relpath, ".") == 0)
+            child = strdup(de->d_name);
+        else if (asprintf(&child, "%s/%s", relpath, de->d_name) < 0)
+            child = NULL;
+        assert(child != NULL);
+
+        struct stat st;
+        if (fstatat(imp.srcfd, child, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            log_err("fstatat %s: %s\n", child, strerror(errno));
+            imp.errors++;
+            free(child);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            push_dir(child);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || de->d_name[0] == '.') {
+            /* only regular files, and nothing that could clash with .yatagfs* */
+            imp.skipped++;
+            free(child);
+            continue;
+        }
+
+        /* if taken, the source may still have been imported by a previous run */
+        int taken = !claim(de->d_name);
+        int rc = taken ? 0 : place_file(child, de->d_name, &st, tmpname);
+        if (rc < 0) {
+            unclaim(de->d_name);
+            imp.errors++;
+            free(child);
+            continue;
+        }
+        if (rc > 0) {
+            imp.placed++;
+            imp.bytes += st.st_size;
+        }
+
+        struct record *r = calloc(1, sizeof *r);
+        assert(r != NULL);
+        r->source = child;
+        r->name = strdup(de->d_name);
+        assert(r->name != NULL);
+        record_set_tags(r, strcmp(relpath, ".") == 0 ? "" : relpath);
+        r->dev = st.st_dev;
+        r->ino = st.st_ino;
+        r->size = st.st_size;
+        r->mtime = st.st_mtim;
+        r->existed = rc == 0;
+        r->taken = taken;
+        push_record(r);
+    }
+
+    closedir(dir);
+}
+
+static void *walker_main(void *arg) {
+    char tmpname[64];
+    snprintf(tmpname, sizeof tmpname, ".yatagfs-import-%ld-%u",
+             (long)getpid(), (unsigned)(uintptr_t)arg);
+
+    struct dir_job *job;
+    while ((job = pop_dir()) != NULL) {
+        walk_dir(job->relpath, tmpname);
+        free(job->relpath);
+        free(job);
+    }
+
+    return NULL;
+}
+
+enum {
+    STMT_GET_IMPORT,
+    STMT_GET_FILE,
+    STMT_GET_TAG,
+    STMT_INSERT_TAGS,
+    STMT_CREATE_FILE,
+    STMT_ADD_TAGS,
+    STMT_INSERT_IMPORT,
+    STMT_COUNT,
+};
+
+static sqlite3_stmt *stmts[STMT_COUNT];
+
+static int prepare_stmts(void) {
+    const char *sql[STMT_COUNT] = {
+        [STMT_GET_IMPORT] = tagfs_sql_get_import,
+        [STMT_GET_FILE] = tagfs_sql_get_file,
+        [STMT_GET_TAG] = tagfs_sql_get_tag,
+        [STMT_INSERT_TAGS] = tagfs_sql_insert_tags,
+        [STMT_CREATE_FILE] = tagfs_sql_create_file,
+        [STMT_ADD_TAGS] = tagfs_sql_add_tags_to_file,
+        [STMT_INSERT_IMPORT] = tagfs_sql_insert_import,
+    };
+    for (int i = 0; i < STMT_COUNT; i++) {
+        int rc = sqlite3_prepare_v3(tagfs.db, sql[i], -1, SQLITE_PREPARE_PERSISTENT, &stmts[i], NULL);
+        if (rc != SQLITE_OK) {
+            log_err("sqlite3_prepare_v3: %s\n", sqlite3_errmsg(tagfs.db));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* steps a statement expected to return at most one integer, 0 if no row */
+static int64_t step_id(sqlite3_stmt *stmt) {
+    int64_t id;
+    int rc = sqlite3_step(stmt);
+    switch (rc) {
+    case SQLITE_DONE:
+        id = 0;
+        break;
+    case SQLITE_ROW:
+        id = sqlite3_column_int64(stmt, 0);
+        break;
+    default:
+        log_err("sqlite3_step: %s\n", sqlite3_errmsg(tagfs.db));
+        id = -1;
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return id;
+}
+
+static int64_t lookup(int which, const char *text) {
+    sqlite3_bind_text(stmts[which], 1, text, -1, SQLITE_STATIC);
+    return step_id(stmts[which]);
+}
+
+static int64_t mtime_ns(const struct timespec *ts) {
+    return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/*
+ * 1 if the source was imported already and has not changed since, 0 if
+ * it was not, 2 if it has changed, -1 on errors.
+ */
+static int get_import(const struct record *r) {
+    sqlite3_stmt *stmt = stmts[STMT_GET_IMPORT];
+    int res;
+
+    sqlite3_bind_text(stmt, 1, r->source, -1, SQLITE_STATIC);
+    switch (sqlite3_step(stmt)) {
+    case SQLITE_DONE:
+        res = 0;
+        break;
+    case SQLITE_ROW:
+        res = (dev_t)sqlite3_column_int64(stmt, 1) == r->dev
+            && (ino_t)sqlite3_column_int64(stmt, 2) == r->ino
+            && sqlite3_column_int64(stmt, 3) == r->size
+            && sqlite3_column_int64(stmt, 4) == mtime_ns(&r->mtime) ? 1 : 2;
+        break;
+    default:
+        log_err("sqlite3_step: %s\n", sqlite3_errmsg(tagfs.db));
+        res = -1;
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return res;
+}
+
+/*
+ * Whether the datadir entry of a record holds the data of its source,
+ * placed by an interrupted run: the same inode when hardlinked, the same
+ * size and mtime, which copies get before their final name, otherwise.
+ */
+static int placed_from_source(const struct record *r) {
+    struct stat st;
+    if (fstatat(tagfs.datadirfd, r->name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        return 0;
+    if (st.st_dev == r->dev && st.st_ino == r->ino)
+        return 1;
+    return st.st_size == r->size && mtime_ns(&st.st_mtim) == mtime_ns(&r->mtime);
+}
+
+/* 1 if imported, 0 if skipped or conflicting, -1 on database errors */
+static int import_record(struct record *r) {
+    int64_t id;
+
+    if (r->existed) {
+        int rc = get_import(r);
+        if (rc < 0)
+            return -1;
+        if (rc == 1) {
+            imp.skipped++;
+            return 0;
+        }
+        if (rc == 2) {
+            log_warn("%s: changed since it was imported, skipped\n", r->source);
+            imp.conflicts++;
+            return 0;
+        }
+        if (r->taken) {
+            log_warn("%s: name conflicts with another file of this import, skipped\n", r->source);
+            imp.conflicts++;
+            return 0;
+        }
+    }
+
+    id = lookup(STMT_GET_FILE, r->name);
+    if (id < 0)
+        return -1;
+    if (id)
+        goto conflict;
+
+    /* left over from an interrupted run, or another file with that name */
+    if (r->existed && !placed_from_source(r))
+        goto conflict;
+
+    id = lookup(STMT_GET_TAG, r->name);
+    if (id < 0)
+        return -1;
+    if (id)
+        goto conflict;
+    for (size_t i = 0; i < r->ntags; i++) {
+        id = lookup(STMT_GET_FILE, r->tags[i]);
+        if (id < 0)
+            return -1;
+        if (id)
+            goto conflict;
+    }
+
+    if (r->ntags > 0) {
+        sqlite3_carray_bind(stmts[STMT_INSERT_TAGS], 1, r->tags, r->ntags, CARRAY_TEXT, SQLITE_STATIC);
+        if (step_id(stmts[STMT_INSERT_TAGS]) < 0)
+            return -1;
+    }
+
+    sqlite3_bind_text(stmts[STMT_CREATE_FILE], 1, r->name, -1, SQLITE_STATIC);
+    int64_t fid = step_id(stmts[STMT_CREATE_FILE]);
+    if (fid <= 0)
+        return -1;
+
+    if (r->ntags > 0) {
+        sqlite3_bind_text(stmts[STMT_ADD_TAGS], 1, r->name, -1, SQLITE_STATIC);
+        sqlite3_carray_bind(stmts[STMT_ADD_TAGS], 2, r->tags, r->ntags, CARRAY_TEXT, SQLITE_STATIC);
+        if (step_id(stmts[STMT_ADD_TAGS]) < 0)
+            return -1;
+    }
+
+    sqlite3_bind_text(stmts[STMT_INSERT_IMPORT], 1, r->source, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmts[STMT_INSERT_IMPORT], 2, fid);
+    sqlite3_bind_int64(stmts[STMT_INSERT_IMPORT], 3, r->dev);
+    sqlite3_bind_int64(stmts[STMT_INSERT_IMPORT], 4, r->ino);
+    sqlite3_bind_int64(stmts[STMT_INSERT_IMPORT], 5, r->size);
+    sqlite3_bind_int64(stmts[STMT_INSERT_IMPORT], 6, mtime_ns(&r->mtime));
+    if (step_id(stmts[STMT_INSERT_IMPORT]) < 0)
+        return -1;
+
+    imp.imported++;
+    return 1;
+
+conflict:
+    log_warn("%s: name conflicts with an existing file or tag, skipped\n", r->source);
+    if (!r->existed)
+        unlinkat(tagfs.datadirfd, r->name, 0);
+    imp.conflicts++;
+    return 0;
+}
+
+static void report_progress(uint64_t start, int final) {
+    double secs = (double)(time(NULL) - start);
+    if (secs <= 0)
+        secs = 1;
+    log_log(final ? FUSE_LOG_NOTICE : FUSE_LOG_INFO, NULL, -1,
+            "%" PRIu64 " imported (%.1f/s), %" PRIu64 " copied (%" PRIu64 " MiB), "
+            "%" PRIu64 " skipped, %" PRIu64 " conflicts, %" PRIu64 " errors\n",
+            (uint64_t)imp.imported, imp.imported / secs, (uint64_t)imp.placed,
+            (uint64_t)imp.bytes >> 20, (uint64_t)imp.skipped,
+            (uint64_t)imp.conflicts, (uint64_t)imp.errors);
+}
+
+/* single database writer, committing every `imp.batch` records or every second */
+static int write_records(void) {
+    int in_txn = 0, res = 0;
+    size_t pending = 0;
+    time_t start = time(NULL), last_report = start;
+
+    pthread_mutex_lock(&imp.lock);
+    for (;;) {
+        while (!imp.records_head && !imp.walk_done) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            if (pthread_cond_timedwait(&imp.records_cond, &imp.lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+
+        struct record *r = imp.records_head;
+        if (r) {
+            imp.records_head = r->next;
+            if (!imp.records_head)
+                imp.records_tail = &imp.records_head;
+            imp.nrecords--;
+            pthread_cond_signal(&imp.space_cond);
+        }
+        int done = !r && imp.walk_done;
+        pthread_mutex_unlock(&imp.lock);
+
+        if (r) {
+            if (!in_txn) {
+                if (sqlite3_exec(tagfs.db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+                    log_err("BEGIN: %s\n", sqlite3_errmsg(tagfs.db));
+                    res = -1;
+                }
+                in_txn = 1;
+            }
+            if (res == 0 && import_record(r) < 0)
+                res = -1;
+            if (!r->taken)
+                unclaim(r->name);
+            free_record(r);
+            pending++;
+        }
+
+        time_t now = time(NULL);
+        if (in_txn && (pending >= imp.batch || !r || now != last_report)) {
+            const char *end = res == 0 ? "COMMIT" : "ROLLBACK";
+            if (sqlite3_exec(tagfs.db, end, NULL, NULL, NULL) != SQLITE_OK) {
+                log_err("%s: %s\n", end, sqlite3_errmsg(tagfs.db));
+                res = -1;
+            }
+            in_txn = 0;
+            pending = 0;
+        }
+        if (now != last_report) {
+            report_progress(start, 0);
+            last_report = now;
+        }
+
+        if (done || res < 0)
+            break;
+        pthread_mutex_lock(&imp.lock);
+    }
+
+    report_progress(start, 1);
+    return res;
+}
+
+/* the writer runs on the main thread, this flags the end of the walk */
+static void *join_walkers(void *arg) {
+    (void)arg;
+
+    for (long i = 0; i < imp.nwalkers; i++)
+        pthread_join(imp.walkers[i], NULL);
+
+    pthread_mutex_lock(&imp.lock);
+    imp.walk_done = 1;
+    pthread_cond_signal(&imp.records_cond);
+    pthread_mutex_unlock(&imp.lock);
+
+    return NULL;
+}
+
+static void usage(const char *argv0) {
+    printf("usage: %s [options] srcdir datadir\n"
+           "\n"
+           "Imports every regular file under srcdir into datadir, tagging each\n"
+           "file with the names of the directories containing it.\n"
+           "\n"
+           "    -j N        number of walker threads (number of CPUs)\n"
+           "    -b N        files per transaction (10000)\n"
+           "    -l          hardlink files instead of copying them when possible\n"
+           "    -h          print help\n"
+           "\n"
+           "Data is reflinked when the filesystem supports it, otherwise copied\n"
+           "with copy_file_range. An interrupted import can be resumed by running\n"
+           "the same command again.\n",
+           argv0);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+
+    fuse_set_log_func(log_fuse);
+    imp.nwalkers = sysconf(_SC_NPROCESSORS_ONLN);
+    imp.batch = 10000;
+    imp.mode = PLACE_COPY;
+
+    while ((opt = getopt(argc, argv, "j:b:lh")) != -1) {
+        switch (opt) {
+        case 'j': imp.nwalkers = strtol(optarg, NULL, 0); break;
+        case 'b': imp.batch = strtoull(optarg, NULL, 0); break;
+        case 'l': imp.mode = PLACE_LINK; break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2 || imp.nwalkers < 1 || imp.batch == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    imp.srcfd = open(argv[optind], O_RDONLY | O_DIRECTORY);
+    if (imp.srcfd < 0)
+        log_fatal("open %s: %s\n", argv[optind], strerror(errno));
+
+    tagfs.datadir = strdup(argv[optind + 1]);
+    assert(tagfs.datadir != NULL);
+    if (tagfs_init() < 0)
+        return 1;
+
+    char *errormsg;
+    if (sqlite3_exec(tagfs.db, tagfs_sql_create_import_tables, NULL, NULL, &errormsg) != SQLITE_OK) {
+        log_err("cannot create tables: %s\n", errormsg);
+        sqlite3_free(errormsg);
+        return 1;
+    }
+    if (prepare_stmts() < 0)
+        return 1;
+
+    pthread_mutex_init(&imp.lock, NULL);
+    pthread_mutex_init(&imp.claims_lock, NULL);
+    pthread_cond_init(&imp.dirs_cond, NULL);
+    pthread_cond_init(&imp.records_cond, NULL);
+    pthread_cond_init(&imp.space_cond, NULL);
+    imp.records_tail = &imp.records_head;
+    imp.busy_walkers = imp.nwalkers;
+
+    char *root = strdup(".");
+    assert(root != NULL);
+    push_dir(root);
+
+    imp.walkers = calloc(imp.nwalkers, sizeof *imp.walkers);
+    assert(imp.walkers != NULL);
+    for (long i = 0; i < imp.nwalkers; i++) {
+        int rc = pthread_create(&imp.walkers[i], NULL, walker_main, (void *)(uintptr_t)i);
+        assert(rc == 0);
+    }
+
+    pthread_t joiner;
+    pthread_create(&joiner, NULL, join_walkers, NULL);
+
+    int res = write_records();
+    if (res < 0) {
+        log_err("import aborted, run again to resume\n");
+        exit(1);
+    }
+    pthread_join(joiner, NULL);
+    free(imp.walkers);
+
+    for (int i = 0; i < STMT_COUNT; i++)
+        sqlite3_finalize(stmts[i]);
+    tagfs_fini();
+    close(imp.srcfd);
+
+    return imp.errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "log.h"
+#include "sql_queries.h"
+#include "tagfs.h"
+
+/* entries read by each transaction */
+#define BATCH 1024
+
+static void print_string(const char *key, const unsigned char *s) {
+    printf(",\"%s\":\"", key);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if (*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+/* at most `limit` entries after `*since`, which is advanced, returns how many or -1 */
+static int64_t print_entries(sqlite3_stmt *stmt, int64_t *since, int64_t limit) {
+    static const char *keys[] = { "seq", "time", "op", "file_id", "file", "tag_id", "tag" };
+    int64_t n = 0;
+    int rc;
+
+    sqlite3_bind_int64(stmt, 1, *since);
+    sqlite3_bind_int64(stmt, 2, limit);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        *since = sqlite3_column_int64(stmt, 0);
+        n++;
+        printf("{\"seq\":%" PRId64, *since);
+        for (int i = 1; i < (int)(sizeof keys / sizeof *keys); i++) {
+            switch (sqlite3_column_type(stmt, i)) {
+            case SQLITE_NULL:
+                break;
+            case SQLITE_INTEGER:
+                printf(",\"%s\":%" PRId64, keys[i], (int64_t)sqlite3_column_int64(stmt, i));
+                break;
+            default:
+                print_string(keys[i], sqlite3_column_text(stmt, i));
+            }
+        }
+        printf("}\n");
+    }
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_DONE) {
+        log_err("sqlite3_step: %s\n", sqlite3_errmsg(tagfs.db));
+        return -1;
+    }
+    return n;
+}
+
+/* the first seq still in the journal, entries before it were pruned */
+static int64_t oldest_seq(void) {
+    sqlite3_stmt *stmt;
+    int64_t seq = -1;
+
+    if (sqlite3_prepare_v2(tagfs.db, tagfs_sql_get_journal_bounds, -1, &stmt, NULL) != SQLITE_OK) {
+        log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
+        return -1;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+            seq = sqlite3_column_int64(stmt, 0);
+        else
+            seq = sqlite3_column_int64(stmt, 1) + 1;
+    } else {
+        log_err("sqlite3_step: %s\n", sqlite3_errmsg(tagfs.db));
+    }
+    sqlite3_finalize(stmt);
+    return seq;
+}
+
+static void usage(const char *argv0) {
+    printf("usage: %s [options] datadir [since=SEQ]\n"
+           "\n"
+           "Prints the changes made to the files and tags of datadir after\n"
+           "sequence number SEQ (0), one JSON object per line.\n"
+           "\n"
+           "    -f          keep printing new changes as they happen\n"
+           "    -n N        print at most N changes (all)\n"
+           "    -h          print help\n"
+           "\n"
+           "Exits with status 3 if changes after SEQ were already dropped by the\n"
+           "retention policy (see the journal_max mount option); a full rescan is\n"
+           "then needed.\n",
+           argv0);
+}
+
+int main(int argc, char **argv) {
+    int64_t since = 0, limit = -1;
+    int follow = 0, opt;
+
+    fuse_set_log_func(log_fuse);
+
+    while ((opt = getopt(argc, argv, "fn:h")) != -1) {
+        switch (opt) {
+        case 'f': follow = 1; break;
+        case 'n': limit = strtoll(optarg, NULL, 0); break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 1 || argc - optind > 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (argc - optind == 2) {
+        char *end;
+        if (strncmp(argv[optind + 1], "since=", 6) != 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        since = strtoll(argv[optind + 1] + 6, &end, 0);
+        if (*end != '\0' || since < 0) {
+            log_err("invalid sequence number: %s\n", argv[optind + 1] + 6);
+            return 1;
+        }
+    }
+
+    tagfs.datadir = strdup(argv[optind]);
+    assert(tagfs.datadir != NULL);
+    tagfs.noindex = 1;
+    tagfs.nocreate = 1;
+    if (tagfs_init() < 0)
+        return 1;
+
+    int res = 0;
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(tagfs.db, tagfs_sql_get_journal, -1, &stmt, NULL) != SQLITE_OK) {
+        log_err("sqlite3_prepare_v2: %s\n", sqlite3_errmsg(tagfs.db));
+        res = 1;
+        goto end;
+    }
+
+    for (;;) {
+        /*
+         * one read transaction, so that nothing is dropped between the
+         * check and the read, of at most BATCH entries to keep it short
+         */
+        if (sqlite3_exec(tagfs.db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+            log_err("BEGIN: %s\n", sqlite3_errmsg(tagfs.db));
+            res = 1;
+            break;
+        }
+        /* also catches readers following too slowly */
+        int64_t oldest = oldest_seq();
+        int64_t n = 0;
+        if (oldest >= 0 && since + 1 >= oldest)
+            n = print_entries(stmt, &since, limit >= 0 && limit < BATCH ? limit : BATCH);
+        sqlite3_exec(tagfs.db, "COMMIT", NULL, NULL, NULL);
+        if (oldest < 0 || n < 0) {
+            res = 1;
+            break;
+        }
+        if (since + 1 < oldest) {
+            log_err("changes %" PRId64 " to %" PRId64 " were dropped\n", since + 1, oldest - 1);
+            res = 3;
+            break;
+        }
+
+        fflush(stdout);
+        if (limit >= 0 && (limit -= n) == 0)
+            break;
+        /* more may be waiting */
+        if (n == BATCH)
+            continue;
+        if (!follow)
+            break;
+        if (n == 0)
+            sleep(1);
+    }
+
+end:
+    sqlite3_finalize(stmt);
+    tagfs_fini();
+    return res;
+}